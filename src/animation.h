@@ -4,6 +4,19 @@
 #include "utils.h"
 #include "format.h"
 
+#define ANIM_MAX_JOINTS 64
+
+// joint angles are 10-bit fixed point (2 * PI / 1024), so sin & cos of the half angles
+// for euler to quaternion conversion are taken from the table
+struct JointAngleTable {
+    float s[1024], c[1024];
+
+    JointAngleTable() {
+        for (int i = 0; i < 1024; i++)
+            sincos(i * (PI / 1024.0f), &s[i], &c[i]);
+    }
+} jointAngleTable;
+
 struct Animation {
     TR::Level       *level;
     const TR::Model *model;
@@ -14,6 +27,7 @@ struct Animation {
     int             frameIndex, framePrev, framesCount;
 
     TR::AnimFrame   *frameA, *frameB;
+    const short4    *storeA, *storeB; // decoded joint rotations of the frames or NULL
     vec3            offset, jump;
     float           rot;
     bool            isEnded, isPrepareToNext;
@@ -22,7 +36,7 @@ struct Animation {
     quat            *overrides;   // left & right arms animation frames
     int             overrideMask;
 
-    Animation() : overrides(NULL) {}
+    Animation() : level(NULL), model(NULL), overrides(NULL) {}
 
     Animation(TR::Level *level, const TR::Model *model, bool smooth = true) : level(level), model(NULL), smooth(smooth), overrides(NULL), overrideMask(0) {
         setModel(model);
@@ -105,6 +119,14 @@ struct Animation {
         return (TR::AnimFrame*)&level->frameData[anim->frameOffset / 2 + index * frameSize]; // >> 1 (div 2) because frameData is array of shorts
     }
 
+    const short4* getFrameStore(TR::Animation *anim, int index) {
+    #ifdef ANIM_FRAME_STORE
+        return level->getAnimFrameRots(int(anim - level->anims), index, model->mCount);
+    #else
+        return NULL;
+    #endif
+    }
+
     void goEnd(bool lerpToNext = true) {
         setAnim(index, -(framesCount - 1), lerpToNext);
     }
@@ -129,6 +151,7 @@ struct Animation {
             fIndexB = (fIndex + 1) % fCount;
 
         frameA = getFrame(anim, fIndexA);
+        storeA = getFrameStore(anim, fIndexA);
  
         int frameNext = frameIndex + 1;
         isPrepareToNext = !fIndexB;
@@ -141,10 +164,13 @@ struct Animation {
 
         getCommand(anim, frameNext, NULL, NULL, &rot);
 
-        if (smooth)
+        if (smooth) {
             frameB = getFrame(anim, fIndexB);
-        else
+            storeB = getFrameStore(anim, fIndexB);
+        } else {
             frameB = frameA;
+            storeB = storeA;
+        }
     }
 
     bool isFrameActive(int index) {
@@ -247,12 +273,180 @@ struct Animation {
         }
     }
 
+    static quat getStoreRot(const short4 &r) {
+        return quat(float(r.x), float(r.y), float(r.z), float(r.w)) * (1.0f / 32767.0f);
+    }
+
     quat getJointRot(int joint) {
+        if (storeA && storeB)
+            return getStoreRot(storeA[joint]).lerp(getStoreRot(storeB[joint]), delta);
         return lerpAngle(frameA->getAngle(level->version, joint), frameB->getAngle(level->version, joint), delta);
     }
 
+    static quat getJointRotYXZ(const uint16 *xyz) {
+        const JointAngleTable &T = jointAngleTable;
+        float sx = T.s[xyz[0]], cx = T.c[xyz[0]];
+        float sy = T.s[xyz[1]], cy = T.c[xyz[1]];
+        float sz = T.s[xyz[2]], cz = T.c[xyz[2]];
+    // qy * qx
+        float x = cy * sx, y = sy * cx, z = -sy * sx, w = cy * cx;
+    // * qz
+        return quat(x * cz + y * sz, y * cz - x * sz, w * sz + z * cz, w * cz - z * sz);
+    }
+
+    // euler YXZ angles (10-bit fixed point) to quaternions
+    static void decodeRots(const uint16 *xyz, int count, quat *rot) {
+        int i = 0;
+
+    #if defined(USE_SSE2) || defined(USE_NEON)
+        const JointAngleTable &T = jointAngleTable;
+
+        for (; i + 4 <= count; i += 4, xyz += 12) {
+            float tmp[6][4]; // sx cx sy cy sz cz, joint
+
+            for (int j = 0; j < 4; j++)
+                for (int k = 0; k < 3; k++) {
+                    tmp[k * 2 + 0][j] = T.s[xyz[j * 3 + k]];
+                    tmp[k * 2 + 1][j] = T.c[xyz[j * 3 + k]];
+                }
+
+        #if defined(USE_SSE2)
+            __m128 sx = _mm_loadu_ps(tmp[0]), cx = _mm_loadu_ps(tmp[1]);
+            __m128 sy = _mm_loadu_ps(tmp[2]), cy = _mm_loadu_ps(tmp[3]);
+            __m128 sz = _mm_loadu_ps(tmp[4]), cz = _mm_loadu_ps(tmp[5]);
+
+            __m128 x = _mm_mul_ps(cy, sx);
+            __m128 y = _mm_mul_ps(sy, cx);
+            __m128 z = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(sy, sx));
+            __m128 w = _mm_mul_ps(cy, cx);
+
+            __m128 r0 = _mm_add_ps(_mm_mul_ps(x, cz), _mm_mul_ps(y, sz));
+            __m128 r1 = _mm_sub_ps(_mm_mul_ps(y, cz), _mm_mul_ps(x, sz));
+            __m128 r2 = _mm_add_ps(_mm_mul_ps(w, sz), _mm_mul_ps(z, cz));
+            __m128 r3 = _mm_sub_ps(_mm_mul_ps(w, cz), _mm_mul_ps(z, sz));
+
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            _mm_storeu_ps((float*)&rot[i + 0], r0);
+            _mm_storeu_ps((float*)&rot[i + 1], r1);
+            _mm_storeu_ps((float*)&rot[i + 2], r2);
+            _mm_storeu_ps((float*)&rot[i + 3], r3);
+        #else
+            float32x4_t sx = vld1q_f32(tmp[0]), cx = vld1q_f32(tmp[1]);
+            float32x4_t sy = vld1q_f32(tmp[2]), cy = vld1q_f32(tmp[3]);
+            float32x4_t sz = vld1q_f32(tmp[4]), cz = vld1q_f32(tmp[5]);
+
+            float32x4_t x = vmulq_f32(cy, sx);
+            float32x4_t y = vmulq_f32(sy, cx);
+            float32x4_t z = vnegq_f32(vmulq_f32(sy, sx));
+            float32x4_t w = vmulq_f32(cy, cx);
+
+            float32x4x4_t r;
+            r.val[0] = vmlaq_f32(vmulq_f32(x, cz), y, sz);
+            r.val[1] = vmlsq_f32(vmulq_f32(y, cz), x, sz);
+            r.val[2] = vmlaq_f32(vmulq_f32(w, sz), z, cz);
+            r.val[3] = vmlsq_f32(vmulq_f32(w, cz), z, sz);
+
+            vst4q_f32((float*)&rot[i], r); // interleave to x, y, z, w
+        #endif
+        }
+    #endif
+
+        for (; i < count; i++, xyz += 3)
+            rot[i] = getJointRotYXZ(xyz);
+    }
+
+    // normalized lerp by the shortest path
+    static void lerpRots(const quat *a, const quat *b, float t, int count, quat *rot) {
+        int i = 0;
+
+    #if defined(USE_SSE2)
+        const __m128 vt   = _mm_set1_ps(t);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 neg  = _mm_set1_ps(-0.0f);
+
+        for (; i + 4 <= count; i += 4) {
+            __m128 a0 = _mm_loadu_ps((float*)&a[i + 0]), a1 = _mm_loadu_ps((float*)&a[i + 1]);
+            __m128 a2 = _mm_loadu_ps((float*)&a[i + 2]), a3 = _mm_loadu_ps((float*)&a[i + 3]);
+            __m128 b0 = _mm_loadu_ps((float*)&b[i + 0]), b1 = _mm_loadu_ps((float*)&b[i + 1]);
+            __m128 b2 = _mm_loadu_ps((float*)&b[i + 2]), b3 = _mm_loadu_ps((float*)&b[i + 3]);
+            _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+            _MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a0, b0), _mm_mul_ps(a1, b1)),
+                                  _mm_add_ps(_mm_mul_ps(a2, b2), _mm_mul_ps(a3, b3)));
+            __m128 sign = _mm_and_ps(_mm_cmplt_ps(d, zero), neg);
+
+            __m128 r0 = _mm_add_ps(a0, _mm_mul_ps(_mm_sub_ps(_mm_xor_ps(b0, sign), a0), vt));
+            __m128 r1 = _mm_add_ps(a1, _mm_mul_ps(_mm_sub_ps(_mm_xor_ps(b1, sign), a1), vt));
+            __m128 r2 = _mm_add_ps(a2, _mm_mul_ps(_mm_sub_ps(_mm_xor_ps(b2, sign), a2), vt));
+            __m128 r3 = _mm_add_ps(a3, _mm_mul_ps(_mm_sub_ps(_mm_xor_ps(b3, sign), a3), vt));
+
+            __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r0, r0), _mm_mul_ps(r1, r1)),
+                                                _mm_add_ps(_mm_mul_ps(r2, r2), _mm_mul_ps(r3, r3))));
+            __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), len);
+            r0 = _mm_mul_ps(r0, inv);
+            r1 = _mm_mul_ps(r1, inv);
+            r2 = _mm_mul_ps(r2, inv);
+            r3 = _mm_mul_ps(r3, inv);
+
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            _mm_storeu_ps((float*)&rot[i + 0], r0);
+            _mm_storeu_ps((float*)&rot[i + 1], r1);
+            _mm_storeu_ps((float*)&rot[i + 2], r2);
+            _mm_storeu_ps((float*)&rot[i + 3], r3);
+        }
+    #elif defined(USE_NEON)
+        const uint32x4_t neg = vdupq_n_u32(0x80000000);
+
+        for (; i + 4 <= count; i += 4) {
+            float32x4x4_t qa = vld4q_f32((const float*)&a[i]); // deinterleave to x, y, z, w
+            float32x4x4_t qb = vld4q_f32((const float*)&b[i]);
+
+            float32x4_t d = vmulq_f32(qa.val[0], qb.val[0]);
+            d = vmlaq_f32(d, qa.val[1], qb.val[1]);
+            d = vmlaq_f32(d, qa.val[2], qb.val[2]);
+            d = vmlaq_f32(d, qa.val[3], qb.val[3]);
+            uint32x4_t sign = vandq_u32(vcltq_f32(d, vdupq_n_f32(0.0f)), neg);
+
+            float32x4x4_t r;
+            for (int k = 0; k < 4; k++) {
+                float32x4_t nb = vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(qb.val[k]), sign));
+                r.val[k] = vmlaq_n_f32(qa.val[k], vsubq_f32(nb, qa.val[k]), t);
+            }
+
+            float32x4_t len2 = vmulq_f32(r.val[0], r.val[0]);
+            len2 = vmlaq_f32(len2, r.val[1], r.val[1]);
+            len2 = vmlaq_f32(len2, r.val[2], r.val[2]);
+            len2 = vmlaq_f32(len2, r.val[3], r.val[3]);
+            float32x4_t inv = vrsqrteq_f32(len2);
+            inv = vmulq_f32(inv, vrsqrtsq_f32(vmulq_f32(len2, inv), inv)); // Newton-Raphson steps
+            inv = vmulq_f32(inv, vrsqrtsq_f32(vmulq_f32(len2, inv), inv));
+            for (int k = 0; k < 4; k++)
+                r.val[k] = vmulq_f32(r.val[k], inv);
+
+            vst4q_f32((float*)&rot[i], r);
+        }
+    #endif
+
+        for (; i < count; i++) {
+            quat q = a[i].dot(b[i]) < 0.0f ? -b[i] : b[i];
+            rot[i] = (a[i] + (q - a[i]) * t).normal();
+        }
+    }
+
+    void getFrameRots(TR::AnimFrame *frame, const short4 *store, int count, quat *rot) {
+        if (store) {
+            for (int i = 0; i < count; i++)
+                rot[i] = getStoreRot(store[i]);
+        } else {
+            uint16 xyz[ANIM_MAX_JOINTS * 3];
+            frame->getAngles(level->version, count, xyz);
+            decodeRots(xyz, count, rot);
+        }
+    }
+
     Basis getJoints(const mat4 &matrix, int joint, bool postRot = false, Basis *joints = NULL) {
-        mat4 basis = matrix;
+        Basis basis(matrix);
 
         ASSERT(model);
         vec3 offset = isPrepareToNext ? this->offset : vec3(0.0f);
@@ -260,8 +454,21 @@ struct Animation {
 
         TR::Node *node = (int)model->node < level->nodesDataSize ? (TR::Node*)&level->nodesData[model->node] : NULL;
 
+    // rotations of all joints at once (up to the requested one)
+        int count = min(int(model->mCount), ANIM_MAX_JOINTS);
+        if (joint > -1)
+            count = min(count, joint + 1);
+
+        quat rotsA[ANIM_MAX_JOINTS];
+        quat rotsB[ANIM_MAX_JOINTS];
+        quat rots[ANIM_MAX_JOINTS];
+
+        getFrameRots(frameA, storeA, count, rotsA);
+        getFrameRots(frameB, storeB, count, rotsB);
+        lerpRots(rotsA, rotsB, delta, count, rots);
+
         int sIndex = 0;
-        mat4 stack[16];
+        Basis stack[16];
 
         for (int i = 0; i < model->mCount; i++) {
 
@@ -279,13 +486,10 @@ struct Animation {
             if (i == joint && !postRot)
                 return basis;
 
-            quat q;
             if (overrideMask & (1 << i))
-                q = overrides[i];
+                basis.rot = (basis.rot * overrides[i]).normal();
             else
-                q = getJointRot(i);
-
-            basis.setRot(basis.getRot() * q);
+                basis.rot = basis.rot * (i < count ? rots[i] : getJointRot(i).normal());
 
             if (i == joint && postRot)
                 return basis;
@@ -5,6 +5,7 @@
 #include "format.h"
 #include "controller.h"
 #include "camera.h"
+#include "jobs.h"
 
 #define NO_CLIP_PLANE  1000000.0f
 
@@ -205,6 +206,14 @@ struct ShaderCache {
     }
 };
 
+// per-sector ambient cubes baked on CPU at load time (or loaded from the level cache)
+// the bake is a software version of the ambient pass (renderEnvironment): rooms and their static meshes seen through portals
+// are rasterized into cube faces with the pass colors (texture * vertex light * material, vertex fog),
+// the cube color is the average of the face pixels as the downsample chain of the render targets gives
+#define AMBIENT_CUBE_SIZE       16      // pixels per cube face side, the GPU bake rendered 64x64 faces
+#define AMBIENT_ZNEAR           32.0f
+#define AMBIENT_CACHE_VERSION   2
+
 struct AmbientCache {
     IGame     *game;
     TR::Level *level;
@@ -216,120 +225,641 @@ struct AmbientCache {
         vec4 colors[6]; // TODO: ubyte4[6]
     } *items;
     int *offsets;
-
-    struct Task {
-        int  room;
-        int  flip;
-        int  sector;
-        Cube *cube;
-    } tasks[32];
-    int tasksCount;
-
-    Texture *textures[6 * 4]; // 64, 16, 4, 1 
-
-    AmbientCache(IGame *game) : game(game), level(game->getLevel()), tasksCount(0) {
+    int sectorsCount;
+
+    enum Blend { BLEND_OPAQUE, BLEND_ALPHA_TEST, BLEND_ADD, BLEND_MAX };
+
+    struct TexColor {
+        vec3  color;    // sum of the opaque texels divided by the texels count
+        float coverage; // opaque texels part
+    };
+
+    struct Face {
+        vec3     v[4];
+        vec3     light[4];  // vertex light * room material
+        vec3     normal;    // points to the visible side
+        TexColor tex;
+        int      count;
+        bool     doubleSided;
+    };
+
+    struct Sprite {
+        vec3     pos;
+        vec3     light;
+        TexColor tex;
+        float    l, t, r, b;
+    };
+
+    struct Geometry {
+        Array<Face>   faces;    // sorted by blend mode
+        Array<Sprite> sprites;
+        int           blendStart[BLEND_MAX + 1];
+        vec4          fogParams;
+    };
+
+    // camera space of the cube face, z is the depth
+    struct Vertex {
+        vec3 pos;
+        vec4 attrib; // fog factor * light, 1 - fog factor
+    };
+
+    struct Target {
+        vec3  color[AMBIENT_CUBE_SIZE * AMBIENT_CUBE_SIZE];
+        float depth[AMBIENT_CUBE_SIZE * AMBIENT_CUBE_SIZE]; // 1 / z, 0 for the clear value
+    };
+
+    TexColor *texColors;    // per object texture, used while baking
+    TexColor *spriteColors; // per sprite texture
+    Geometry *geometry;     // per room of the current flip state, used while baking
+
+    AmbientCache(IGame *game, uint32 cacheKey) : game(game), level(game->getLevel()) {
         items   = NULL;
         offsets = new int[level->roomsCount];
-        int sectors = 0;
+        sectorsCount = 0;
         for (int i = 0; i < level->roomsCount; i++) {
             TR::Room &r = level->rooms[i];
-            offsets[i] = sectors;
-            sectors += r.xSectors * r.zSectors * (r.alternateRoom > -1 ? 2 : 1); // x2 for flipped rooms
+            offsets[i] = sectorsCount;
+            sectorsCount += r.xSectors * r.zSectors * (r.alternateRoom > -1 ? 2 : 1); // x2 for flipped rooms
         }
     // init cache buffer
-        items = new Cube[sectors];
-        memset(items, 0, sizeof(Cube) * sectors);
-    // init downsample textures
-        for (int j = 0; j < 6; j++)
-            for (int i = 0; i < 4; i++)
-                textures[j * 4 + i] = new Texture(64 >> (i << 1), 64 >> (i << 1), 1, FMT_RGBA, OPT_TARGET | OPT_NEAREST);
+        items = new Cube[sectorsCount];
+        memset(items, 0, sizeof(Cube) * sectorsCount);
+
+    #ifdef LEVEL_CACHE
+        if (loadCache(cacheKey))
+            return;
+    #endif
+
+        bake();
+
+    #ifdef LEVEL_CACHE
+        saveCache(cacheKey);
+    #endif
     }
 
     ~AmbientCache() {
         delete[] items;
         delete[] offsets;
-        for (int i = 0; i < 6 * 4; i++)
-            delete textures[i];
     }
 
-    void addTask(int room, int sector) {
-        if (tasksCount >= COUNT(tasks)) return;
+    // index of the room with geometry of the sectors set (0 - normal, 1 - flipped)
+    int getRoomData(int room, int flip) {
+        int alt = level->rooms[room].alternateRoom;
+        return (alt > -1 && flip != int(level->state.flags.flipped)) ? alt : room;
+    }
+
+    // the same texels as the atlas has for the texture
+    TexColor getTexColor(TR::Tile32 *tile, TR::TextureInfo &t) {
+        TexColor res;
+        res.color    = vec3(0.0f);
+        res.coverage = 0.0f;
+
+        if (t.tile == 0xFFFF)
+            return res;
+
+        short4 uv = t.getMinMax();
+        uv.z++;
+        uv.w++;
+        level->fillObjectTexture(tile, uv, &t);
+
+        if (level->version == TR::VER_TR1_SAT) // unpacked to the tile origin
+            uv = short4(0, 0, uv.z - uv.x, uv.w - uv.y);
 
-        Task &task  = tasks[tasksCount++];
-        task.room   = room;
-        task.flip   = level->state.flags.flipped && level->rooms[room].alternateRoom > -1;
-        task.sector = sector;
-        task.cube   = &items[offsets[room] + sector];
-        task.cube->status = Cube::WAIT;
+        int count = 0;
+        for (int y = uv.y; y < uv.w; y++)
+            for (int x = uv.x; x < uv.z; x++) {
+                const Color32 &c = tile->color[y * 256 + x];
+                if (c.a > 127) { // alpha test of the pass
+                    res.color += vec3(c.r, c.g, c.b);
+                    res.coverage += 1.0f;
+                }
+                count++;
+            }
+
+        if (count) {
+            res.color    *= 1.0f / (255.0f * count);
+            res.coverage *= 1.0f / count;
+        }
+        return res;
     }
 
-    void renderAmbient(int room, int sector, vec4 *colors) {
-        PROFILE_MARKER("PASS_AMBIENT");
-                
-        TR::Room &r = level->rooms[room];
-        TR::Room::Sector &s = r.sectors[sector];
-            
-        vec3 pos = vec3(float((sector / r.zSectors) * 1024 + 512 + r.info.x), 
-                        float(max((s.floor - 2) * 256, (s.floor + s.ceiling) * 256 / 2)),
-                        float((sector % r.zSectors) * 1024 + 512 + r.info.z));
+    void initTexColors() {
+        TR::Tile32 *tile = new TR::Tile32();
 
-        Core::setClearColor(vec4(0, 0, 0, 1));
+        texColors = new TexColor[level->objectTexturesCount];
+        for (int i = 0; i < level->objectTexturesCount; i++)
+            texColors[i] = getTexColor(tile, level->objectTextures[i]);
 
-        // first pass - render environment from position (room geometry & static meshes)
-        game->renderEnvironment(room, pos, textures, 4);
+    // only the room sprites, the rest are items and glyphs
+        spriteColors = new TexColor[level->spriteTexturesCount];
+        bool *ready = new bool[level->spriteTexturesCount];
+        memset(ready, 0, sizeof(bool) * level->spriteTexturesCount);
+        for (int i = 0; i < level->roomsCount; i++) {
+            TR::Room::Data &d = level->rooms[i].data;
+            for (int j = 0; j < d.sCount; j++) {
+                int index = d.sprites[j].texture;
+                if (!ready[index]) {
+                    spriteColors[index] = getTexColor(tile, level->spriteTextures[index]);
+                    ready[index] = true;
+                }
+            }
+        }
+        delete[] ready;
 
-        // second pass - downsample it
-        Core::setDepthTest(false);
+        delete tile;
+    }
+
+    static vec3 getNormal(const vec3 *v, int count) {
+    // same orientation as CHECK_ROOM_NORMAL
+        vec3 a = v[0] - v[1];
+        vec3 b = v[0] - v[2];
+        vec3 n = b.cross(a);
+        if (count == 4)
+            n += (v[0] - v[3]).cross(b);
+        return n;
+    }
 
-        game->setShader(Core::passFilter, Shader::FILTER_DOWNSAMPLE);
+    static int getBlend(int attribute) {
+        return attribute == 2 ? BLEND_ADD : (attribute == 1 ? BLEND_ALPHA_TEST : BLEND_OPAQUE);
+    }
 
-        for (int i = 1; i < 4; i++) {
-            int size = 64 >> (i << 1);
+    // room faces and static meshes of the render geometry (MeshBuilder::buildRoom & buildMesh)
+    static void geometryJob(int index, int thread, void *userData) {
+        AmbientCache *cache = (AmbientCache*)userData;
+        TR::Level *level = cache->level;
+        TR::Room  &room  = level->rooms[index];
+        TR::Room::Data &d = room.data;
+        Geometry  &geom  = cache->geometry[index];
 
-            Core::active.shader->setParam(uParam, vec4(1.0f / (size << 2), 0.0f, 0.0f, 0.0f));
+        vec4 material;
+        cache->game->getAmbientParams(room.flags.water, geom.fogParams, material);
 
-            for (int j = 0; j < 6; j++) {
-                Texture *src = textures[j * 4 + i - 1];
-                Texture *dst = textures[j * 4 + i];
-                Core::setTarget(dst, NULL, RT_STORE_COLOR);
-                src->bind(sDiffuse);
-                game->getMesh()->renderQuad();
+        vec3 offset = room.getOffset();
+
+        geom.faces.reserve(d.fCount);
+
+        for (int blend = 0; blend < BLEND_MAX; blend++) {
+            geom.blendStart[blend] = geom.faces.length;
+
+            for (int i = 0; i < d.fCount; i++) {
+                TR::Face &f = d.faces[i];
+                if (f.water || getBlend(level->objectTextures[f.flags.texture].attribute) != blend)
+                    continue;
+
+                Face face;
+                face.count       = f.triangle ? 3 : 4;
+                face.doubleSided = f.flags.doubleSided;
+                face.tex         = cache->texColors[f.flags.texture];
+                for (int j = 0; j < face.count; j++) {
+                    TR::Room::Data::Vertex &v = d.vertices[f.vertices[j]];
+                    face.v[j]     = vec3(v.pos.x, v.pos.y, v.pos.z) + offset;
+                    face.light[j] = vec3(v.color.r, v.color.g, v.color.b) * (1.0f / 255.0f) * material.xyz();
+                }
+                face.normal = getNormal(face.v, face.count);
+                geom.faces.push(face);
             }
+
+            for (int i = 0; i < room.meshesCount; i++) {
+                TR::Room::Mesh &m = room.meshes[i];
+                TR::StaticMesh *s = &level->staticMeshes[m.meshIndex];
+                if (!level->meshOffsets[s->mesh]) continue;
+                TR::Mesh &mesh = level->meshes[level->meshOffsets[s->mesh]];
+
+                int  dir   = m.rotation.value / 0x4000;
+                vec3 light = vec3(m.color.r, m.color.g, m.color.b) * (1.0f / 255.0f) * material.xyz();
+
+                for (int j = 0; j < mesh.fCount; j++) {
+                    TR::Face &f = mesh.faces[j];
+                    if (getBlend(f.colored ? 0 : level->objectTextures[f.flags.texture].attribute) != blend)
+                        continue;
+
+                    Face face;
+                    face.count       = f.triangle ? 3 : 4;
+                    face.doubleSided = f.flags.doubleSided;
+                    if (f.colored) {
+                        Color32 c = level->getColor(f.flags.value);
+                        face.tex.color    = vec3(c.r, c.g, c.b) * (1.0f / 255.0f);
+                        face.tex.coverage = 1.0f;
+                    } else
+                        face.tex = cache->texColors[f.flags.texture];
+
+                    for (int k = 0; k < face.count; k++) {
+                        const short4 &c = mesh.vertices[f.vertices[k]].coord;
+                        vec3 p = vec3(c.x, c.y, c.z);
+                        switch (dir) {
+                            case 1 : p = vec3( p.z, p.y, -p.x); break;
+                            case 2 : p = vec3(-p.x, p.y, -p.z); break;
+                            case 3 : p = vec3(-p.z, p.y,  p.x); break;
+                        }
+                        face.v[k]     = p + vec3(float(m.x), float(m.y), float(m.z));
+                        face.light[k] = light;
+                    }
+                    face.normal = getNormal(face.v, face.count);
+                    geom.faces.push(face);
+                }
+            }
+        }
+        geom.blendStart[BLEND_MAX] = geom.faces.length;
+
+        for (int i = 0; i < d.sCount; i++) {
+            TR::Room::Data::Sprite &f = d.sprites[i];
+            TR::Room::Data::Vertex &v = d.vertices[f.vertexIndex];
+            TR::TextureInfo &t = level->spriteTextures[f.texture];
+
+            Sprite sprite;
+            sprite.pos   = vec3(v.pos.x, v.pos.y, v.pos.z) + offset;
+            sprite.light = vec3(v.color.r, v.color.g, v.color.b) * (1.0f / 255.0f) * material.xyz();
+            sprite.tex   = cache->spriteColors[f.texture];
+            sprite.l     = t.l;
+            sprite.t     = t.t;
+            sprite.r     = t.r;
+            sprite.b     = t.b;
+            geom.sprites.push(sprite);
         }
+    }
 
-        // get result color from 1x1 textures
-        for (int j = 0; j < 6; j++) {
-            Core::setTarget(textures[j * 4 + 3], NULL, RT_LOAD_COLOR);
-            colors[j] = Core::copyPixel(0, 0);
+    static vec3 toFace(const vec3 &v, int face) {
+        switch (face) {
+            case 0  : return vec3(v.z, v.y,  v.x);
+            case 1  : return vec3(v.z, v.y, -v.x);
+            case 2  : return vec3(v.x, v.z,  v.y);
+            case 3  : return vec3(v.x, v.z, -v.y);
+            case 4  : return vec3(v.x, v.y,  v.z);
+            default : return vec3(v.x, v.y, -v.z);
         }
+    }
 
-        Core::setDepthTest(true);
-        Core::setClearColor(vec4(0, 0, 0, 0));
+    struct Context {
+        vec3       pos;
+        int        face;
+        int        flip;
+        Array<int> rooms;
+        bool       *visible;
+        Target     target;
+    };
+
+    bool checkPortal(Context &ctx, const TR::Room &room, const TR::Room::Portal &portal, const vec4 &viewPort, vec4 &clipPort) {
+        vec3 offset = room.getOffset();
+        vec3 n = portal.normal;
+
+        if (n.dot(ctx.pos - (offset + portal.vertices[0])) <= 0.0f)
+            return false;
+
+        int zClip = 0;
+        clipPort = vec4(INF, INF, -INF, -INF);
+
+        for (int i = 0; i < 4; i++) {
+            vec3 p = toFace(vec3(portal.vertices[i]) + offset - ctx.pos, ctx.face);
+            if (p.z > 0.0f) {
+                p.x /= p.z;
+                p.y /= p.z;
+                clipPort.x = min(clipPort.x, p.x);
+                clipPort.y = min(clipPort.y, p.y);
+                clipPort.z = max(clipPort.z, p.x);
+                clipPort.w = max(clipPort.w, p.y);
+            } else
+                zClip++;
+        }
+
+        if (zClip == 4)
+            return false;
+
+        if (zClip > 0) // the portal crosses the camera plane
+            clipPort = viewPort;
+
+        if (clipPort.x > viewPort.z || clipPort.y > viewPort.w || clipPort.z < viewPort.x || clipPort.w < viewPort.y)
+            return false;
+
+        clipPort.x = max(clipPort.x, viewPort.x);
+        clipPort.y = max(clipPort.y, viewPort.y);
+        clipPort.z = min(clipPort.z, viewPort.z);
+        clipPort.w = min(clipPort.w, viewPort.w);
+
+        return true;
     }
 
-    void processQueue() {
-        game->setupBinding();
+    // Level::getVisibleRooms for the cube face camera
+    void getVisibleRooms(Context &ctx, int from, int to, const vec4 &viewPort, int count = 0) {
+        if (count > 16)
+            return;
 
-        for (int i = 0; i < tasksCount; i++) {
-            Task &task = tasks[i];
-            
-            bool needFlip = task.flip != level->state.flags.flipped;
-           
-            if (needFlip) game->flipMap(false);
-
-            int sector = task.sector;
-            if (task.flip) {
-                TR::Room &r = level->rooms[task.room];
-                sector -= r.xSectors * r.zSectors;
+        if (!ctx.visible[to]) {
+            ctx.visible[to] = true;
+            ctx.rooms.push(to);
+        }
+
+        const TR::Room &room = level->rooms[getRoomData(to, ctx.flip)];
+
+        vec4 clipPort;
+        for (int i = 0; i < room.portalsCount; i++) {
+            const TR::Room::Portal &p = room.portals[i];
+            if (from != p.roomIndex && checkPortal(ctx, room, p, viewPort, clipPort))
+                getVisibleRooms(ctx, to, p.roomIndex, clipPort, count + 1);
+        }
+    }
+
+    static float edge(const vec3 &a, const vec3 &b, float x, float y) {
+        return (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+    }
+
+    // s is the screen position and 1 / z, attributes are premultiplied by 1 / z
+    static void rasterTriangle(Target &target, const vec3 *s, const vec4 *a, const TexColor &tex, int blend, const vec3 &fogColor) {
+        float area = edge(s[0], s[1], s[2].x, s[2].y);
+        if (fabsf(area) < EPS)
+            return;
+        area = 1.0f / area;
+
+        int x0 = max(0, int(floorf(min(min(s[0].x, s[1].x), s[2].x))));
+        int y0 = max(0, int(floorf(min(min(s[0].y, s[1].y), s[2].y))));
+        int x1 = min(AMBIENT_CUBE_SIZE - 1, int(ceilf(max(max(s[0].x, s[1].x), s[2].x))));
+        int y1 = min(AMBIENT_CUBE_SIZE - 1, int(ceilf(max(max(s[0].y, s[1].y), s[2].y))));
+
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++) {
+                float px = x + 0.5f;
+                float py = y + 0.5f;
+
+                float w0 = edge(s[1], s[2], px, py) * area;
+                float w1 = edge(s[2], s[0], px, py) * area;
+                float w2 = 1.0f - w0 - w1;
+                if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+                    continue;
+
+                int   index = y * AMBIENT_CUBE_SIZE + x;
+                float depth = s[0].z * w0 + s[1].z * w1 + s[2].z * w2;
+                if (depth <= target.depth[index])
+                    continue;
+
+                vec4 attrib = (a[0] * w0 + a[1] * w1 + a[2] * w2) * (1.0f / depth);
+            // mix(fog, tex * light, factor) * alpha, transparent texels are black for the opaque faces
+                vec3 color = tex.color * attrib.xyz() + fogColor * (attrib.w * tex.coverage);
+
+                vec3 &dst = target.color[index];
+                switch (blend) {
+                    case BLEND_OPAQUE :
+                        dst = color;
+                        target.depth[index] = depth;
+                        break;
+                    case BLEND_ALPHA_TEST :
+                        dst = color + dst * (1.0f - tex.coverage);
+                        if (tex.coverage >= 0.5f)
+                            target.depth[index] = depth;
+                        break;
+                    case BLEND_ADD :
+                        dst += color;
+                        break;
+                }
+            }
+    }
+
+    static void rasterPolygon(Context &ctx, const vec3 *v, const vec3 *light, int count, const TexColor &tex, int blend, const vec4 &fogParams) {
+        Vertex in[4], out[8];
+
+        int outside[5] = { 0, 0, 0, 0, 0 };
+
+        for (int i = 0; i < count; i++) {
+            vec3 p = toFace(v[i] - ctx.pos, ctx.face);
+            if (p.z < AMBIENT_ZNEAR) outside[0]++;
+            if (p.x >  p.z) outside[1]++;
+            if (p.x < -p.z) outside[2]++;
+            if (p.y >  p.z) outside[3]++;
+            if (p.y < -p.z) outside[4]++;
+            in[i].pos = p;
+        }
+
+        for (int i = 0; i < 5; i++)
+            if (outside[i] == count)
+                return;
+
+        for (int i = 0; i < count; i++) {
+            float fog = clamp(1.0f / expf(in[i].pos.length() * fogParams.w), 0.0f, 1.0f);
+            in[i].attrib = vec4(light[i] * fog, 1.0f - fog);
+        }
+
+    // clip by the near plane
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            const Vertex &a = in[i];
+            const Vertex &b = in[(i + 1) % count];
+            bool aIn = a.pos.z >= AMBIENT_ZNEAR;
+            bool bIn = b.pos.z >= AMBIENT_ZNEAR;
+
+            if (aIn)
+                out[n++] = a;
+
+            if (aIn != bIn) {
+                float t = (AMBIENT_ZNEAR - a.pos.z) / (b.pos.z - a.pos.z);
+                out[n].pos    = a.pos + (b.pos - a.pos) * t;
+                out[n].attrib = a.attrib + (b.attrib - a.attrib) * t;
+                n++;
             }
+        }
+
+        if (n < 3)
+            return;
+
+        vec3 s[8];
+        vec4 a[8];
+        for (int i = 0; i < n; i++) {
+            float w = 1.0f / out[i].pos.z;
+            s[i] = vec3((out[i].pos.x * w + 1.0f) * (AMBIENT_CUBE_SIZE * 0.5f),
+                        (out[i].pos.y * w + 1.0f) * (AMBIENT_CUBE_SIZE * 0.5f), w);
+            a[i] = out[i].attrib * w;
+        }
+
+        vec3 fogColor = fogParams.xyz();
+        for (int i = 2; i < n; i++) {
+            vec3 ts[3] = { s[0], s[i - 1], s[i] };
+            vec4 ta[3] = { a[0], a[i - 1], a[i] };
+            rasterTriangle(ctx.target, ts, ta, tex, blend, fogColor);
+        }
+    }
+
+    void renderRoom(Context &ctx, int roomIndex, int blend) {
+        const Geometry &geom = geometry[getRoomData(roomIndex, ctx.flip)];
+
+        for (int i = geom.blendStart[blend]; i < geom.blendStart[blend + 1]; i++) {
+            const Face &f = geom.faces[i];
+
+            bool backface = f.normal.dot(ctx.pos - f.v[0]) <= 0.0f;
+            if (backface && !f.doubleSided)
+                continue;
+
+            rasterPolygon(ctx, f.v, f.light, f.count, f.tex, blend, geom.fogParams);
+        }
+
+        if (blend != BLEND_ALPHA_TEST)
+            return;
+
+    // sprites are aligned with the camera plane
+        vec3 right, up;
+        switch (ctx.face) {
+            case 0  : right = vec3(0, 0, -1); up = vec3( 0, -1,  0); break;
+            case 1  : right = vec3(0, 0,  1); up = vec3( 0, -1,  0); break;
+            case 2  : right = vec3(1, 0,  0); up = vec3( 0,  0,  1); break;
+            case 3  : right = vec3(1, 0,  0); up = vec3( 0,  0, -1); break;
+            case 4  : right = vec3(1, 0,  0); up = vec3( 0, -1,  0); break;
+            default : right = vec3(-1, 0, 0); up = vec3( 0, -1,  0); break;
+        }
+
+        for (int i = 0; i < geom.sprites.length; i++) {
+            const Sprite &s = geom.sprites[i];
+
+            vec3 v[4] = {
+                s.pos + right * s.l - up * s.t,
+                s.pos + right * s.r - up * s.t,
+                s.pos + right * s.r - up * s.b,
+                s.pos + right * s.l - up * s.b,
+            };
+            vec3 light[4] = { s.light, s.light, s.light, s.light };
+
+            rasterPolygon(ctx, v, light, 4, s.tex, BLEND_ALPHA_TEST, geom.fogParams);
+        }
+    }
+
+    vec4 renderFace(Context &ctx, int roomIndex) {
+        memset(&ctx.target, 0, sizeof(ctx.target));
+
+        for (int i = 0; i < ctx.rooms.length; i++)
+            ctx.visible[ctx.rooms[i]] = false;
+        ctx.rooms.clear();
+
+        getVisibleRooms(ctx, TR::NO_ROOM, roomIndex, vec4(-1.0f, -1.0f, 1.0f, 1.0f));
+
+    // opaque in the list order, transparent and additive back to front
+        for (int i = 0; i < ctx.rooms.length; i++)
+            renderRoom(ctx, ctx.rooms[i], BLEND_OPAQUE);
+        for (int i = ctx.rooms.length - 1; i >= 0; i--)
+            renderRoom(ctx, ctx.rooms[i], BLEND_ALPHA_TEST);
+        for (int i = ctx.rooms.length - 1; i >= 0; i--)
+            renderRoom(ctx, ctx.rooms[i], BLEND_ADD);
+
+    // the render target clamps every pixel
+        vec3 color(0.0f);
+        for (int i = 0; i < AMBIENT_CUBE_SIZE * AMBIENT_CUBE_SIZE; i++) {
+            const vec3 &c = ctx.target.color[i];
+            color += vec3(min(c.x, 1.0f), min(c.y, 1.0f), min(c.z, 1.0f));
+        }
+        return vec4(color * (1.0f / (AMBIENT_CUBE_SIZE * AMBIENT_CUBE_SIZE)), 1.0f);
+    }
+
+    static void bakeJob(int index, int thread, void *userData) {
+        AmbientCache *cache = (AmbientCache*)userData;
+        TR::Level *level = cache->level;
+
+        int room = index >> 1;
+        int flip = index & 1;
+
+        if (flip && level->rooms[room].alternateRoom <= -1)
+            return;
 
-            renderAmbient(task.room, sector, &task.cube->colors[0]);
-            if (needFlip) game->flipMap(false);
+        TR::Room &r = level->rooms[cache->getRoomData(room, flip)];
 
-            task.cube->status = Cube::READY;
+        int sectors = r.xSectors * r.zSectors;
+        Cube *cubes = cache->items + cache->offsets[room] + flip * sectors;
+
+        Context *ctx = new Context();
+        ctx->flip    = flip;
+        ctx->visible = new bool[level->roomsCount];
+        memset(ctx->visible, 0, sizeof(bool) * level->roomsCount);
+
+        for (int sector = 0; sector < sectors; sector++) {
+            TR::Room::Sector &s = r.sectors[sector];
+            if (s.floor == TR::NO_FLOOR)
+                continue;
+
+            ctx->pos = vec3(float((sector / r.zSectors) * 1024 + 512 + r.info.x), 
+                            float(max((s.floor - 2) * 256, (s.floor + s.ceiling) * 256 / 2)),
+                            float((sector % r.zSectors) * 1024 + 512 + r.info.z));
+
+            Cube &cube = cubes[sector];
+            for (ctx->face = 0; ctx->face < 6; ctx->face++)
+                cube.colors[ctx->face] = cache->renderFace(*ctx, room);
+            cube.status = Cube::READY;
+        }
+
+        delete[] ctx->visible;
+        delete ctx;
+    }
+
+    void bake() {
+        initTexColors();
+
+        geometry = new Geometry[level->roomsCount];
+        Jobs::parallelFor(level->roomsCount, geometryJob, this);
+        Jobs::parallelFor(level->roomsCount * 2, bakeJob, this);
+        delete[] geometry;
+        delete[] texColors;
+        delete[] spriteColors;
+        geometry     = NULL;
+        texColors    = NULL;
+        spriteColors = NULL;
+
+        LOG("bake ambient cubes (%d sectors)\n", sectorsCount);
+    }
+
+#ifdef LEVEL_CACHE
+    struct CacheHeader {
+        int32 version;
+        int32 sectorsCount;
+        int32 cubeSize;
+    };
+
+    static void readCacheAsync(Stream *stream, void *userData) {
+        if (!stream) return;
+
+        AmbientCache *cache = (AmbientCache*)userData;
+
+        CacheHeader header;
+        if (stream->size >= int(sizeof(header))) {
+            stream->read(header);
+
+            int size = sizeof(Cube) * cache->sectorsCount;
+            if (header.version == AMBIENT_CACHE_VERSION && header.sectorsCount == cache->sectorsCount && header.cubeSize == int(sizeof(Cube)) && stream->size == int(sizeof(header)) + size) {
+                stream->raw(cache->items, size);
+                LOG("load ambient cache (%d bytes)\n", stream->size);
+            }
         }
-        tasksCount = 0;
+
+        delete stream;
+    }
+
+    void getCacheName(uint32 cacheKey, char *name) {
+        sprintf(name, "%08X.ambient", cacheKey);
+    }
+
+    bool loadCache(uint32 cacheKey) {
+        if (!cacheKey) return false;
+
+        char name[64];
+        getCacheName(cacheKey, name);
+        Stream::cacheRead(name, readCacheAsync, this); // synchronous for OS_FILEIO_CACHE
+
+        for (int i = 0; i < sectorsCount; i++)
+            if (items[i].status != Cube::BLANK)
+                return true;
+        return false;
+    }
+
+    void saveCache(uint32 cacheKey) {
+        if (!cacheKey) return;
+
+        CacheHeader header;
+        header.version      = AMBIENT_CACHE_VERSION;
+        header.sectorsCount = sectorsCount;
+        header.cubeSize     = sizeof(Cube);
+
+        int size = sizeof(header) + sizeof(Cube) * sectorsCount;
+        char *data = new char[size];
+        memcpy(data, &header, sizeof(header));
+        memcpy(data + sizeof(header), items, sizeof(Cube) * sectorsCount);
+
+        char name[64];
+        getCacheName(cacheKey, name);
+        Stream::cacheWrite(name, data, size);
+        delete[] data;
     }
+#endif
 
     Cube* getAmbient(int roomIndex, int x, int z) {
         TR::Room &r = level->rooms[roomIndex];
@@ -345,9 +875,6 @@ struct AmbientCache {
             sector += r.xSectors * r.zSectors;
 
         Cube *cube = &items[offsets[roomIndex] + sector];
-        if (cube->status == Cube::BLANK)
-            addTask(roomIndex, sector);
-
         return cube->status == Cube::READY ? cube : NULL;
     }
 
@@ -1047,6 +1574,7 @@ struct WaterCache {
 };
 
 struct ZoneCache {
+    #define PATH_CACHE_SIZE 32
 
     struct Item {
         uint16 zone;
@@ -1065,21 +1593,92 @@ struct ZoneCache {
     } *items;
 
     IGame  *game;
-    // dummy arrays for path search
-    uint16 *nodes;
+    // scratch arrays for path search (allocated once per level)
+    uint16 *nodes;      // result path
     uint16 *parents;
-    uint16 *weights;
+    uint16 *heap;       // open list, binary heap ordered by score
+    uint16 *heapPos;    // box position in the heap, NO_NODE if not in the open list
+    uint32 *costs;      // path cost from the end box
+    uint32 *scores;     // cost + estimate to the start box
+    int    heapSize;
+
+    enum { NO_NODE = 0xFFFF };
+
+    // LRU cache of solved paths (enemies re-query the same box pairs every frame)
+    struct PathItem {
+        uint16 *zones;      // NULL for unused item
+        int    ascend;
+        int    descend;
+        bool   big;
+        uint16 boxStart;
+        uint16 boxEnd;
+        uint16 count;       // 0 if there is no path
+        uint16 capacity;
+        uint16 *boxes;
+        uint32 stamp;       // last access
+    } paths[PATH_CACHE_SIZE];
+
+    uint32 pathStamp;
+    int    pathHits;
+    int    pathMisses;
+
+    ZoneCache(IGame *game) : items(NULL), game(game), pathStamp(0), pathHits(0), pathMisses(0) {
+        memset(paths, 0, sizeof(paths));
 
-    ZoneCache(IGame *game) : items(NULL), game(game) {
         TR::Level *level = game->getLevel();
-        nodes   = new uint16[level->boxesCount * 3];
+        nodes   = new uint16[level->boxesCount * 4];
         parents = nodes + level->boxesCount;
-        weights = nodes + level->boxesCount * 2;
+        heap    = nodes + level->boxesCount * 2;
+        heapPos = nodes + level->boxesCount * 3;
+        costs   = new uint32[level->boxesCount * 2];
+        scores  = costs + level->boxesCount;
     }
 
     ~ZoneCache() {
         delete   items;
         delete[] nodes;
+        delete[] costs;
+        for (int i = 0; i < PATH_CACHE_SIZE; i++)
+            delete[] paths[i].boxes;
+    }
+
+    void invalidatePaths() {
+        for (int i = 0; i < PATH_CACHE_SIZE; i++)
+            paths[i].zones = NULL;
+    }
+
+    PathItem* getPath(int ascend, int descend, bool big, int boxStart, int boxEnd, uint16 *zones) {
+        for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+            PathItem &p = paths[i];
+            if (p.zones == zones && p.boxStart == boxStart && p.boxEnd == boxEnd && p.ascend == ascend && p.descend == descend && p.big == big)
+                return &p;
+        }
+        return NULL;
+    }
+
+    PathItem* addPath(int ascend, int descend, bool big, int boxStart, int boxEnd, uint16 *zones, uint16 *boxes, uint16 count) {
+        PathItem *p = &paths[0]; // least recently used or unused item
+        for (int i = 1; i < PATH_CACHE_SIZE && p->zones; i++)
+            if (!paths[i].zones || paths[i].stamp < p->stamp)
+                p = &paths[i];
+
+        if (p->capacity < count) {
+            delete[] p->boxes;
+            p->capacity = count;
+            p->boxes    = new uint16[count];
+        }
+
+        p->zones    = zones;
+        p->ascend   = ascend;
+        p->descend  = descend;
+        p->big      = big;
+        p->boxStart = boxStart;
+        p->boxEnd   = boxEnd;
+        p->count    = count;
+        if (count)
+            memcpy(p->boxes, boxes, sizeof(uint16) * count);
+
+        return p;
     }
 
     Item *getBoxes(uint16 zone, uint16 *zones) {
@@ -1103,46 +1702,105 @@ struct ZoneCache {
         return items = new Item(zone, count, zones, boxes, items);
     }
 
+    void heapUp(int i) {
+        uint16 box   = heap[i];
+        uint32 score = scores[box];
+        while (i > 0) {
+            int p = (i - 1) >> 1;
+            if (scores[heap[p]] <= score)
+                break;
+            heap[i] = heap[p];
+            heapPos[heap[i]] = i;
+            i = p;
+        }
+        heap[i] = box;
+        heapPos[box] = i;
+    }
+
+    void heapDown(int i) {
+        uint16 box   = heap[i];
+        uint32 score = scores[box];
+        while (true) {
+            int c = i * 2 + 1;
+            if (c >= heapSize)
+                break;
+            if (c + 1 < heapSize && scores[heap[c + 1]] < scores[heap[c]])
+                c++;
+            if (score <= scores[heap[c]])
+                break;
+            heap[i] = heap[c];
+            heapPos[heap[i]] = i;
+            i = c;
+        }
+        heap[i] = box;
+        heapPos[box] = i;
+    }
+
+    void heapPush(uint16 box) {
+        heap[heapSize] = box;
+        heapUp(heapSize++);
+    }
+
+    uint16 heapPop() {
+        uint16 box = heap[0];
+        heapPos[box] = NO_NODE;
+        if (--heapSize) {
+            heap[0] = heap[heapSize];
+            heapDown(0);
+        }
+        return box;
+    }
+
+    static inline int getDistance(const TR::Box &a, const TR::Box &b) { // manhattan distance between box centers in sectors
+        int dx = ((a.minX + a.maxX) >> 11) - ((b.minX + b.maxX) >> 11);
+        int dz = ((a.minZ + a.maxZ) >> 11) - ((b.minZ + b.maxZ) >> 11);
+        return abs(dx) + abs(dz);
+    }
+
     uint16 findPath(int ascend, int descend, bool big, int boxStart, int boxEnd, uint16 *zones, uint16 **boxes) {
         if (boxStart == TR::NO_BOX || boxEnd == TR::NO_BOX)
             return 0;
 
-        TR::Level *level = game->getLevel();
-        memset(parents, 0xFF, sizeof(uint16) * level->boxesCount); // fill parents by 0xFFFF
-        memset(weights, 0x00, sizeof(uint16) * level->boxesCount); // zeroes weights
+        if (zones[boxStart] != zones[boxEnd])
+            return 0;
 
-        uint16 count = 0;
-        nodes[count++] = boxEnd;
+        PathItem *p = getPath(ascend, descend, big, boxStart, boxEnd, zones);
+        if (p) {
+            pathHits++;
+        } else {
+            pathMisses++;
+            uint16 count = searchPath(ascend, descend, big, boxStart, boxEnd, zones, boxes);
+            p = addPath(ascend, descend, big, boxStart, boxEnd, zones, *boxes, count);
+        }
 
-        uint16 zone = zones[boxStart];
+        p->stamp = ++pathStamp;
+        *boxes   = p->boxes;
+        return p->count;
+    }
 
-        if (zone != zones[boxEnd])
-            return 0;
+    // A* search from the end box to the start box
+    // edge cost is the distance between box centers + 1 per box, so the distance to the start box is an admissible and consistent estimate
+    uint16 searchPath(int ascend, int descend, bool big, int boxStart, int boxEnd, uint16 *zones, uint16 **boxes) {
+        uint16 zone = zones[boxStart];
 
-        TR::Box &b = level->boxes[boxStart];
+        TR::Level *level = game->getLevel();
+        memset(parents, 0xFF, sizeof(uint16) * level->boxesCount); // fill parents by NO_NODE
+        memset(heapPos, 0xFF, sizeof(uint16) * level->boxesCount);
 
-        int sx = (b.minX + b.maxX) >> 11; // box center / 1024
-        int sz = (b.minZ + b.maxZ) >> 11;
+        const TR::Box &start = level->boxes[boxStart];
 
-        while (count) {
-            // get min weight
-            int minI  = 0;
-            int minW = weights[nodes[minI]];
-            for (int i = 1; i < count; i++)
-                if (weights[nodes[i]] < minW) {
-                    minI = i;
-                    minW = weights[nodes[i]];
-                }
-            int cur = nodes[minI];
+        heapSize        = 0;
+        parents[boxEnd] = boxEnd;
+        costs[boxEnd]   = 0;
+        scores[boxEnd]  = getDistance(level->boxes[boxEnd], start);
+        heapPush(boxEnd);
 
-            // peek min weight item from array
-            count--;
-            for (int i = minI; i < count; i++)
-                nodes[i] = nodes[i + 1];
+        while (heapSize) {
+            int cur = heapPop();
 
             // check for end of path
             if (cur == boxStart) {
-                count = 0;
+                int count = 0;
                 while (cur != boxEnd) {
                     nodes[count++] = cur;
                     cur = parents[cur];
@@ -1153,42 +1811,180 @@ struct ZoneCache {
             }
 
             // add overlap boxes
-            TR::Box &b = game->getLevel()->boxes[cur];
+            TR::Box &b = level->boxes[cur];
             TR::Overlap *overlap = &level->overlaps[b.overlap.index];
 
             do {
                 uint16 index = overlap->boxIndex;
-                // unvisited yet
-                if (parents[index] != 0xFFFF)
-                    continue;
                 // has same zone
                 if (zones[index] != zone)
                     continue;
+
+                TR::Box &n = level->boxes[index];
                 // check passability
-                if (big && level->boxes[index].overlap.blockable)
+                if (big && n.overlap.blockable)
                     continue;
                 // check blocking (doors)
-                if (level->boxes[index].overlap.block)
+                if (n.overlap.block)
                     continue;
                 // check for height difference
-                int d = level->boxes[index].floor - b.floor;
+                int d = n.floor - b.floor;
                 if (d > ascend || d < descend)
                     continue;
-                
-                int dx = sx - ((b.minX + b.maxX) >> 11);
-                int dz = sz - ((b.minZ + b.maxZ) >> 11);
-                int w = abs(dx) + abs(dz);
 
-                ASSERT(count < level->boxesCount);
-                nodes[count++] = index;
-                parents[index] = cur;
-                weights[index] = weights[cur] + w;
+                uint32 cost = costs[cur] + getDistance(b, n) + 1;
+
+                if (parents[index] == NO_NODE) { // unvisited yet
+                    parents[index] = cur;
+                    costs[index]   = cost;
+                    scores[index]  = cost + getDistance(n, start);
+                    heapPush(index);
+                } else if (heapPos[index] != NO_NODE && cost < costs[index]) { // shorter path to the open box
+                    parents[index] = cur;
+                    scores[index] -= costs[index] - cost;
+                    costs[index]   = cost;
+                    heapUp(heapPos[index]);
+                }
 
             } while (!(overlap++)->end);
         }
 
+        *boxes = nodes;
         return 0;
     }
+
+    #undef PATH_CACHE_SIZE
+};
+
+// potentially visible set of rooms for every room and flip state, built at load time from the portals graph
+// a line of sight crosses every portal plane only once, so all the next portals of a visible chain
+// must be (at least partially) behind the planes of all the previous ones
+struct VisibilityCache {
+    #define PVS_MAX_DEPTH   16      // same as getVisibleRooms recursion limit
+    #define PVS_MAX_VISITS  4096    // per room, everything is potentially visible if exceeded
+    #define PVS_EPS         1.0f
+
+    TR::Level *level;
+    int       stride;   // uint32 words per room mask
+    uint32    *masks;   // [flip][room][stride]
+    int16     *baseRooms;
+
+    struct Plane {
+        vec3  n;
+        float d;
+    };
+
+    struct Walker {
+        int    flip;
+        int    visits;
+        uint32 *mask;
+        Plane  planes[PVS_MAX_DEPTH + 1];
+    };
+
+    VisibilityCache(TR::Level *level) : level(level) {
+        stride    = (level->roomsCount + 31) / 32;
+        masks     = new uint32[stride * level->roomsCount * 2];
+        baseRooms = new int16[level->roomsCount];
+
+        for (int i = 0; i < level->roomsCount; i++)
+            baseRooms[i] = -1;
+        for (int i = 0; i < level->roomsCount; i++)
+            if (level->rooms[i].alternateRoom > -1)
+                baseRooms[level->rooms[i].alternateRoom] = i;
+
+        Jobs::parallelFor(level->roomsCount * 2, buildJob, this);
+
+        int count = 0;
+        for (int i = 0; i < stride * level->roomsCount * 2; i++)
+            count += bitCount(masks[i]);
+        LOG("PVS: %d%% visible\n", count * 100 / max(1, level->roomsCount * level->roomsCount * 2));
+    }
+
+    ~VisibilityCache() {
+        delete[] masks;
+        delete[] baseRooms;
+    }
+
+    static int bitCount(uint32 x) {
+        int count = 0;
+        for (; x; x &= x - 1)
+            count++;
+        return count;
+    }
+
+    // room data for the flip state, rooms are swapped by flipMap
+    const TR::Room& getRoom(int index, int flip) const {
+        if (flip != int(level->state.flags.flipped)) {
+            if (level->rooms[index].alternateRoom > -1)
+                return level->rooms[level->rooms[index].alternateRoom];
+            if (baseRooms[index] > -1)
+                return level->rooms[baseRooms[index]];
+        }
+        return level->rooms[index];
+    }
+
+    const uint32* getMask(int index) const {
+        return masks + (int(level->state.flags.flipped) * level->roomsCount + index) * stride;
+    }
+
+    static bool isVisible(const uint32 *mask, int index) {
+        return (mask[index >> 5] & (1 << (index & 31))) != 0;
+    }
+
+    bool isBehind(const Plane &plane, const TR::Room &room, const TR::Room::Portal &portal) const {
+        vec3 offset = room.getOffset();
+        for (int i = 0; i < 4; i++)
+            if (plane.n.dot(offset + vec3(portal.vertices[i])) + plane.d < -PVS_EPS)
+                return true;
+        return false;
+    }
+
+    void walk(Walker &w, int from, int to, int depth) const {
+        w.mask[to >> 5] |= 1 << (to & 31);
+
+        if (depth == PVS_MAX_DEPTH || ++w.visits > PVS_MAX_VISITS)
+            return;
+
+        const TR::Room &room = getRoom(to, w.flip);
+
+        for (int i = 0; i < room.portalsCount; i++) {
+            const TR::Room::Portal &p = room.portals[i];
+            if (p.roomIndex == from)
+                continue;
+
+            int j;
+            for (j = 0; j < depth; j++)
+                if (!isBehind(w.planes[j], room, p))
+                    break;
+            if (j < depth)
+                continue;
+
+            Plane &plane = w.planes[depth];
+            plane.n = vec3(p.normal).normal(); // points to the room side
+            plane.d = -plane.n.dot(room.getOffset() + vec3(p.vertices[0]));
+
+            walk(w, to, p.roomIndex, depth + 1);
+        }
+    }
+
+    static void buildJob(int index, int thread, void *userData) {
+        VisibilityCache *cache = (VisibilityCache*)userData;
+
+        Walker w;
+        w.flip   = index / cache->level->roomsCount;
+        w.visits = 0;
+        w.mask   = cache->masks + index * cache->stride;
+        memset(w.mask, 0, cache->stride * sizeof(uint32));
+
+        cache->walk(w, -1, index % cache->level->roomsCount, 0);
+
+        if (w.visits > PVS_MAX_VISITS)
+            memset(w.mask, 0xFF, cache->stride * sizeof(uint32));
+    }
+
+    #undef PVS_MAX_DEPTH
+    #undef PVS_MAX_VISITS
+    #undef PVS_EPS
 };
 
 ShaderCache *shaderCache;
@@ -75,6 +75,34 @@ struct Character : Controller {
         updateZone();
     }
 
+    virtual void getSnapshot(SnapshotEntity &data) {
+        Controller::getSnapshot(data);
+        data.health    = health;
+        data.tilt      = tilt;
+        data.angleExt  = angleExt;
+        data.speed     = speed;
+        data.velocity  = velocity;
+        data.stand     = stand;
+        data.input     = input;
+        data.lastInput = lastInput;
+        data.zone      = zone;
+        data.box       = box;
+    }
+
+    virtual void setSnapshot(const SnapshotEntity &data) {
+        Controller::setSnapshot(data);
+        health    = data.health;
+        tilt      = data.tilt;
+        angleExt  = data.angleExt;
+        speed     = data.speed;
+        velocity  = data.velocity;
+        stand     = Stand(data.stand);
+        input     = data.input;
+        lastInput = data.lastInput;
+        zone      = data.zone;
+        box       = data.box;
+    }
+
     bool isActiveTarget() {
         return flags.state == TR::Entity::asActive && !flags.invisible && health > 0.0f;
     }
@@ -14,6 +14,9 @@
 
 #define UNLIMITED_AMMO  10000
 
+#define GRID_CELL_SHIFT 11  // 2x2 sectors
+#define GRID_SIZE       256 // hash buckets, must be power of two
+
 struct Controller;
 
 struct ICamera {
@@ -61,15 +64,19 @@ struct IGame {
     virtual ICamera*     getCamera(int index = -1)  { return NULL; }
     virtual Controller*  getLara(int index = 0)     { return NULL; }
     virtual Controller*  getLara(const vec3 &pos)   { return NULL; }
+    virtual int          getControllers(const Box &box, Controller **list, int maxCount)                { return 0; }
+    virtual int          getControllers(const vec3 &pos, float radius, Controller **list, int maxCount) { return 0; }
     virtual bool         isCutscene()   { return false; }
     virtual uint16       getRandomBox(uint16 zone, uint16 *zones) { return 0; }
     virtual uint16       findPath(int ascend, int descend, bool big, int boxStart, int boxEnd, uint16 *zones, uint16 **boxes) { return 0; }
+    virtual void         invalidatePaths() {}
     virtual void         flipMap(bool water = true) {}
     virtual void setClipParams(float clipSign, float clipHeight) {}
     virtual void setWaterParams(float height) {}
     virtual void waterDrop(const vec3 &pos, float radius, float strength) {}
     virtual void setShader(Core::Pass pass, Shader::Type type, bool underwater = false, bool alphaTest = false) {}
     virtual void setRoomParams(int roomIndex, Shader::Type type, float diffuse, float ambient, float specular, float alpha, bool alphaTest = false) {}
+    virtual void getAmbientParams(bool water, vec4 &fogParams, vec4 &material) { fogParams = vec4(0.0f); material = vec4(1.0f); }
     virtual void setupBinding() {}
     virtual void getVisibleRooms(int *roomsList, int &roomsCount, int from, int to, const vec4 &viewPort, bool water, int count = 0) {}
     virtual void renderEnvironment(int roomIndex, const vec3 &pos, Texture **targets, int stride = 0, Core::Pass pass = Core::passAmbient) {}
@@ -102,6 +109,12 @@ struct Controller {
     static Controller *first;
     Controller  *next;
 
+// spatial hash of the active controllers (the same set as the first list)
+    static Controller *grid[GRID_SIZE];
+    Controller  *gridNext, *gridPrev;
+    int16       gridX, gridZ;
+    int16       gridIndex;
+
     IGame       *game;
     TR::Level   *level;
     int         entity;
@@ -150,7 +163,7 @@ struct Controller {
 
     float waterLevel, waterDepth;
 
-    Controller(IGame *game, int entity) : next(NULL), game(game), level(game->getLevel()), entity(entity), animation(level, getModel(), level->entities[entity].flags.smooth), state(animation.state), invertAim(false), layers(0), explodeMask(0), explodeParts(0), lastPos(0) {
+    Controller(IGame *game, int entity) : next(NULL), gridNext(NULL), gridPrev(NULL), gridIndex(-1), game(game), level(game->getLevel()), entity(entity), animation(level, getModel(), level->entities[entity].flags.smooth), state(animation.state), invertAim(false), layers(0), explodeMask(0), explodeParts(0), lastPos(0) {
         const TR::Entity &e = getEntity();
         lockMatrix  = false;
         matrix.identity();
@@ -249,22 +262,51 @@ struct Controller {
         //if (s.floor == TR::NO_FLOOR) 
         //    return;
 
-        TR::Room::Sector *sBelow = &s;
-        while (sBelow->roomBelow != TR::NO_ROOM) sBelow = &level->getSector(sBelow->roomBelow, x, z, dx, dz);
-        info.floor = float(256 * sBelow->floor);
-
-        parseFloorData(info, sBelow->floorIndex, dx, dz);
+    #ifdef SECTOR_CACHE
+        const TR::Level::SectorCache::Item *c = level->getSectorCache(roomIndex, x, z);
+        if (c) {
+            info.floor    = float(256 * c->below->floor + TR::Level::getFloorOffset(c->floor, dx, dz, info.slantX, info.slantZ));
+            info.ceiling += float(TR::Level::getCeilingOffset(c->ceilingBelow, dx, dz));
+            info.roomNext = c->roomNext;
+            info.lava     = c->lava;
+            info.climb    = c->climb;
+
+            if (c->trigIndex) {
+                const TR::FloorData *fd = &level->floors[c->trigIndex + 1];
+                info.trigger  = TR::Level::Trigger::Type(c->trigger);
+                info.trigInfo = (*fd++).triggerInfo;
+                TR::FloorData::TriggerCommand trigCmd;
+                do {
+                    trigCmd = (*fd++).triggerCmd;
+                    ASSERT(info.trigCmdCount < MAX_TRIGGER_COMMANDS);
+                    info.trigCmd[info.trigCmdCount++] = trigCmd;
+                } while (!trigCmd.end);
+            }
 
-        if (info.roomNext == TR::NO_ROOM) {
-            TR::Room::Sector *sAbove = &s;
-            while (sAbove->roomAbove != TR::NO_ROOM) sAbove = &level->getSector(sAbove->roomAbove, x, z, dx, dz);
-            if (sAbove != sBelow) {
-                TR::Level::FloorInfo tmpInfo;
-                tmpInfo.ceiling = float(256 * sAbove->ceiling);
-                parseFloorData(tmpInfo, sAbove->floorIndex, dx, dz);
-                info.ceiling = tmpInfo.ceiling;
+            if (info.roomNext == TR::NO_ROOM && c->above != c->below)
+                info.ceiling = float(256 * c->above->ceiling + TR::Level::getCeilingOffset(c->ceiling, dx, dz));
+        } else
+    #endif
+        {
+            TR::Room::Sector *sBelow = &s;
+            while (sBelow->roomBelow != TR::NO_ROOM) sBelow = &level->getSector(sBelow->roomBelow, x, z, dx, dz);
+            info.floor = float(256 * sBelow->floor);
+
+            parseFloorData(info, sBelow->floorIndex, dx, dz);
+
+            if (info.roomNext == TR::NO_ROOM) {
+                TR::Room::Sector *sAbove = &s;
+                while (sAbove->roomAbove != TR::NO_ROOM) sAbove = &level->getSector(sAbove->roomAbove, x, z, dx, dz);
+                if (sAbove != sBelow) {
+                    TR::Level::FloorInfo tmpInfo;
+                    tmpInfo.ceiling = float(256 * sAbove->ceiling);
+                    parseFloorData(tmpInfo, sAbove->floorIndex, dx, dz);
+                    info.ceiling = tmpInfo.ceiling;
+                }
             }
-        } else {
+        }
+
+        if (info.roomNext != TR::NO_ROOM) {
             int tmp = info.roomNext;
             getFloorInfo(tmp, pos, info);
             info.roomNext = tmp;
@@ -597,6 +639,59 @@ struct Controller {
         updateLights(false);
     }
 
+// exact runtime state for the simulation snapshots, the record is zeroed by the caller
+    virtual int getSnapshotSize() {
+        return SnapshotEntity::getSize(-1);
+    }
+
+    virtual void getSnapshot(SnapshotEntity &data) {
+        data.size      = getSnapshotSize();
+        data.pos       = pos;
+        data.angle     = angle;
+        data.timer     = timer;
+        data.flags     = flags.value;
+        data.room      = roomIndex;
+        data.pathCount = -1;
+        if (getModel()) {
+            data.animState     = animation.state;
+            data.animIndex     = animation.index;
+            data.animPrev      = animation.prev;
+            data.animNext      = animation.next;
+            data.animFramePrev = animation.framePrev;
+            data.animTime      = animation.time;
+            data.animTimeMax   = animation.timeMax;
+            data.animDir       = animation.dir;
+            data.animOffset    = animation.offset;
+            data.animJump      = animation.jump;
+            data.animEnded     = animation.isEnded;
+        }
+    }
+
+    virtual void setSnapshot(const SnapshotEntity &data) {
+        pos         = data.pos;
+        angle       = data.angle;
+        timer       = data.timer;
+        flags.value = data.flags;
+        roomIndex   = data.room;
+        if (getModel()) {
+            animation.index     = data.animIndex;
+            animation.prev      = data.animPrev;
+            animation.next      = data.animNext;
+            animation.time      = data.animTime;
+            animation.timeMax   = data.animTimeMax;
+            animation.dir       = data.animDir;
+            animation.offset    = data.animOffset;
+            animation.jump      = data.animJump;
+            animation.isEnded   = data.animEnded != 0;
+            TR::Animation *anim = animation.anims + animation.index;
+            animation.framesCount = anim->frameEnd - anim->frameStart + 1;
+            animation.updateInfo();
+            animation.framePrev = data.animFramePrev;
+            animation.state     = data.animState;
+        }
+        updateLights(false);
+    }
+
     bool isActive(bool timing = true) {
         if (flags.active != TR::ACTIVE)
             return flags.reverse;
@@ -632,6 +727,7 @@ struct Controller {
         flags.state = TR::Entity::asActive;
         next = first;
         first = this;
+        gridUpdate();
         return true;
     }
 
@@ -653,6 +749,7 @@ struct Controller {
                 c = c->next;
             }
             next = NULL;
+            gridRemove();
         }
     }
 
@@ -668,12 +765,91 @@ struct Controller {
                     first = c->next;
                 c->flags.state = TR::Entity::asNone;
                 c->next = NULL;
-            } else
+                c->gridRemove();
+            } else {
+                c->gridUpdate(); // catch up the controllers moved without updateRoom
                 prev = c;
+            }
             c = next;
         }
     }
 
+    void gridRemove() {
+        if (gridIndex == -1)
+            return;
+        if (gridPrev)
+            gridPrev->gridNext = gridNext;
+        else
+            grid[gridIndex] = gridNext;
+        if (gridNext)
+            gridNext->gridPrev = gridPrev;
+        gridNext = gridPrev = NULL;
+        gridIndex = -1;
+    }
+
+    static inline int gridHash(int x, int z) {
+        return ((x * 73856093) ^ (z * 19349663)) & (GRID_SIZE - 1);
+    }
+
+    void gridUpdate() {
+        int x = int(pos.x) >> GRID_CELL_SHIFT;
+        int z = int(pos.z) >> GRID_CELL_SHIFT;
+
+        if (gridIndex != -1 && gridX == x && gridZ == z)
+            return;
+
+        gridRemove();
+        gridX     = x;
+        gridZ     = z;
+        gridIndex = gridHash(x, z);
+        gridNext  = grid[gridIndex];
+        if (gridNext)
+            gridNext->gridPrev = this;
+        grid[gridIndex] = this;
+    }
+
+    static void gridClear() {
+        for (int i = 0; i < GRID_SIZE; i++) {
+            Controller *c = grid[i];
+            while (c) {
+                Controller *next = c->gridNext;
+                c->gridNext = c->gridPrev = NULL;
+                c->gridIndex = -1;
+                c = next;
+            }
+            grid[i] = NULL;
+        }
+    }
+
+    static void gridRebuild() {
+        gridClear();
+        for (Controller *c = first; c; c = c->next)
+            c->gridUpdate();
+    }
+
+// active controllers with the position inside of the box
+    static int gridQuery(const Box &box, Controller **list, int maxCount) {
+        int minX = int(box.min.x) >> GRID_CELL_SHIFT;
+        int minZ = int(box.min.z) >> GRID_CELL_SHIFT;
+        int maxX = int(box.max.x) >> GRID_CELL_SHIFT;
+        int maxZ = int(box.max.z) >> GRID_CELL_SHIFT;
+
+        int count = 0;
+        for (int z = minZ; z <= maxZ; z++)
+            for (int x = minX; x <= maxX; x++) {
+                Controller *c = grid[gridHash(x, z)];
+                while (c) {
+                    if (c->gridX == x && c->gridZ == z && box.contains(c->pos)) { // skip the hash collisions
+                        if (count == maxCount)
+                            return count;
+                        list[count++] = c;
+                    }
+                    c = c->gridNext;
+                }
+            }
+        return count;
+    }
+
     void initMeshOverrides() {
         if (layers) return;
         layers = new MeshLayer[MAX_LAYERS];
@@ -1086,6 +1262,8 @@ struct Controller {
     void updateRoom() {
         level->getSector(roomIndex, pos);
         level->getWaterInfo(getRoomIndex(), pos, waterLevel, waterDepth);
+        if (gridIndex != -1)
+            gridUpdate();
     }
 
     virtual void hit(float damage, Controller *enemy = NULL, TR::HitType hitType = TR::HIT_DEFAULT) {}
@@ -1509,5 +1687,6 @@ struct Controller {
 };
 
 Controller *Controller::first = NULL;
+Controller *Controller::grid[GRID_SIZE];
 
 #endif
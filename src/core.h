@@ -8,9 +8,13 @@
 #include <stdio.h>
 
 #define OS_FILEIO_CACHE
+#define OS_FILEIO_MMAP
 #define OS_PTHREAD_MT
 
-#ifdef WIN32
+#ifdef __HEADLESS__
+    #define _OS_HEADLESS 1
+    #define _GAPI_NULL   1
+#elif defined(WIN32)
     #define _OS_WIN      1
 #ifdef __LIBRETRO__
     #define _GAPI_GL     1
@@ -26,6 +30,7 @@
 
     #include <windows.h>
 
+    #undef OS_FILEIO_MMAP
     #undef OS_PTHREAD_MT
 #elif ANDROID
     #define _OS_ANDROID 1
@@ -71,6 +76,7 @@
     #define _GAPI_GLES 1
 
     #undef  OS_FILEIO_CACHE
+    #undef  OS_FILEIO_MMAP
 
     extern int WEBGL_VERSION;
 #elif _PSP
@@ -82,16 +88,19 @@
     //#define EDRAM_MESH
     #define EDRAM_TEX
 
+    #undef OS_FILEIO_MMAP
     #undef OS_PTHREAD_MT
 #elif __vita__
     #define _OS_PSV   1
     #define _GAPI_GXM 1
 
+    #undef OS_FILEIO_MMAP
     #undef OS_PTHREAD_MT
 #elif __SWITCH__
    #define _OS_NX     1
    #define _GAPI_GL   1
 
+   #undef OS_FILEIO_MMAP
    #undef OS_PTHREAD_MT
 #endif
 
@@ -103,6 +112,11 @@
     #include "libs/tinf/tinf.h"
 #endif
 
+#ifndef _OS_PSP
+    #define ANIM_FRAME_STORE // decode joint rotations of all animation frames at load time
+    #define SECTOR_CACHE     // resolve floor data of all room sectors at load time
+#endif
+
 #ifdef FFP
     #define SPLIT_BY_TILE
     #ifdef _OS_PSP
@@ -114,6 +128,10 @@
     #define GENERATE_WATER_PLANE
 #endif
 
+#if defined(OS_FILEIO_CACHE) && !defined(SPLIT_BY_TILE)
+    #define LEVEL_CACHE // store the built atlas & geometry of the level in cacheDir
+#endif
+
 #include "utils.h"
 
 // muse be equal with base shader
@@ -614,6 +632,8 @@ namespace Core {
     #include "gapi_gxm.h"
 #elif _GAPI_VULKAN
     #include "gapi_vk.h"
+#elif _GAPI_NULL
+    #include "gapi_null.h"
 #endif
 
 #include "texture.h"
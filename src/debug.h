@@ -704,7 +704,7 @@ namespace Debug {
             vec3 viewPos = ((Lara*)controller)->camera->frustum->pos;
 
             char buf[255];
-            sprintf(buf, "DIP = %d, TRI = %d, SND = %d, active = %d", Core::stats.dips, Core::stats.tris, Sound::channelsCount, activeCount);
+            sprintf(buf, "DIP = %d, TRI = %d, SND = %d (steals %d, rejects %d, drops %d), active = %d, anim store = %d KB", Core::stats.dips, Core::stats.tris, Sound::channelsCount, Sound::stats.steals, Sound::stats.rejects, Sound::stats.drops, activeCount, level.getAnimStoreSize() / 1024);
             Debug::Draw::text(vec2(16, y += 16), vec4(1.0f), buf);
             vec3 angle = controller->angle * RAD2DEG;
             sprintf(buf, "pos = (%d, %d, %d), angle = (%d, %d), room = %d (camera: %d [%d, %d, %d])", int(controller->pos.x), int(controller->pos.y), int(controller->pos.z), (int)angle.x, (int)angle.y, controller->getRoomIndex(), game->getCamera()->getRoomIndex(), int(viewPos.x), int(viewPos.y), int(viewPos.z));
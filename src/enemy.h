@@ -10,6 +10,9 @@
 
 #define MAX_SHOT_DIST   (64 * 1024)
 
+#define ENEMY_RADIUS_MAX    341
+#define COLLIDE_ENEMIES_MAX 64
+
 struct Enemy : Character {
 
     struct Path {
@@ -76,6 +79,7 @@ struct Enemy : Character {
     bool  targetFromView;   // enemy in target view zone
     bool  targetCanAttack;
 
+
     Enemy(IGame *game, int entity, float health, int radius, float length, float aggression) : Character(game, entity, health), ai(AI_RANDOM), mood(MOOD_SLEEP), wound(false), nextState(0), targetBox(TR::NO_BOX), thinkTime(1.0f / 30.0f), length(length), aggression(aggression), radius(radius), hitSound(-1), target(NULL), path(NULL) {
         targetDist   = +INF;
         targetInView = targetFromView = targetCanAttack = false;
@@ -103,6 +107,55 @@ struct Enemy : Character {
         updateZone();
     }
 
+    virtual int getSnapshotSize() {
+        return SnapshotEntity::getSize(path ? path->count - path->index : -1);
+    }
+
+    virtual void getSnapshot(SnapshotEntity &data) {
+        Character::getSnapshot(data);
+        data.ai              = ai;
+        data.mood            = mood;
+        data.nextState       = nextState;
+        data.thinkTime       = thinkTime;
+        data.targetDist      = targetDist;
+        data.targetAngle     = targetAngle;
+        data.waypoint        = waypoint;
+        data.targetBox       = targetBox;
+        data.target          = target ? target->entity : -1;
+        data.wound           = wound;
+        data.targetDead      = targetDead;
+        data.targetInView    = targetInView;
+        data.targetFromView  = targetFromView;
+        data.targetCanAttack = targetCanAttack;
+        if (path) { // remaining boxes only
+            data.pathCount = path->count - path->index;
+            memcpy(data.pathBoxes, path->boxes + path->index, data.pathCount * sizeof(uint16));
+        }
+    }
+
+    virtual void setSnapshot(const SnapshotEntity &data) {
+        Character::setSnapshot(data);
+        ai              = AI(data.ai);
+        mood            = Mood(data.mood);
+        nextState       = data.nextState;
+        thinkTime       = data.thinkTime;
+        targetDist      = data.targetDist;
+        targetAngle     = data.targetAngle;
+        waypoint        = data.waypoint;
+        targetBox       = data.targetBox;
+        target          = data.target == -1 ? NULL : (Character*)level->entities[data.target].controller;
+        wound           = data.wound != 0;
+        targetDead      = data.targetDead != 0;
+        targetInView    = data.targetInView != 0;
+        targetFromView  = data.targetFromView != 0;
+        targetCanAttack = data.targetCanAttack != 0;
+
+        delete path;
+        path = NULL;
+        if (data.pathCount >= 0)
+            path = new Path(level, (uint16*)data.pathBoxes, data.pathCount);
+    }
+
     virtual bool activate() {
         return health > 0.0f && Character::activate();
     }
@@ -161,8 +214,12 @@ struct Enemy : Character {
         if (getEntity().isBigEnemy())
             return;
 
-        Controller *c = Controller::first;
-        while (c) {
+        Controller *list[COLLIDE_ENEMIES_MAX];
+        float r = float(radius + ENEMY_RADIUS_MAX) / 2;
+        int count = game->getControllers(Box(vec3(pos.x - r, -INF, pos.z - r), vec3(pos.x + r, INF, pos.z + r)), list, COUNT(list));
+
+        for (int i = 0; i < count; i++) {
+            Controller *c = list[i];
             if (c != this && c->getEntity().isEnemy()) {
                 Enemy *enemy = (Enemy*)c;
                 if (enemy->health > 0.0f) {
@@ -175,7 +232,6 @@ struct Enemy : Character {
                     }
                 }
             }
-            c = c->next;
         }
     }
 
@@ -2113,7 +2113,7 @@ namespace TR {
 
             if (version & (VER_TR2 | VER_TR3)) {
 
-                // TODO: remove this !!!
+                // random access, pose evaluation decodes all joints in one pass by getAngles
                 for (int i = 0; i < joint; i++)
                     if (!(angles[index++] & 0xC000))
                         index++;
@@ -2133,6 +2133,46 @@ namespace TR {
             return vec3(0);
         }
 
+        // decode angles of the first count joints in one pass as 10-bit fixed point (x, y, z) triples
+        void getAngles(Version version, int count, uint16 *xyz) {
+            int index = 0;
+
+            if (version & VER_TR1) {
+                for (int i = 0; i < count; i++, xyz += 3) {
+                    index = i * 2 + 1;
+                    uint16 b = angles[index++];
+                    uint16 a = angles[index++];
+                    if (version & VER_SAT)
+                        swap(a, b);
+                    xyz[0] = (a & 0x3FF0) >> 4;
+                    xyz[1] = ((a & 0x000F) << 6) | ((b & 0xFC00) >> 10);
+                    xyz[2] = b & 0x03FF;
+                }
+                return;
+            }
+
+            if (version & (VER_TR2 | VER_TR3)) {
+                for (int i = 0; i < count; i++, xyz += 3) {
+                    uint16 a = angles[index++];
+                    xyz[0] = xyz[1] = xyz[2] = 0;
+                    switch (a & 0xC000) {
+                        case 0x4000 : xyz[0] = a & 0x03FF; break;
+                        case 0x8000 : xyz[1] = a & 0x03FF; break;
+                        case 0xC000 : xyz[2] = a & 0x03FF; break;
+                        default     : {
+                            uint16 b = angles[index++];
+                            xyz[0] = (a & 0x3FF0) >> 4;
+                            xyz[1] = ((a & 0x000F) << 6) | ((b & 0xFC00) >> 10);
+                            xyz[2] = b & 0x03FF;
+                        }
+                    }
+                }
+                return;
+            }
+
+            memset(xyz, 0, sizeof(uint16) * 3 * count);
+        }
+
         #undef ANGLE_SCALE
     };
 
@@ -2314,6 +2354,42 @@ namespace TR {
         int32           frameDataSize;
         uint16          *frameData;
 
+        struct AnimFrameStore {     // joint rotations of animation frames as quantized quaternions
+            int32   *offsets;       // per animation, index of the first frame rotation in data
+            uint16  *framesCount;   // per animation
+            uint8   *jointsCount;   // per animation, 0 if not decoded
+            short4  *data;
+            int32   dataSize;
+        } animStore;
+
+        struct SectorCache {        // floor data of the room sectors resolved through the roomBelow/roomAbove chains
+            struct Plane {
+                uint8   split;      // FloorData::FLOOR or CEILING for a single plane, triangle split function otherwise
+                int8    tri[2];     // height offsets of the triangles (a, b)
+                int8    slantX[2];
+                int8    slantZ[2];
+            };
+
+            struct Item {
+                Room::Sector *below;    // end of the roomBelow chain, floor height is read from it
+                Room::Sector *above;    // end of the roomAbove chain
+                Plane   floor;          // of the below sector
+                Plane   ceilingBelow;   // ceiling of the below sector
+                Plane   ceiling;        // of the above sector
+                int32   trigIndex;      // trigger command of the below sector in floors, 0 if none
+                uint8   trigger;
+                uint8   roomNext;
+                uint8   lava;
+                uint8   climb;
+                uint8   exact;          // 0 for the sectors with unaligned rooms in the chains, use the floor data parser
+            };
+
+            int32   *offsets;           // per room, index of the first sector item
+            Item    *items;
+            int32   count;
+            bool    dirty;
+        } sectorCache;
+
         int32           modelsCount;
         Model           *models;
 
@@ -2396,6 +2472,9 @@ namespace TR {
         uint32          *soundOffsets;
         uint32          *soundSize;
 
+        StreamMap       *levelMap; // zero-copy arrays (floors, frames, sound data) point into the mapped files
+        StreamMap       *sfxMap;
+
         Color32         skyColor;
 
    // common
@@ -2544,6 +2623,20 @@ namespace TR {
         uint32 tsubCount;
         uint8 *tsub;
 
+    // empty level to take the data of the level parsed in background
+        Level() {
+            memset(this, 0, sizeof(*this));
+        }
+
+    // moves the data, the source is left empty and can be deleted
+        void take(Level &src) {
+            ASSERT(!roomsCount && !entitiesCount);
+            memcpy(this, &src, sizeof(*this));
+            memset(&src, 0, sizeof(src));
+        }
+
+        Level(const Level &src); // not copyable (owns the data), use take
+
         Level(Stream &stream) {
             memset(this, 0, sizeof(*this));
             version  = VER_UNKNOWN;
@@ -2661,14 +2754,14 @@ namespace TR {
                     soundOffsets[i] = soundDataSize;
                     soundDataSize  += soundSize[i];
                 }
-                stream.read(soundData, soundDataSize);
+                stream.readMapped(soundData, soundDataSize, levelMap);
             }
 
             if (version == VER_TR3_PSX) {
                 stream.read(soundOffsets, stream.read(soundOffsetsCount));
                 if (soundOffsetsCount) {
                     stream.read(soundDataSize);
-                    stream.read(soundData, soundDataSize);
+                    stream.readMapped(soundData, soundDataSize, levelMap);
                     soundSize = new uint32[soundOffsetsCount];
                     int size = 0;
                     for (int i = 0; i < soundOffsetsCount - 1; i++) {
@@ -2721,7 +2814,7 @@ namespace TR {
                 }           
             // sound data
                 stream.setPos(startPos + 2600 + numSounds * 512);
-                stream.read(soundData, soundDataSize);
+                stream.readMapped(soundData, soundDataSize, levelMap);
                 stream.setPos(startPos + offsetTexTiles + 8);
             }
 
@@ -2747,7 +2840,7 @@ namespace TR {
                 readRoom(stream, i);
 
         // floors
-            stream.read(floors, stream.read(floorsCount));
+            stream.readMapped(floors, stream.read(floorsCount), levelMap);
 
             if (version == VER_TR3_PSX) {
                 // outside room offsets
@@ -2772,7 +2865,7 @@ namespace TR {
             stream.read(ranges,    stream.read(rangesCount));
             stream.read(commands,  stream.read(commandsCount));
             stream.read(nodesData, stream.read(nodesDataSize));
-            stream.read(frameData, stream.read(frameDataSize));
+            stream.readMapped(frameData, stream.read(frameDataSize), levelMap);
         // models
             models = stream.read(modelsCount) ? new Model[modelsCount] : NULL;
             for (int i = 0; i < modelsCount; i++) {
@@ -2921,7 +3014,7 @@ namespace TR {
                 stream.seek(4);
 
             if (version == VER_TR1_PC) {
-                stream.read(soundData,    stream.read(soundDataSize));
+                stream.readMapped(soundData, stream.read(soundDataSize), levelMap);
                 stream.read(soundOffsets, stream.read(soundOffsetsCount));
             }
 
@@ -2953,14 +3046,20 @@ namespace TR {
                 delete[] r.meshes;
             }
             delete[] rooms;
-            delete[] floors;
+            freeData(floors);
             delete[] meshOffsets;
             delete[] anims;
             delete[] states;
             delete[] ranges;
             delete[] commands;
             delete[] nodesData;
-            delete[] frameData;
+            freeData(frameData);
+            delete[] animStore.offsets;
+            delete[] animStore.framesCount;
+            delete[] animStore.jointsCount;
+            delete[] animStore.data;
+            delete[] sectorCache.offsets;
+            delete[] sectorCache.items;
             delete[] models;
             delete[] staticMeshes;
             delete[] objectTextures;
@@ -2997,11 +3096,21 @@ namespace TR {
             delete[] demoData;
             delete[] soundsMap;
             delete[] soundsInfo;
-            delete[] soundData;
+            freeData(soundData);
             delete[] soundOffsets;
             delete[] soundSize;
 
             delete[] tsub;
+
+            if (levelMap) levelMap->release();
+            if (sfxMap)   sfxMap->release();
+        }
+
+        template <typename T>
+        void freeData(T *data) {
+            if ((levelMap && levelMap->contains(data)) || (sfxMap && sfxMap->contains(data)))
+                return;
+            delete[] data;
         }
 
         #define CHUNK(str) ((uint64)((const char*)(str))[0]        | ((uint64)((const char*)(str))[1] << 8)  | ((uint64)((const char*)(str))[2] << 16) | ((uint64)((const char*)(str))[3] << 24) | \
@@ -3841,7 +3950,16 @@ namespace TR {
             initAnimTex();
             initExtra();
             initCutscene();
+        #ifdef ANIM_FRAME_STORE
+            initAnimStore();
+        #endif
+        #ifdef SECTOR_CACHE
+            initSectorCache();
+        #endif
+        }
 
+    // the level can be parsed in background, so the active level sets the globals by itself
+        void initGlobals() {
             gObjectTextures      = objectTextures;
             gSpriteTextures      = spriteTextures;
             gObjectTexturesCount = objectTexturesCount;
@@ -3849,7 +3967,7 @@ namespace TR {
         }
 
         void readSamples(Stream &stream) {
-            stream.read(soundData, soundDataSize = stream.size);
+            stream.readMapped(soundData, soundDataSize = stream.size, sfxMap);
 
             int32 dataOffsets[512];
             int32 dataOffsetsCount = 0;
@@ -3875,6 +3993,339 @@ namespace TR {
         }
 
 
+    #ifdef ANIM_FRAME_STORE
+        int getFrameSize(const Animation &anim, int jointsCount) const {
+            return anim.frameSize ? anim.frameSize : (sizeof(AnimFrame) / 2 + jointsCount * 2);
+        }
+
+        void initAnimStore() {
+            AnimFrameStore &s = animStore;
+            if (!animsCount) return;
+
+            s.offsets     = new int32[animsCount];
+            s.framesCount = new uint16[animsCount];
+            s.jointsCount = new uint8[animsCount];
+            memset(s.jointsCount, 0, animsCount);
+
+        // animations of the model are in [model.animation, next model animation) range
+            for (int i = 0; i < modelsCount; i++) {
+                const Model &m = models[i];
+                if (m.animation >= animsCount || !m.mCount || m.mCount > 255)
+                    continue;
+
+                int end = animsCount;
+                for (int j = 0; j < modelsCount; j++)
+                    if (models[j].animation > m.animation && models[j].animation < end)
+                        end = models[j].animation;
+
+                for (int j = m.animation; j < end; j++)
+                    s.jointsCount[j] = max(s.jointsCount[j], uint8(m.mCount));
+            }
+
+            s.dataSize = 0;
+            for (int i = 0; i < animsCount; i++) {
+                const Animation &anim = anims[i];
+                int count = 0;
+
+                if (s.jointsCount[i] && anim.frameEnd >= anim.frameStart) {
+                    count = (anim.frameEnd - anim.frameStart) / max(int(anim.frameRate), 1) + 1;
+                // don't run out of the frame data
+                    int frameSize = getFrameSize(anim, s.jointsCount[i]);
+                    count = clamp((frameDataSize - int(anim.frameOffset / 2)) / max(frameSize, 1), 0, count);
+                }
+
+                s.offsets[i]     = s.dataSize;
+                s.framesCount[i] = count;
+                s.dataSize      += count * s.jointsCount[i];
+            }
+
+            s.data = s.dataSize ? new short4[s.dataSize] : NULL;
+
+            uint16 xyz[255 * 3];
+            for (int i = 0; i < animsCount; i++) {
+                const Animation &anim = anims[i];
+                int jCount    = s.jointsCount[i];
+                int frameSize = getFrameSize(anim, jCount);
+                short4 *rot   = s.data + s.offsets[i];
+
+                for (int j = 0; j < s.framesCount[i]; j++) {
+                    AnimFrame *frame = (AnimFrame*)&frameData[anim.frameOffset / 2 + j * frameSize];
+                    frame->getAngles(version, jCount, xyz);
+
+                    for (int k = 0; k < jCount; k++) {
+                        quat q = rotYXZ(vec3(xyz[k * 3 + 0], xyz[k * 3 + 1], xyz[k * 3 + 2]) * (2.0f * PI / 1024.0f));
+                        *rot++ = short4(int16(roundf(q.x * 32767.0f)), int16(roundf(q.y * 32767.0f)), int16(roundf(q.z * 32767.0f)), int16(roundf(q.w * 32767.0f)));
+                    }
+                }
+            }
+
+            LOG("anim frames: %d KB\n", getAnimStoreSize() / 1024);
+        }
+
+        const short4* getAnimFrameRots(int animIndex, int frameIndex, int jointsCount) const {
+            if (!animStore.data || animStore.jointsCount[animIndex] != jointsCount || frameIndex >= animStore.framesCount[animIndex])
+                return NULL;
+            return animStore.data + animStore.offsets[animIndex] + frameIndex * jointsCount;
+        }
+    #endif
+
+        int getAnimStoreSize() const {
+            if (!animStore.data) return 0;
+            return animStore.dataSize * sizeof(short4) + animsCount * (sizeof(int32) + sizeof(uint16) + sizeof(uint8));
+        }
+
+    #ifdef SECTOR_CACHE
+        void initSectorCache() {
+            SectorCache &c = sectorCache;
+
+            delete[] c.offsets;
+            c.offsets = new int32[roomsCount];
+
+            c.count = 0;
+            for (int i = 0; i < roomsCount; i++) {
+                c.offsets[i] = c.count;
+                c.count += rooms[i].xSectors * rooms[i].zSectors;
+            }
+
+            delete[] c.items;
+            c.items = c.count ? new SectorCache::Item[c.count] : NULL;
+            c.dirty = true;
+
+            updateSectorCache();
+
+            LOG("sector cache: %d KB\n", getSectorCacheSize() / 1024);
+        }
+
+    // rebuild the cache after flipmap or doors changed the sectors
+        void updateSectorCache() {
+            SectorCache &c = sectorCache;
+            if (!c.dirty || !c.items) return;
+
+            for (int i = 0; i < roomsCount; i++) {
+                Room &room = rooms[i];
+                SectorCache::Item *item = c.items + c.offsets[i];
+
+                for (int sx = 0; sx < room.xSectors; sx++)
+                    for (int sz = 0; sz < room.zSectors; sz++)
+                        resolveSector(*item++, room.info.x + sx * 1024, room.info.z + sz * 1024, &room.sectors[sx * room.zSectors + sz]);
+            }
+
+            c.dirty = false;
+        }
+
+    // the sector of the room contains the whole 1024x1024 cell at x, z
+        bool sectorAligned(int roomIndex, int x, int z) const {
+            const Room &room = rooms[roomIndex];
+            int sx = x - room.info.x;
+            int sz = z - room.info.z;
+            return (sx % 1024) == 0 && (sz % 1024) == 0 && sx >= 0 && sz >= 0 && sx < room.xSectors * 1024 && sz < room.zSectors * 1024;
+        }
+
+        Room::Sector* resolveChain(Room::Sector *sector, int x, int z, bool below, bool &exact) {
+            int dx, dz;
+            for (int i = 0; i < roomsCount; i++) {
+                int next = below ? sector->roomBelow : sector->roomAbove;
+                if (next == NO_ROOM)
+                    return sector;
+                if (!sectorAligned(next, x, z))
+                    exact = false;
+                sector = &getSector(next, x, z, dx, dz);
+            }
+            exact = false; // looped chain
+            return sector;
+        }
+
+        void resolvePlane(SectorCache::Plane &plane, FloorData *fd, FloorData::Command cmd) {
+            plane.split = cmd.func;
+            if (cmd.func == FloorData::FLOOR || cmd.func == FloorData::CEILING) {
+                plane.tri[0]    = plane.tri[1]    = 0;
+                plane.slantX[0] = plane.slantX[1] = fd->slantX;
+                plane.slantZ[0] = plane.slantZ[1] = fd->slantZ;
+                return;
+            }
+
+            plane.tri[0] = cmd.triangle.a;
+            plane.tri[1] = cmd.triangle.b;
+
+            switch (cmd.func) {
+                case FloorData::FLOOR_NW_SE_SOLID       :
+                case FloorData::FLOOR_NW_SE_PORTAL_SE   :
+                case FloorData::FLOOR_NW_SE_PORTAL_NW   :
+                    plane.slantX[0] = fd->d - fd->c; plane.slantZ[0] = fd->d - fd->a;
+                    plane.slantX[1] = fd->a - fd->b; plane.slantZ[1] = fd->c - fd->b;
+                    break;
+                case FloorData::FLOOR_NE_SW_SOLID       :
+                case FloorData::FLOOR_NE_SW_PORTAL_SW   :
+                case FloorData::FLOOR_NE_SW_PORTAL_NE   :
+                    plane.slantX[0] = fd->a - fd->b; plane.slantZ[0] = fd->d - fd->a;
+                    plane.slantX[1] = fd->d - fd->c; plane.slantZ[1] = fd->c - fd->b;
+                    break;
+                case FloorData::CEILING_NW_SE_SOLID     :
+                case FloorData::CEILING_NW_SE_PORTAL_SE :
+                case FloorData::CEILING_NW_SE_PORTAL_NW :
+                    plane.slantX[0] = fd->b - fd->a; plane.slantZ[0] = fd->a - fd->d;
+                    plane.slantX[1] = fd->c - fd->d; plane.slantZ[1] = fd->b - fd->c;
+                    break;
+                default : // CEILING_NE_SW_*
+                    plane.slantX[0] = fd->c - fd->d; plane.slantZ[0] = fd->a - fd->d;
+                    plane.slantX[1] = fd->b - fd->a; plane.slantZ[1] = fd->b - fd->c;
+            }
+        }
+
+        static bool isFloorFunc(int func) {
+            return func == FloorData::FLOOR
+                || func == FloorData::FLOOR_NW_SE_SOLID
+                || func == FloorData::FLOOR_NE_SW_SOLID
+                || func == FloorData::FLOOR_NW_SE_PORTAL_SE
+                || func == FloorData::FLOOR_NW_SE_PORTAL_NW
+                || func == FloorData::FLOOR_NE_SW_PORTAL_SW
+                || func == FloorData::FLOOR_NE_SW_PORTAL_NE;
+        }
+
+        static bool isCeilingFunc(int func) {
+            return func == FloorData::CEILING
+                || func == FloorData::CEILING_NW_SE_SOLID
+                || func == FloorData::CEILING_NE_SW_SOLID
+                || func == FloorData::CEILING_NW_SE_PORTAL_SE
+                || func == FloorData::CEILING_NW_SE_PORTAL_NW
+                || func == FloorData::CEILING_NE_SW_PORTAL_SW
+                || func == FloorData::CEILING_NE_SW_PORTAL_NE;
+        }
+
+    // decodes floor data of the sector, the rest of fields are untouched
+        void resolveFloorData(SectorCache::Item &item, SectorCache::Plane &floor, SectorCache::Plane &ceiling, const Room::Sector *sector, bool triggers) {
+            floor.split   = FloorData::FLOOR;
+            ceiling.split = FloorData::CEILING;
+            floor.tri[0]    = floor.tri[1]    = ceiling.tri[0]    = ceiling.tri[1]    = 0;
+            floor.slantX[0] = floor.slantX[1] = ceiling.slantX[0] = ceiling.slantX[1] = 0;
+            floor.slantZ[0] = floor.slantZ[1] = ceiling.slantZ[0] = ceiling.slantZ[1] = 0;
+
+            if (!sector->floorIndex) return;
+
+            FloorData *fd = &floors[sector->floorIndex];
+            FloorData::Command cmd;
+            int floorCount = 0, ceilingCount = 0;
+
+            do {
+                cmd = (*fd++).cmd;
+
+                if (isFloorFunc(cmd.func)) {
+                    resolvePlane(floor, fd++, cmd);
+                    floorCount++;
+                    continue;
+                }
+
+                if (isCeilingFunc(cmd.func)) {
+                    resolvePlane(ceiling, fd++, cmd);
+                    ceilingCount++;
+                    continue;
+                }
+
+                switch (cmd.func) {
+                    case FloorData::PORTAL :
+                        if (triggers) item.roomNext = uint8((*fd).value);
+                        fd++;
+                        break;
+
+                    case FloorData::TRIGGER : {
+                        if (triggers && !item.trigIndex) {
+                            item.trigIndex = int32(fd - 1 - floors);
+                            item.trigger   = cmd.sub;
+                        }
+                        fd++; // trigger info
+                        while (!(*fd++).triggerCmd.end);
+                        break;
+                    }
+
+                    case FloorData::LAVA :
+                        if (triggers) item.lava = true;
+                        break;
+
+                    case FloorData::CLIMB :
+                        if (triggers) item.climb = cmd.sub;
+                        break;
+
+                    case FloorData::MONKEY         :
+                    case FloorData::MINECART_LEFT  :
+                    case FloorData::MINECART_RIGHT : break;
+
+                    default : item.exact = false; // unknown function, let the parser report it
+                }
+            } while (!cmd.end);
+
+            if (floorCount > 1 || ceilingCount > 1) // the parser accumulates them
+                item.exact = false;
+        }
+
+        void resolveSector(SectorCache::Item &item, int x, int z, Room::Sector *sector) {
+            bool exact = true;
+
+            item.trigIndex = 0;
+            item.trigger   = 0;
+            item.roomNext  = NO_ROOM;
+            item.lava      = false;
+            item.climb     = 0;
+
+            item.below = resolveChain(sector, x, z, true,  exact);
+            item.above = resolveChain(sector, x, z, false, exact);
+
+            item.exact = true;
+            SectorCache::Plane dummy;
+            resolveFloorData(item, item.floor, item.ceilingBelow, item.below, true);
+            resolveFloorData(item, dummy, item.ceiling, item.above, false);
+            item.exact = item.exact && exact;
+        }
+
+        const SectorCache::Item* getSectorCache(int roomIndex, int x, int z) const {
+            const SectorCache &c = sectorCache;
+            if (c.dirty || !c.items) return NULL;
+
+            const Room &room = rooms[roomIndex];
+            int sx = x - room.info.x;
+            int sz = z - room.info.z;
+            if (sx < 0 || sz < 0 || sx >= room.xSectors * 1024 || sz >= room.zSectors * 1024)
+                return NULL; // clamped by the room bounds
+
+            const SectorCache::Item *item = c.items + c.offsets[roomIndex] + (sx / 1024) * room.zSectors + (sz / 1024);
+            return item->exact ? item : NULL;
+        }
+
+        static int getFloorOffset(const SectorCache::Plane &p, int dx, int dz, int &slantX, int &slantZ) {
+            int i = 0;
+            if (p.split != FloorData::FLOOR) {
+                if (p.split == FloorData::FLOOR_NW_SE_SOLID || p.split == FloorData::FLOOR_NW_SE_PORTAL_SE || p.split == FloorData::FLOOR_NW_SE_PORTAL_NW)
+                    i = (dx <= 1024 - dz) ? 1 : 0;
+                else
+                    i = (dx <= dz) ? 1 : 0;
+            }
+            int sx = slantX = p.slantX[i];
+            int sz = slantZ = p.slantZ[i];
+            return p.tri[i] * 256 - (sx * (sx > 0 ? (dx - 1023) : dx) >> 2) - (sz * (sz > 0 ? (dz - 1023) : dz) >> 2);
+        }
+
+        static int getCeilingOffset(const SectorCache::Plane &p, int dx, int dz) {
+            int i = 0;
+            if (p.split != FloorData::CEILING) {
+                if (p.split == FloorData::CEILING_NW_SE_SOLID || p.split == FloorData::CEILING_NW_SE_PORTAL_SE || p.split == FloorData::CEILING_NW_SE_PORTAL_NW)
+                    i = (dx <= 1024 - dz) ? 1 : 0;
+                else
+                    i = (dx <= dz) ? 1 : 0;
+            }
+            int sx = p.slantX[i];
+            int sz = p.slantZ[i];
+            return p.tri[i] * 256 - (sx * (sx < 0 ? (dx - 1023) : dx) >> 2) + (sz * (sz > 0 ? (dz - 1023) : dz) >> 2);
+        }
+    #endif
+
+        void invalidateSectorCache() {
+            sectorCache.dirty = true;
+        }
+
+        int getSectorCacheSize() const {
+            if (!sectorCache.items) return 0;
+            return sectorCache.count * sizeof(SectorCache::Item) + roomsCount * sizeof(int32);
+        }
+
         void initExtra() {
         // get special models indices
             memset(&extra, 0xFF, sizeof(extra));
@@ -5494,6 +5945,7 @@ namespace TR {
                     swap(src.alternateRoom, dst.alternateRoom);
                 }
             state.flags.flipped = !state.flags.flipped;
+            invalidateSectorCache();
         }
 
         void floorSkipCommand(FloorData* &fd, int func) {
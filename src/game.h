@@ -16,6 +16,43 @@ namespace Game {
     Stream     *nextLevel;
     ControlKey cheatSeq[MAX_CHEAT_SEQUENCE];
 
+// the next level of the gameflow is parsed in background while the current one is running
+    struct Preload {
+        Jobs::Background task;
+        char             fileName[255];
+        TR::Level        *data;
+        uint32           cacheKey;
+        bool             ready; // requested by the current level (see loadLevelPreloaded)
+    } preload;
+
+    void preloadLevelAsync(Stream *stream, void *userData) {
+        if (!stream) return;
+        preload.cacheKey = Level::getCacheKey(*stream);
+        preload.data     = new TR::Level(*stream);
+        delete stream;
+    }
+
+    void preloadProc(void *userData) {
+        new Stream(preload.fileName, preloadLevelAsync);
+    }
+
+    void freePreload() {
+        Jobs::wait(preload.task);
+        delete preload.data;
+        preload.data  = NULL;
+        preload.ready = false;
+        preload.fileName[0] = 0;
+    }
+
+    void startPreload(TR::LevelID id) {
+        freePreload();
+    #if !defined(_OS_WEB) && !defined(_OS_HEADLESS) // async file IO, the background parsing skews the headless benchmarks
+        TR::getGameLevelFile(preload.fileName, level->level.version, id);
+        if (!Jobs::startBackground(preload.task, preloadProc, NULL))
+            preload.fileName[0] = 0;
+    #endif
+    }
+
     void cheatControl(ControlKey key) {
         if (key == cMAX || !level || level->level.isTitle() || level->level.isCutsceneLevel()) return;
         const ControlKey CHEAT_ALL_WEAPONS[] = { cLook, cWeapon, cDash, cDuck, cDuck, cDash, cRoll, cLook };
@@ -46,8 +83,20 @@ namespace Game {
         if (loadSlot != -1)
             playVideo = !saveSlots[loadSlot].isCheckpoint();
 
+        TR::Level *data = NULL;
+        if (preload.ready) {
+            data = preload.data;
+            preload.data = NULL;
+        }
+        uint32 cacheKey = preload.cacheKey;
+        freePreload();
+
         delete level;
-        level = new Level(*lvl);
+        if (data) {
+            level = new Level(*data, cacheKey);
+            delete data;
+        } else
+            level = new Level(*lvl);
 
         bool playLogo = level->level.isTitle() && id == TR::LVL_MAX;
         playVideo = playVideo && (id != level->level.id);
@@ -62,9 +111,25 @@ namespace Game {
             UI::helpTipTime = 5.0f;
         #endif
         delete lvl;
+
+        if (!level->level.isTitle())
+            startPreload(level->getNextLevelID());
     }
 }
 
+bool loadLevelPreloaded(const char *fileName) {
+    Game::Preload &preload = Game::preload;
+    if (!preload.fileName[0] || strcmp(preload.fileName, fileName))
+        return false;
+
+    Jobs::wait(preload.task); // usually it's already done
+    if (!preload.data)
+        return false;
+
+    preload.ready = true;
+    return true;
+}
+
 void loadLevelAsync(Stream *stream, void *userData) {
     if (!stream) {
         if (Game::level) Game::level->isEnded = false;
@@ -128,11 +193,13 @@ namespace Game {
         loadSlot    = -1;
         nextLevel   = NULL;
         shaderCache = NULL;
+        memset(&preload, 0, sizeof(preload));
         level       = NULL;
 
         memset(cheatSeq, 0, sizeof(cheatSeq));
 
         Core::init();
+        Jobs::init();
         Sound::callback = stopChannel;
 
         if (lvl->size == -1) {
@@ -169,14 +236,18 @@ namespace Game {
         #ifdef DEBUG_RENDER
             Debug::deinit();
         #endif
+        freePreload();
         delete inventory;
         delete level;
         UI::deinit();
         delete shaderCache;
+        Jobs::deinit();
         Core::deinit();
     }
 
     void updateTick() {
+        PROFILE_MARKER("TICK");
+
         Input::update();
         Network::update();
 
@@ -207,14 +278,16 @@ namespace Game {
 
         PROFILE_MARKER("UPDATE");
 
-#ifndef __LIBRETRO__
+#if !defined(__LIBRETRO__) && !defined(_OS_HEADLESS)
         if (!Core::update())
             return false;
 #endif
 
+        Sound::update(); // release channels finished by the mixer
+
         float delta = Core::deltaTime;
 
-        if (nextLevel) {
+        if (nextLevel || preload.ready) {
             startLevel(nextLevel);
             nextLevel = NULL;
         }
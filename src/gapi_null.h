@@ -0,0 +1,222 @@
+#ifndef H_GAPI_NULL
+#define H_GAPI_NULL
+
+#include "core.h"
+
+// null GAPI for headless builds, all draw calls are no-op
+// PROFILE_MARKER measures CPU time of the marked scope (there is no GPU to query)
+
+#define MAX_PROFILE_MARKERS 32
+
+extern int64 osGetTimeMCS();
+
+namespace GAPI {
+
+    using namespace Core;
+
+    typedef ::Vertex Vertex;
+
+// Profile
+    struct MarkerStat {
+        const char *title;
+        int64      time; // inclusive
+        int64      self; // without the time of the nested markers
+        int        count;
+        int        depth;
+    } markerStats[MAX_PROFILE_MARKERS];
+    int markerStatsCount;
+
+    struct Marker *markerTop; // innermost open marker, all markers are on the game thread
+
+    struct Marker {
+        MarkerStat *stat;
+        Marker     *parent;
+        int64      start;
+        int64      childTime;
+
+        Marker(const char *title) : stat(NULL), parent(NULL) {
+            for (int i = 0; i < markerStatsCount; i++)
+                if (markerStats[i].title == title || !strcmp(markerStats[i].title, title)) {
+                    stat = &markerStats[i];
+                    break;
+                }
+
+            if (!stat) {
+                if (markerStatsCount == MAX_PROFILE_MARKERS)
+                    return;
+                stat = &markerStats[markerStatsCount++];
+                stat->title = title;
+                stat->time  = 0;
+                stat->self  = 0;
+                stat->count = 0;
+                stat->depth = markerTop ? markerTop->stat->depth + 1 : 0;
+            }
+
+            parent    = markerTop;
+            markerTop = this;
+            childTime = 0;
+            start     = osGetTimeMCS();
+        }
+
+        ~Marker() {
+            if (!stat) return;
+            int64 time = osGetTimeMCS() - start;
+            stat->time += time;
+            stat->self += time - childTime;
+            stat->count++;
+
+            if (parent)
+                parent->childTime += time;
+            markerTop = parent;
+        }
+    };
+
+    void resetMarkers() {
+        markerStatsCount = 0;
+        markerTop        = NULL;
+    }
+
+    #define PROFILE_MARKER(title)           GAPI::Marker marker(title)
+    #define PROFILE_LABEL(id, name, label)
+    #define PROFILE_TIMING(time)
+
+// Shader
+    struct Shader {
+        void init(Pass pass, int type, int *def, int defCount) {}
+        void deinit() {}
+        void bind() {
+            Core::active.shader = this;
+        }
+        void setParam(UniformType uType, const vec4  &value, int count = 1) {}
+        void setParam(UniformType uType, const mat4  &value, int count = 1) {}
+        void setParam(UniformType uType, const Basis &value, int count = 1) {}
+    };
+
+// Texture
+    struct Texture {
+        int        width, height, depth, origWidth, origHeight, origDepth;
+        TexFormat  fmt;
+        uint32     opt;
+
+        Texture(int width, int height, int depth, uint32 opt) : width(width), height(height), depth(depth), origWidth(width), origHeight(height), origDepth(depth), fmt(FMT_RGBA), opt(opt) {}
+
+        void init(void *data) {}
+        void deinit() {}
+        void generateMipMap() {}
+        void update(void *data) {}
+
+        void bind(int sampler) {
+            Core::active.textures[sampler] = this;
+        }
+
+        void unbind(int sampler) {
+            Core::active.textures[sampler] = NULL;
+        }
+
+        void setFilterQuality(int value) {}
+    };
+
+// Mesh
+    struct Mesh {
+        int  iCount;
+        int  vCount;
+        bool dynamic;
+
+        Mesh(bool dynamic) : iCount(0), vCount(0), dynamic(dynamic) {}
+
+        void init(Index *indices, int iCount, ::Vertex *vertices, int vCount, int aCount) {
+            this->iCount = iCount;
+            this->vCount = vCount;
+        }
+
+        void deinit() {}
+        void update(Index *indices, int iCount, ::Vertex *vertices, int vCount) {}
+        void bind(const MeshRange &range) const {}
+
+        void initNextRange(MeshRange &range, int &aIndex) const {
+            range.aIndex = -1;
+        }
+    };
+
+
+    void init() {
+        LOG("Vendor   : %s\n", "none");
+        LOG("Renderer : %s\n", "null");
+        LOG("Version  : %s\n", "1.0");
+
+        support.maxAniso       = 0;
+        support.maxVectors     = 0;
+        support.shaderBinary   = false;
+        support.VAO            = false;
+        support.depthTexture   = false;
+        support.shadowSampler  = false;
+        support.discardFrame   = false;
+        support.texNPOT        = true;
+        support.tex3D          = false;
+        support.texRG          = false;
+        support.texBorder      = false;
+        support.colorFloat     = false;
+        support.colorHalf      = false;
+        support.texFloatLinear = false;
+        support.texFloat       = false;
+        support.texHalfLinear  = false;
+        support.texHalf        = false;
+        support.clipDist       = false;
+
+        resetMarkers();
+    }
+
+    void deinit() {}
+
+    mat4 ortho(float l, float r, float b, float t, float znear, float zfar) {
+        return mat4(mat4::PROJ_NEG_POS, l, r, b, t, znear, zfar);
+    }
+
+    mat4 perspective(float fov, float aspect, float znear, float zfar) {
+        return mat4(mat4::PROJ_NEG_POS, fov, aspect, znear, zfar);
+    }
+
+    bool beginFrame() {
+        return true;
+    }
+
+    void endFrame() {}
+    void resetState() {}
+    void bindTarget(Texture *texture, int face) {}
+    void discardTarget(bool color, bool depth) {}
+    void copyTarget(Texture *dst, int xOffset, int yOffset, int x, int y, int width, int height) {}
+    void setVSync(bool enable) {}
+    void waitVBlank() {}
+    void clear(bool color, bool depth) {}
+    void setClearColor(const vec4 &color) {}
+    void setViewport(const Viewport &vp) {}
+    void setDepthTest(bool enable) {}
+    void setDepthWrite(bool enable) {}
+    void setColorWrite(bool r, bool g, bool b, bool a) {}
+    void setAlphaTest(bool enable) {}
+    void setCullMode(int rsMask) {}
+    void setBlendMode(int rsMask) {}
+    void setViewProj(const mat4 &mView, const mat4 &mProj) {}
+    void updateLights(vec4 *lightPos, vec4 *lightColor, int count) {}
+    void DIP(Mesh *mesh, const MeshRange &range) {}
+
+    vec4 copyPixel(int x, int y) {
+        return vec4(0.0f);
+    }
+
+    void initPSO(PSO *pso) {
+        ASSERT(pso);
+        ASSERT(pso && pso->data == NULL);
+        pso->data = &pso;
+    }
+
+    void deinitPSO(PSO *pso) {
+        ASSERT(pso);
+        ASSERT(pso->data != NULL);
+        pso->data = NULL;
+    }
+
+    void bindPSO(const PSO *pso) {}
+}
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef H_JOBS
+#define H_JOBS
+
+#include "core.h"
+
+#ifdef OS_PTHREAD_MT
+    #include <stdint.h>
+    #include <unistd.h>
+#endif
+
+// worker threads pool for data parallel loops (level loading etc.)
+// the calling thread takes part in the work, so parallelFor returns when all items are processed
+// parallelFor must be called from the same thread and not from inside of a job
+// without OS_PTHREAD_MT all items are processed serially by the calling thread
+//
+// Background is a single long task in its own thread (level streaming), the owner must wait for it to get the result
+// startBackground returns false if there is no threads support, the owner should do the work synchronously then
+// Event wakes up a background task waiting for more work (auto-reset)
+
+#define JOBS_MAX_THREADS 8
+
+namespace Jobs {
+
+    // index - item index, thread - [0..threadsCount) to select per-thread scratch data
+    typedef void (Callback)(int index, int thread, void *userData);
+
+    typedef void (BackgroundCallback)(void *userData);
+
+    int threadsCount = 1; // including the calling thread
+
+    struct Background {
+        BackgroundCallback *callback;
+        void               *userData;
+        bool               active;
+    #ifdef OS_PTHREAD_MT
+        pthread_t          thread;
+    #endif
+    };
+
+#ifdef OS_PTHREAD_MT
+    pthread_t       threads[JOBS_MAX_THREADS];
+    pthread_mutex_t mutex;
+    pthread_cond_t  condStart;
+    pthread_cond_t  condDone;
+
+    struct Task {
+        Callback     *callback;
+        void         *userData;
+        int          count;
+        volatile int next;
+    } task;
+
+    struct Event {
+        pthread_mutex_t mutex;
+        pthread_cond_t  cond;
+        bool            signaled;
+
+        Event() : signaled(false) {
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&cond, NULL);
+        }
+
+        ~Event() {
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+        }
+
+        void signal() {
+            pthread_mutex_lock(&mutex);
+            signaled = true;
+            pthread_cond_signal(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        void wait() {
+            pthread_mutex_lock(&mutex);
+            while (!signaled)
+                pthread_cond_wait(&cond, &mutex);
+            signaled = false;
+            pthread_mutex_unlock(&mutex);
+        }
+    };
+
+    int  taskId;  // incremented for every new task
+    int  running; // workers inside the task
+    bool quit;
+
+    void work(int thread) {
+        int index;
+        while ((index = __sync_fetch_and_add(&task.next, 1)) < task.count)
+            task.callback(index, thread, task.userData);
+    }
+
+    void* worker(void *arg) {
+        int thread = int(intptr_t(arg));
+        int id     = 0;
+
+        pthread_mutex_lock(&mutex);
+        while (1) {
+            while (!quit && id == taskId)
+                pthread_cond_wait(&condStart, &mutex);
+
+            if (quit)
+                break;
+
+            id = taskId;
+            running++;
+            pthread_mutex_unlock(&mutex);
+
+            work(thread);
+
+            pthread_mutex_lock(&mutex);
+            if (--running == 0)
+                pthread_cond_signal(&condDone);
+        }
+        pthread_mutex_unlock(&mutex);
+
+        return NULL;
+    }
+
+    void init() {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&condStart, NULL);
+        pthread_cond_init(&condDone, NULL);
+
+        taskId  = 0;
+        running = 0;
+        quit    = false;
+        task.count = task.next = 0;
+
+        int count = clamp(int(sysconf(_SC_NPROCESSORS_ONLN)), 1, JOBS_MAX_THREADS);
+
+        threadsCount = 1;
+        for (int i = 1; i < count; i++) {
+            if (pthread_create(&threads[i], NULL, worker, (void*)intptr_t(i)) != 0)
+                break; // no threads support (web)
+            threadsCount++;
+        }
+
+        LOG("jobs: %d threads\n", threadsCount);
+    }
+
+    void deinit() {
+        pthread_mutex_lock(&mutex);
+        quit = true;
+        pthread_cond_broadcast(&condStart);
+        pthread_mutex_unlock(&mutex);
+
+        for (int i = 1; i < threadsCount; i++)
+            pthread_join(threads[i], NULL);
+        threadsCount = 1;
+
+        pthread_cond_destroy(&condDone);
+        pthread_cond_destroy(&condStart);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void parallelFor(int count, Callback *callback, void *userData) {
+        if (threadsCount == 1 || count <= 1) {
+            for (int i = 0; i < count; i++)
+                callback(i, 0, userData);
+            return;
+        }
+
+        pthread_mutex_lock(&mutex);
+        while (running > 0) // wait for late workers of the previous task
+            pthread_cond_wait(&condDone, &mutex);
+        task.callback = callback;
+        task.userData = userData;
+        task.count    = count;
+        task.next     = 0;
+        taskId++;
+        pthread_cond_broadcast(&condStart);
+        pthread_mutex_unlock(&mutex);
+
+        work(0);
+
+        pthread_mutex_lock(&mutex);
+        while (running > 0)
+            pthread_cond_wait(&condDone, &mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void* backgroundProc(void *arg) {
+        Background *task = (Background*)arg;
+        task->callback(task->userData);
+        return NULL;
+    }
+
+    bool startBackground(Background &task, BackgroundCallback *callback, void *userData) {
+        ASSERT(!task.active);
+        task.callback = callback;
+        task.userData = userData;
+        task.active   = pthread_create(&task.thread, NULL, backgroundProc, &task) == 0;
+        return task.active;
+    }
+
+    void wait(Background &task) {
+        if (!task.active) return;
+        pthread_join(task.thread, NULL);
+        task.active = false;
+    }
+#else
+    struct Event {
+        void signal() {}
+        void wait()   {}
+    };
+
+    void init()   {}
+    void deinit() {}
+
+    void parallelFor(int count, Callback *callback, void *userData) {
+        for (int i = 0; i < count; i++)
+            callback(i, 0, userData);
+    }
+
+    bool startBackground(Background &task, BackgroundCallback *callback, void *userData) {
+        task.active = false;
+        return false;
+    }
+
+    void wait(Background &task) {}
+#endif
+}
+
+#endif
@@ -704,6 +704,158 @@ struct Lara : Character {
             stand = STAND_AIR;
     }
 
+    static int16 getSnapshotIndex(Controller *controller) {
+        return controller ? int16(controller->entity) : -1;
+    }
+
+    Controller* getSnapshotController(int16 index) {
+        return index == -1 ? NULL : (Controller*)level->entities[index].controller;
+    }
+
+    SnapshotLara& getSnapshotLara(const SnapshotEntity &data) {
+        return *(SnapshotLara*)((uint8*)&data + SnapshotEntity::getSize(-1));
+    }
+
+    virtual int getSnapshotSize() {
+        return SnapshotEntity::getSize(-1) + sizeof(SnapshotLara);
+    }
+
+    virtual void getSnapshot(SnapshotEntity &data) {
+        Character::getSnapshot(data);
+        SnapshotLara &l = getSnapshotLara(data);
+
+        for (int i = 0; i < 2; i++) {
+            const Arm &arm = arms[i];
+            SnapshotLara::Arm &a = l.arms[i];
+            a.model    = arm.animation.model ? int16(arm.animation.model - level->models) : -1;
+            a.tracking = getSnapshotIndex(arm.tracking);
+            a.target   = getSnapshotIndex(arm.target);
+            a.anim     = arm.anim;
+            a.rot      = arm.rot;
+            a.rotAbs   = arm.rotAbs;
+            if (arm.animation.model) {
+                a.animState     = arm.animation.state;
+                a.animIndex     = arm.animation.index;
+                a.animPrev      = arm.animation.prev;
+                a.animNext      = arm.animation.next;
+                a.animFramePrev = arm.animation.framePrev;
+                a.animTime      = arm.animation.time;
+                a.animTimeMax   = arm.animation.timeMax;
+                a.animDir       = arm.animation.dir;
+                a.animEnded     = arm.animation.isEnded;
+            }
+        }
+
+        l.wpnCurrent  = wpnCurrent;
+        l.wpnNext     = wpnNext;
+        l.wpnState    = wpnState;
+        l.itemHolster = itemHolster;
+        l.usedItem    = usedItem;
+        ASSERT(COUNT(l.layerModel) == MAX_LAYERS);
+        for (int i = 0; i < MAX_LAYERS; i++) {
+            l.layerModel[i] = layers[i].model;
+            l.layerMask[i]  = layers[i].mask;
+        }
+
+        l.oxygen          = oxygen;
+        l.damageTime      = damageTime;
+        l.hitTime         = hitTime;
+        l.hitTimer        = hitTimer;
+        l.hitDir          = hitDir;
+        l.collisionOffset = collisionOffset;
+        l.flowVelocity    = flowVelocity;
+        l.viewTarget      = getSnapshotIndex(viewTarget);
+        l.dozy            = dozy;
+        l.canJump         = canJump;
+
+        l.camMode          = camera->mode;
+        l.camViewIndex     = camera->viewIndex;
+        l.camViewIndexLast = camera->viewIndexLast;
+        l.camSpeed         = camera->speed;
+        l.camTimer         = camera->timer;
+        l.camShake         = camera->shake;
+        l.camAngle         = camera->angle;
+        l.camLookAngle     = camera->lookAngle;
+        l.camTargetAngle   = camera->targetAngle;
+        l.camEyePos        = camera->eye.pos;
+        l.camTargetPos     = camera->target.pos;
+        l.camEyeRoom       = camera->eye.room;
+        l.camTargetRoom    = camera->target.room;
+        l.camViewTarget    = getSnapshotIndex(camera->viewTarget);
+        l.camSmooth        = camera->smooth;
+        l.camCenterView    = camera->centerView;
+    }
+
+    virtual void setSnapshot(const SnapshotEntity &data) {
+        Character::setSnapshot(data);
+        const SnapshotLara &l = getSnapshotLara(data);
+
+        for (int i = 0; i < 2; i++) {
+            Arm &arm = arms[i];
+            const SnapshotLara::Arm &a = l.arms[i];
+            if (a.model != -1 && arm.animation.model != &level->models[a.model])
+                arm.animation = Animation(level, &level->models[a.model]);
+            arm.tracking = getSnapshotController(a.tracking);
+            arm.target   = getSnapshotController(a.target);
+            arm.anim     = Weapon::Anim::Type(a.anim);
+            arm.rot      = a.rot;
+            arm.rotAbs   = a.rotAbs;
+            if (a.model != -1) {
+                Animation &anim = arm.animation;
+                anim.index   = a.animIndex;
+                anim.prev    = a.animPrev;
+                anim.next    = a.animNext;
+                anim.time    = a.animTime;
+                anim.timeMax = a.animTimeMax;
+                anim.dir     = a.animDir;
+                anim.isEnded = a.animEnded != 0;
+                TR::Animation *an = anim.anims + anim.index;
+                anim.framesCount = an->frameEnd - an->frameStart + 1;
+                anim.updateInfo();
+                anim.framePrev = a.animFramePrev;
+                anim.state     = a.animState;
+            }
+        }
+
+        wpnCurrent  = TR::Entity::Type(l.wpnCurrent);
+        wpnNext     = TR::Entity::Type(l.wpnNext);
+        wpnState    = Weapon::State(l.wpnState);
+        itemHolster = TR::Entity::Type(l.itemHolster);
+        usedItem    = TR::Entity::Type(l.usedItem);
+        for (int i = 0; i < MAX_LAYERS; i++) {
+            layers[i].model = l.layerModel[i];
+            layers[i].mask  = l.layerMask[i];
+        }
+
+        oxygen          = l.oxygen;
+        damageTime      = l.damageTime;
+        hitTime         = l.hitTime;
+        hitTimer        = l.hitTimer;
+        hitDir          = l.hitDir;
+        collisionOffset = l.collisionOffset;
+        flowVelocity    = l.flowVelocity;
+        viewTarget      = getSnapshotController(l.viewTarget);
+        dozy            = l.dozy != 0;
+        canJump         = l.canJump != 0;
+
+        camera->mode          = Camera::Mode(l.camMode);
+        camera->viewIndex     = l.camViewIndex;
+        camera->viewIndexLast = l.camViewIndexLast;
+        camera->speed         = l.camSpeed;
+        camera->timer         = l.camTimer;
+        camera->shake         = l.camShake;
+        camera->angle         = l.camAngle;
+        camera->lookAngle     = l.camLookAngle;
+        camera->targetAngle   = l.camTargetAngle;
+        camera->eye.pos       = l.camEyePos;
+        camera->target.pos    = l.camTargetPos;
+        camera->eye.room      = l.camEyeRoom;
+        camera->target.room   = l.camTargetRoom;
+        camera->viewTarget    = getSnapshotController(l.camViewTarget);
+        camera->smooth        = l.camSmooth != 0;
+        camera->centerView    = l.camCenterView != 0;
+    }
+
     int getRoomByPos(const vec3 &pos) {
         int x = int(pos.x),
             y = int(pos.y),
@@ -24,7 +24,10 @@
 #define ANIM_TEX_TIMESTEP (10.0f / 30.0f)
 #define SKY_TIME_PERIOD   (1.0f / 0.005f)
 
+#define LEVEL_CACHE_VERSION 1
+
 extern void loadLevelAsync(Stream *stream, void *userData);
+extern bool loadLevelPreloaded(const char *fileName);
 
 extern Array<SaveSlot> saveSlots;
 extern SaveResult saveResult;
@@ -51,6 +54,20 @@ struct Level : IGame {
     AmbientCache *ambientCache;
     WaterCache   *waterCache;
 
+    VisibilityCache *visibilityCache;
+    const uint32    *pvs; // mask of the getVisibleRooms start room
+
+    Array<Controller*> jointsList;
+
+    SaveEntityRecord *saveBase; // initial state of the base entities (index -1 if not saved), checkpoints keep the changed only
+
+    SnapshotRing *snapshots;
+    int          snapshotTick;
+
+#ifdef SND_BANK
+    Sound::Bank *sampleBank;
+#endif
+
     Sound::Sample *sndTrack, *sndWater;
     bool waitTrack;
 
@@ -82,16 +99,18 @@ struct Level : IGame {
         nextLevel = id;
     }
 
-    virtual void loadNextLevel() {
-        if (nextLevel != TR::LVL_MAX) return;
-
-        TR::LevelID id = TR::LVL_MAX;
+    TR::LevelID getNextLevelID() {
     #ifdef _OS_WEB
         if (level.id == TR::LVL_TR1_2 && level.version != TR::VER_TR1_PC)
-            id = TR::LVL_TR1_TITLE;
-        else
+            return TR::LVL_TR1_TITLE;
     #endif
-        id = (level.isEnd() || level.isHome()) ? level.getTitleId() : TR::LevelID(level.id + 1);
+        return (level.isEnd() || level.isHome()) ? level.getTitleId() : TR::LevelID(level.id + 1);
+    }
+
+    virtual void loadNextLevel() {
+        if (nextLevel != TR::LVL_MAX) return;
+
+        TR::LevelID id = getNextLevelID();
 
         if (!level.isTitle() && loadSlot == -1) {
         // update statistics info for current level
@@ -113,15 +132,22 @@ struct Level : IGame {
         inventory->toggle(playerIndex, Inventory::Page(page));
     }
 
+    int getSaveDataSize(int itemsCount) const {
+        return sizeof(SaveStats) + sizeof(int32) + sizeof(SaveItem) * max(1, itemsCount) + // for every save
+               sizeof(SaveState) + sizeof(int32) + sizeof(SaveEntityRecord) * level.entitiesCount; // only for checkpoints
+    }
+
     SaveSlot createSaveSlot(TR::LevelID id, bool checkpoint, bool dummy = false) {
         SaveSlot slot;
 
         // allocate oversized data for save slot
-        slot.data  = new uint8[sizeof(SaveStats) + sizeof(SaveItem) * inventory->itemsCount + // for every save
-                               sizeof(SaveState) + sizeof(SaveEntity) * level.entitiesCount]; // only for checkpoints
+        slot.data = new uint8[getSaveDataSize(inventory->itemsCount)];
+        slot.size = int32(writeSaveData(slot.data, id, checkpoint, dummy) - slot.data);
 
-        uint8 *ptr = slot.data;
+        return slot;
+    }
 
+    uint8* writeSaveData(uint8 *ptr, TR::LevelID id, bool checkpoint, bool dummy) {
     // level progress stats
         SaveStats *stats = (SaveStats*)ptr;
         if (!checkpoint)
@@ -175,23 +201,26 @@ struct Level : IGame {
             ptr += sizeof(*state);
             *state = level.state;
 
-        // level entities
+        // changed level entities
             int32 *entitiesCount = (int32*)ptr;
             ptr += sizeof(*entitiesCount);
 
             *entitiesCount = 0;
             for (int i = 0; i < level.entitiesCount; i++) {
-                Controller *controller = (Controller*)level.entities[i].controller;
-                SaveEntity *entity = (SaveEntity*)ptr;
-                if (!controller || !controller->getSaveData(*entity)) continue;
-                ptr += (sizeof(SaveEntity) - sizeof(SaveEntity::Extra)) + entity->extraSize;
+                SaveEntityRecord *record = (SaveEntityRecord*)ptr;
+                memset(record, 0, sizeof(*record)); // getSaveData fills the bitfields partially, keep the rest comparable with saveBase
+                if (!getSaveRecord(i, *record)) continue;
+
+                if (i < level.entitiesBaseCount && saveBase[i].index != -1 && record->getSize() == saveBase[i].getSize()
+                    && !memcmp(record, saveBase + i, record->getSize()))
+                    continue;
+
+                ptr += record->getSize();
                 (*entitiesCount)++;
             }
         }
 
-        slot.size = int32(ptr - slot.data);
-
-        return slot;
+        return ptr;
     }
 
     void parseSaveSlot(const SaveSlot &slot) {
@@ -223,34 +252,26 @@ struct Level : IGame {
             level.state = *(SaveState*)ptr;
             ptr += sizeof(level.state);
 
-        // level entities
+        // changed level entities, the rest gets the initial state
             int32 entitiesCount = *(int32*)ptr;
             ptr += sizeof(entitiesCount);
 
+            int index = 0;
             for (int i = 0; i < entitiesCount; i++) {
-                SaveEntity *entity = (SaveEntity*)ptr;
-
-                Controller *controller;
-                if (i >= level.entitiesBaseCount)
-                    controller = addEntity(TR::Entity::Type(entity->type), entity->room, vec3(float(entity->x), float(entity->y), float(entity->z)), TR::angle(entity->rotation));
-                else
-                    controller = (Controller*)level.entities[i].controller;
+                SaveEntityRecord *record = (SaveEntityRecord*)ptr;
 
-                controller->setSaveData(*entity);
-                if (Controller::first != controller && controller->flags.state != TR::Entity::asNone) {
-                    controller->next = Controller::first;
-                    Controller::first = controller;
-                }
+                for (; index < min(record->index, level.entitiesBaseCount); index++)
+                    setSaveRecord(saveBase[index]);
 
-                if (controller->getEntity().isLara()) {
-                    Lara *lara = (Lara*)controller;
-                    if (lara->camera)
-                        lara->camera->reset();
-                }
+                setSaveRecord(*record);
+                index = record->index + 1;
 
-                ptr += (sizeof(SaveEntity) - sizeof(SaveEntity::Extra)) + entity->extraSize;
+                ptr += record->getSize();
             }
 
+            for (; index < level.entitiesBaseCount; index++)
+                setSaveRecord(saveBase[index]);
+
             if (level.state.flags.flipped) {
                 flipMap();
                 level.state.flags.flipped = true;
@@ -264,19 +285,65 @@ struct Level : IGame {
         statsTimeDelta = 0.0f;
     }
 
-    static void saveGameWriteAsync(Stream *stream, void *userData) {
-        if (stream != NULL) {
-            delete[] stream->data;
-            delete stream;
-            saveResult = SAVE_RESULT_SUCCESS;
+    bool getSaveRecord(int index, SaveEntityRecord &record) {
+        Controller *controller = (Controller*)level.entities[index].controller;
+        record.index = index;
+        return controller && controller->getSaveData(record.entity);
+    }
+
+    void setSaveRecord(const SaveEntityRecord &record) {
+        if (record.index == -1)
+            return;
+
+        const SaveEntity &entity = record.entity;
+
+        Controller *controller;
+        if (record.index >= level.entitiesBaseCount)
+            controller = addEntity(TR::Entity::Type(entity.type), entity.room, vec3(float(entity.x), float(entity.y), float(entity.z)), TR::angle(entity.rotation));
+        else
+            controller = (Controller*)level.entities[record.index].controller;
+
+        if (!controller)
+            return;
+
+        controller->setSaveData(entity);
+        if (Controller::first != controller && controller->flags.state != TR::Entity::asNone) {
+            controller->next = Controller::first;
+            Controller::first = controller;
+            controller->gridUpdate();
+        }
+
+        if (controller->getEntity().isLara()) {
+            Lara *lara = (Lara*)controller;
+            if (lara->camera)
+                lara->camera->reset();
+        }
+    }
+
+    void initSaveBase() {
+        delete[] saveBase;
+        saveBase = new SaveEntityRecord[level.entitiesBaseCount];
+
+        for (int i = 0; i < level.entitiesBaseCount; i++) {
+            memset(&saveBase[i], 0, sizeof(saveBase[i]));
+            if (!getSaveRecord(i, saveBase[i]))
+                saveBase[i].index = -1;
+        }
+    }
+
+    void updateSaveResult(bool wait) {
+        if (!updateSaveSlots(wait))
+            return;
+
+        if (saveResult == SAVE_RESULT_SUCCESS)
             UI::showHint(STR_HINT_SAVING_DONE, 1.0f);
-        } else {
-            saveResult = SAVE_RESULT_ERROR;
+        else
             UI::showHint(STR_HINT_SAVING_ERROR, 3.0f);
-        }
     }
 
     virtual void saveGame(TR::LevelID id, bool checkpoint, bool updateStats) {
+        updateSaveResult(true); // finish the previous write
+
         ASSERT(saveResult != SAVE_RESULT_WAIT);
 
         if (saveResult == SAVE_RESULT_WAIT)
@@ -304,12 +371,8 @@ struct Level : IGame {
         saveSlots.sort();
 
         if (!updateStats) {
-            saveResult = SAVE_RESULT_WAIT;
             UI::showHint(STR_HINT_SAVING, 60.0f);
-
-            int size;
-            uint8 *data = writeSaveSlots(size);
-            osWriteSlot(new Stream(SAVE_FILENAME, (const char*)data, size, saveGameWriteAsync, this));
+            writeSaveSlots();
         }
     }
 
@@ -318,6 +381,225 @@ struct Level : IGame {
         loadSlot = slot;
     }
 
+// simulation state snapshots
+// the checkpoint data (changed entities only) followed by the entity indices of the active controllers list
+// and the exact runtime state of every controller (the checkpoint data is quantized)
+    void initSnapshots(int count) {
+        delete snapshots;
+        snapshots = NULL;
+        if (count > 0)
+            snapshots = new SnapshotRing(count, getSnapshotSize());
+        snapshotTick = 0;
+    }
+
+    int getSnapshotSize() {
+        int size = getSaveDataSize(INVENTORY_MAX_ITEMS) + sizeof(int32) + sizeof(int16) * level.entitiesCount + sizeof(int32);
+        for (int i = 0; i < level.entitiesCount; i++) {
+            Controller *controller = (Controller*)level.entities[i].controller;
+            if (controller)
+                size += controller->getSnapshotSize();
+        }
+        return size;
+    }
+
+    int writeSnapshot(uint8 *data) {
+        uint8 *ptr = writeSaveData(data, level.id, true, false);
+
+        int32 *activeCount = (int32*)ptr;
+        ptr += sizeof(*activeCount);
+
+        *activeCount = 0;
+        for (Controller *c = Controller::first; c; c = c->next) {
+            *(int16*)ptr = int16(c->entity);
+            ptr += sizeof(int16);
+            (*activeCount)++;
+        }
+
+        int32 *recordsCount = (int32*)ptr;
+        ptr += sizeof(*recordsCount);
+
+        *recordsCount = 0;
+        for (int i = 0; i < level.entitiesCount; i++) {
+            Controller *controller = (Controller*)level.entities[i].controller;
+            if (!controller) continue;
+
+            SnapshotEntity *record = (SnapshotEntity*)ptr;
+            memset(record, 0, controller->getSnapshotSize());
+            controller->getSnapshot(*record);
+            record->index = i;
+            ptr += record->size;
+            (*recordsCount)++;
+        }
+
+        return int(ptr - data);
+    }
+
+    void captureSnapshot() {
+        PROFILE_MARKER("SNAPSHOT");
+        snapshots->reserve(getSnapshotSize());
+        SnapshotRing::Snapshot &s = snapshots->push();
+        s.tick = snapshotTick++;
+        s.seed = uint32(rand());
+        s.size = writeSnapshot(s.data);
+        ASSERT(s.size <= snapshots->stride);
+        srand(s.seed); // random sequence is restorable from the snapshot
+    }
+
+    void removeSnapshotEntity(Controller *controller) {
+        for (int i = 0; i < COUNT(players); i++)
+            if (players[i] && players[i]->keyItem == controller)
+                players[i]->keyItem = NULL;
+        removeEntity(controller);
+    }
+
+    void restoreSnapshotEntity(const SaveEntityRecord &record) {
+        if (record.index == -1)
+            return;
+
+        TR::Entity &e = level.entities[record.index];
+        Controller *controller = (Controller*)e.controller;
+
+        if (controller && record.index >= level.entitiesBaseCount && e.type != record.entity.type) {
+            removeSnapshotEntity(controller);
+            controller = NULL;
+        }
+
+        if (!controller) {
+            const SaveEntity &entity = record.entity;
+            controller = initEntity(record.index, TR::Entity::Type(entity.type), entity.room, vec3(float(entity.x), float(entity.y), float(entity.z)), TR::angle(entity.rotation));
+        } else {
+            SaveEntityRecord current;
+            memset(&current, 0, sizeof(current));
+            if (getSaveRecord(record.index, current) && current.getSize() == record.getSize() && !memcmp(&current, &record, record.getSize()))
+                return; // not changed since the snapshot
+        }
+
+        controller->setSaveData(record.entity);
+
+        if (controller->getEntity().isLara()) {
+            Lara *lara = (Lara*)controller;
+            if (lara->camera)
+                lara->camera->reset();
+        }
+    }
+
+    // restore the snapshot, rewind drops the newer snapshots
+    bool restoreSnapshot(int back, bool rewind) {
+        PROFILE_MARKER("SNAPSHOT_RESTORE");
+        SnapshotRing::Snapshot *s = snapshots ? snapshots->get(back) : NULL;
+        if (!s) return false;
+
+        uint8 *ptr = s->data;
+
+    // level progress stats
+        saveStats = *(SaveStats*)ptr;
+        ptr += sizeof(saveStats);
+
+    // inventory items
+        clearInventory();
+
+        int32 itemsCount = *(int32*)ptr;
+        ptr += sizeof(itemsCount);
+
+        for (int i = 0; i < itemsCount; i++) {
+            SaveItem *item = (SaveItem*)ptr;
+            inventory->add(TR::Entity::Type(item->type), item->count, false);
+            ptr += sizeof(*item);
+        }
+
+    // level state
+        SaveState state = *(SaveState*)ptr;
+        ptr += sizeof(state);
+
+        bool  flipped = level.state.flags.flipped;
+        uint8 track   = level.state.flags.track;
+
+        level.state = state;
+        level.state.flags.flipped = flipped;
+        level.state.flags.track   = track;
+        if (flipped != state.flags.flipped)
+            flipMap();
+        if (track != state.flags.track)
+            playTrack(state.flags.track);
+
+    // changed level entities, the rest gets the initial state
+        int32 entitiesCount = *(int32*)ptr;
+        ptr += sizeof(entitiesCount);
+
+        int index = 0;
+        for (int i = 0; i < entitiesCount; i++) {
+            SaveEntityRecord *record = (SaveEntityRecord*)ptr;
+
+            for (; index < min(record->index, level.entitiesBaseCount); index++)
+                restoreSnapshotEntity(saveBase[index]);
+
+            for (; index < record->index; index++) { // remove the newer dynamic entities
+                Controller *controller = (Controller*)level.entities[index].controller;
+                if (controller)
+                    removeSnapshotEntity(controller);
+            }
+
+            restoreSnapshotEntity(*record);
+            index = record->index + 1;
+
+            ptr += record->getSize();
+        }
+
+        for (; index < level.entitiesCount; index++) {
+            if (index < level.entitiesBaseCount) {
+                restoreSnapshotEntity(saveBase[index]);
+                continue;
+            }
+            Controller *controller = (Controller*)level.entities[index].controller;
+            if (controller)
+                removeSnapshotEntity(controller);
+        }
+
+    // active controllers list in the same order
+        int32 activeCount = *(int32*)ptr;
+        ptr += sizeof(activeCount);
+
+        int16 *active = (int16*)ptr;
+        Controller *c = Controller::first;
+        while (c) {
+            Controller *next = c->next;
+            c->next = NULL;
+            c = next;
+        }
+
+        Controller::first = NULL;
+        for (int i = activeCount - 1; i >= 0; i--) {
+            Controller *controller = (Controller*)level.entities[active[i]].controller;
+            ASSERT(controller);
+            controller->next  = Controller::first;
+            Controller::first = controller;
+        }
+        ptr += sizeof(int16) * activeCount;
+
+    // exact runtime state
+        int32 recordsCount = *(int32*)ptr;
+        ptr += sizeof(recordsCount);
+
+        for (int i = 0; i < recordsCount; i++) {
+            SnapshotEntity *record = (SnapshotEntity*)ptr;
+            Controller *controller = (Controller*)level.entities[record->index].controller;
+            ASSERT(controller);
+            controller->setSnapshot(*record);
+            ptr += record->size;
+        }
+        Controller::gridRebuild();
+
+        srand(s->seed);
+        statsTimeDelta = 0.0f;
+
+        if (rewind) {
+            snapshots->drop(back);
+            snapshotTick = s->tick + 1;
+        }
+
+        return true;
+    }
+
     void clearInventory() {
         int i = inventory->itemsCount;
 
@@ -329,6 +611,7 @@ struct Level : IGame {
 
     void clearEntities() {
         Controller::first = NULL;
+        Controller::gridClear();
         for (int i = 0; i < level.entitiesCount; i++) {
             TR::Entity &e = level.entities[i];
             Controller *controller = (Controller*)e.controller;
@@ -343,6 +626,26 @@ struct Level : IGame {
         }
     }
 
+#ifdef SND_BANK
+    static Stream* getSampleStream(int index, void *userData) {
+        return ((Level*)userData)->level.getSampleStream(index);
+    }
+
+    static void sampleBankJob(int index, int thread, void *userData) {
+        ((Level*)userData)->sampleBank->decode(index, false);
+    }
+
+    void initSampleBank() {
+        PROFILE_MARKER("SAMPLE_BANK");
+        sampleBank = NULL;
+        if (!level.soundOffsetsCount || !level.soundData)
+            return;
+        sampleBank = new Sound::Bank(level.soundOffsetsCount, getSampleStream, this);
+        Jobs::parallelFor(level.soundOffsetsCount, sampleBankJob, this);
+        LOG("sample bank: %d KB\n", sampleBank->size / 1024);
+    }
+#endif
+
     void initShadow() {
         delete shadow;
         if (Core::settings.detail.shadows > Core::Settings::LOW) {
@@ -388,12 +691,12 @@ struct Level : IGame {
 
         if (rebuildMesh) {
             delete mesh;
-            mesh = new MeshBuilder(&level, atlas);
+            mesh = new MeshBuilder(&level, atlas, cacheKey);
         }
 
         if (rebuildAmbient) {
             delete ambientCache;
-            ambientCache = Core::settings.detail.lighting > Core::Settings::MEDIUM ? new AmbientCache(this) : NULL;
+            ambientCache = Core::settings.detail.lighting > Core::Settings::MEDIUM ? new AmbientCache(this, cacheKey) : NULL;
         }
 
         if (rebuildShadows)
@@ -445,6 +748,19 @@ struct Level : IGame {
         return (players[0]->pos - pos).length2() < (players[1]->pos - pos).length2() ? players[0] : players[1];
     }
 
+    virtual int getControllers(const Box &box, Controller **list, int maxCount) {
+        return Controller::gridQuery(box, list, maxCount);
+    }
+
+    virtual int getControllers(const vec3 &pos, float radius, Controller **list, int maxCount) {
+        int count = Controller::gridQuery(Box(pos - radius, pos + radius), list, maxCount);
+        float r2 = radius * radius;
+        for (int i = 0; i < count; i++)
+            if ((list[i]->pos - pos).length2() > r2)
+                list[i--] = list[--count];
+        return count;
+    }
+
     virtual bool isCutscene() {
         if (level.isTitle()) return false;
         return camera->mode == Camera::MODE_CUTSCENE;
@@ -456,10 +772,18 @@ struct Level : IGame {
     }
     
     virtual uint16 findPath(int ascend, int descend, bool big, int boxStart, int boxEnd, uint16 *zones, uint16 **boxes) {
+        PROFILE_MARKER("PATHFIND");
         return zoneCache->findPath(ascend, descend, big, boxStart, boxEnd, zones, boxes);
     }
 
+    virtual void invalidatePaths() {
+        if (zoneCache)
+            zoneCache->invalidatePaths();
+    }
+
     void updateBlocks(bool rise) {
+        invalidatePaths();
+
         for (int i = 0; i < level.entitiesBaseCount; i++) {
             Controller *controller = (Controller*)level.entities[i].controller;
             switch (level.entities[i].type) {
@@ -503,6 +827,16 @@ struct Level : IGame {
         shaderCache->bind(pass, type, (underwater ? ShaderCache::FX_UNDERWATER : 0) | (alphaTest ? ShaderCache::FX_ALPHA_TEST : 0) | ((params->clipHeight != NO_CLIP_PLANE && pass == Core::passCompose) ? ShaderCache::FX_CLIP_PLANE : 0));
     }
 
+    virtual void getAmbientParams(bool water, vec4 &fogParams, vec4 &material) {
+        if (water) {
+            fogParams = underwaterFogParams;
+            material  = vec4(underwaterColor, 1.0f);
+        } else {
+            fogParams = levelFogParams;
+            material  = vec4(1.0f);
+        }
+    }
+
     virtual void setRoomParams(int roomIndex, Shader::Type type, float diffuse, float ambient, float specular, float alpha, bool alphaTest = false) {
         if (Core::pass == Core::passShadow) {
             setShader(Core::pass, type, false, alphaTest);
@@ -545,13 +879,7 @@ struct Level : IGame {
         vec4 material;
 
         if (Core::pass == Core::passAmbient) {
-            if (room.flags.water) {
-                Core::fogParams = underwaterFogParams;
-                material = vec4(underwaterColor, 1.0f);
-            } else {
-                Core::fogParams = levelFogParams;
-                material = vec4(1.0f);
-            }
+            getAmbientParams(room.flags.water, Core::fogParams, material);
         } else {
             Core::fogParams = levelFogParams;
             material = vec4(diffuse, ambient, specular, alpha);
@@ -640,6 +968,7 @@ struct Level : IGame {
     }
 
     virtual void checkTrigger(Controller *controller, bool heavy) {
+        PROFILE_MARKER("TRIGGERS");
         players[0]->checkTrigger(controller, heavy);
     }
 
@@ -656,27 +985,30 @@ struct Level : IGame {
 
     virtual Controller* addEntity(TR::Entity::Type type, int room, const vec3 &pos, float angle) {
         int index;
-        for (index = level.entitiesBaseCount; index < level.entitiesCount; index++) {
-            TR::Entity &e = level.entities[index];
-            if (!e.controller) {
-                e.type          = type;
-                e.room          = room;
-                e.x             = int(pos.x);
-                e.y             = int(pos.y);
-                e.z             = int(pos.z);
-                e.rotation      = TR::angle(normalizeAngle(angle));
-                e.intensity     = -1;
-                e.flags.value   = 0;
-                e.flags.smooth  = true;
-                e.modelIndex    = level.getModelIndex(e.type);
+        for (index = level.entitiesBaseCount; index < level.entitiesCount; index++)
+            if (!level.entities[index].controller)
                 break;
-            }
-        }
 
         if (index == level.entitiesCount)
             return NULL;
 
+        return initEntity(index, type, room, pos, angle);
+    }
+
+    Controller* initEntity(int index, TR::Entity::Type type, int room, const vec3 &pos, float angle) {
         TR::Entity &e = level.entities[index];
+        ASSERT(!e.controller);
+        e.type          = type;
+        e.room          = room;
+        e.x             = int(pos.x);
+        e.y             = int(pos.y);
+        e.z             = int(pos.z);
+        e.rotation      = TR::angle(normalizeAngle(angle));
+        e.intensity     = -1;
+        e.flags.value   = 0;
+        e.flags.smooth  = true;
+        e.modelIndex    = level.getModelIndex(e.type);
+
         if (e.isPickup())
             e.intensity = 4096;
         else
@@ -756,6 +1088,11 @@ struct Level : IGame {
             }
             if (b.flags.gain) volume = max(0.0f, volume - randf() * 0.25f);
             //if (b.flags.camera) flags &= ~Sound::PAN;
+        #ifdef SND_BANK
+            Sound::Bank::Item *item = sampleBank ? sampleBank->get(index) : NULL;
+            if (item)
+                return Sound::play(item, &pos, volume, pitch, flags, id);
+        #endif
             return Sound::play(level.getSampleStream(index), &pos, volume, pitch, flags, id);
         }
         return NULL;
@@ -786,7 +1123,7 @@ struct Level : IGame {
                 if (level->level.isCutsceneLevel()) {
                     Core::resetTime();
                 }
-                level->sndTrack->volume = level->sndTrack->volumeTarget = 0.0f;
+                level->sndTrack->setVolume(0.0f, 0.0f);
             }
         }
 
@@ -844,6 +1181,19 @@ struct Level : IGame {
 //==============================
 
     Level(Stream &stream) : level(stream), waitTrack(false), isEnded(false), cutsceneWaitTimer(0.0f), animTexTimer(0.0f), statsTimeDelta(0.0f) {
+        initLevel(getCacheKey(stream));
+    }
+
+    Level(TR::Level &data, uint32 cacheKey) : waitTrack(false), isEnded(false), cutsceneWaitTimer(0.0f), animTexTimer(0.0f), statsTimeDelta(0.0f) {
+        level.take(data);
+        initLevel(cacheKey);
+    }
+
+    void initLevel(uint32 cacheKey) {
+        this->cacheKey = cacheKey;
+
+        level.initGlobals();
+        Controller::gridClear();
         level.simpleItems = Core::settings.detail.simple == 1;
         level.initModelIndices();
 
@@ -871,15 +1221,24 @@ struct Level : IGame {
             saveStats.level = level.id;
         }
 
+        zoneCache = NULL; // doors invalidate cached paths on init
+
         initTextures();
-        mesh = new MeshBuilder(&level, atlas);
+        mesh = new MeshBuilder(&level, atlas, cacheKey);
+    #ifdef SND_BANK
+        initSampleBank();
+    #endif
         initEntities();
 
+        visibilityCache = new VisibilityCache(&level);
+        saveBase        = NULL;
+        snapshots       = NULL;
+        snapshotTick    = 0;
+
         shadow       = NULL;
         camera       = NULL;
         ambientCache = NULL;
         waterCache   = NULL;
-        zoneCache    = NULL;
 
         needRedrawTitleBG = false;
         needRedrawReflections = true;
@@ -892,14 +1251,9 @@ struct Level : IGame {
             camera = player->camera;
 
             zoneCache    = new ZoneCache(this);
-            ambientCache = Core::settings.detail.lighting > Core::Settings::MEDIUM ? new AmbientCache(this) : NULL;
+            ambientCache = Core::settings.detail.lighting > Core::Settings::MEDIUM ? new AmbientCache(this, cacheKey) : NULL;
             waterCache   = Core::settings.detail.water    > Core::Settings::LOW    ? new WaterCache(this)   : NULL;
 
-            if (ambientCache) { // at first calculate ambient cube for Lara
-                AmbientCache::Cube cube;
-                ambientCache->getAmbient(players[0]->getRoomIndex(), players[0]->pos, cube); // add to queue
-            }
-
             for (int i = 0; i < level.soundSourcesCount; i++) {
                 TR::SoundSource &src = level.soundSources[i];
                 int flags = Sound::PAN;
@@ -924,6 +1278,8 @@ struct Level : IGame {
         }
         */
 
+        initSaveBase();
+
         saveResult = SAVE_RESULT_SUCCESS;
         if (loadSlot != -1 && saveSlots[loadSlot].getLevelID() == level.id) {
             parseSaveSlot(saveSlots[loadSlot]);
@@ -947,11 +1303,17 @@ struct Level : IGame {
         delete ambientCache;
         delete waterCache;
         delete zoneCache;
+        delete visibilityCache;
+        delete[] saveBase;
+        delete snapshots;
 
         delete atlas;
         delete mesh;
 
         Sound::stopAll();
+    #ifdef SND_BANK
+        delete sampleBank;
+    #endif
     }
 
     void init(bool playLogo, bool playVideo) {
@@ -1190,10 +1552,125 @@ struct Level : IGame {
     #define ATLAS_PAGE_BARS   4096
     #define ATLAS_PAGE_GLYPHS 8192
 
-    TR::Tile32 *tileData;
+    TR::Tile32 *tileData; // scratch tile per Jobs thread
     uint8 *glyphsCyr;
 
-    static void fillCallback(int id, int tileX, int tileY, int atlasWidth, int atlasHeight, Atlas::Tile &tile, void *userData, void *data) {
+    uint32 cacheKey; // hash of the level file for the artifacts cache, 0 - cache is disabled
+
+    static uint32 getCacheKey(Stream &stream) {
+    #ifdef LEVEL_CACHE
+        if (!cacheDir[0])
+            return 0;
+
+        int32 params[] = { LEVEL_CACHE_VERSION, int32(sizeof(Vertex)), int32(sizeof(Index)) };
+        uint32 hash = fnv32((char*)params, sizeof(params));
+
+        char buf[STREAM_BUFFER_SIZE];
+        int pos = stream.pos;
+        stream.setPos(0);
+        for (int i = 0; i < stream.size; i += sizeof(buf)) {
+            int size = min(stream.size - i, int(sizeof(buf)));
+            stream.raw(buf, size);
+            hash = fnv32(buf, size, hash);
+        }
+        stream.setPos(pos);
+
+        return hash ? hash : 1;
+    #else
+        return 0;
+    #endif
+    }
+
+    #ifdef LEVEL_CACHE
+// <header> <pixels> <objectTextures uv> <spriteTextures uv> <barTile>
+    struct AtlasCacheHeader {
+        int32 width, height;
+        int32 objectTexturesCount;
+        int32 spriteTexturesCount;
+    };
+
+    int getAtlasCacheSize(const AtlasCacheHeader &header) {
+        return sizeof(header) + header.width * header.height * sizeof(uint32) + (header.objectTexturesCount + header.spriteTexturesCount) * sizeof(short2) * 4 + sizeof(barTile);
+    }
+
+    static void readAtlasCacheAsync(Stream *stream, void *userData) {
+        if (!stream) return;
+
+        Level *owner = (Level*)userData;
+        TR::Level &level = owner->level;
+
+        AtlasCacheHeader header;
+        if (stream->size >= int(sizeof(header))) {
+            stream->read(header);
+
+            if (header.objectTexturesCount == level.objectTexturesCount && header.spriteTexturesCount == level.spriteTexturesCount &&
+                header.width > 0 && header.height > 0 && stream->size == owner->getAtlasCacheSize(header)) {
+
+                uint32 *pixels = (uint32*)(stream->data + stream->pos);
+                stream->seek(header.width * header.height * sizeof(uint32));
+
+                for (int i = 0; i < level.objectTexturesCount; i++)
+                    stream->raw(level.objectTextures[i].texCoordAtlas, sizeof(short2) * 4);
+                for (int i = 0; i < level.spriteTexturesCount; i++)
+                    stream->raw(level.spriteTextures[i].texCoordAtlas, sizeof(short2) * 4);
+                stream->raw(barTile, sizeof(barTile));
+
+                owner->atlas = new Texture(header.width, header.height, 1, FMT_RGBA, OPT_MIPMAPS, pixels);
+                LOG("load atlas cache (%d bytes)\n", stream->size);
+            }
+        }
+
+        delete stream;
+    }
+
+    void getAtlasCacheName(char *name) {
+        sprintf(name, "%08X.atlas", cacheKey);
+    }
+
+    void loadAtlasCache() {
+        if (!cacheKey) return;
+
+        char name[64];
+        getAtlasCacheName(name);
+        Stream::cacheRead(name, readAtlasCacheAsync, this); // synchronous for OS_FILEIO_CACHE
+    }
+
+    void saveAtlasCache(uint32 *pixels) {
+        AtlasCacheHeader header;
+        header.width               = atlas->width;
+        header.height              = atlas->height;
+        header.objectTexturesCount = level.objectTexturesCount;
+        header.spriteTexturesCount = level.spriteTexturesCount;
+
+        int size = getAtlasCacheSize(header);
+        uint8 *data = new uint8[size];
+        uint8 *ptr  = data;
+
+        memcpy(ptr, &header, sizeof(header));
+        ptr += sizeof(header);
+        memcpy(ptr, pixels, header.width * header.height * sizeof(uint32));
+        ptr += header.width * header.height * sizeof(uint32);
+        for (int i = 0; i < level.objectTexturesCount; i++) {
+            memcpy(ptr, level.objectTextures[i].texCoordAtlas, sizeof(short2) * 4);
+            ptr += sizeof(short2) * 4;
+        }
+        for (int i = 0; i < level.spriteTexturesCount; i++) {
+            memcpy(ptr, level.spriteTextures[i].texCoordAtlas, sizeof(short2) * 4);
+            ptr += sizeof(short2) * 4;
+        }
+        memcpy(ptr, barTile, sizeof(barTile));
+        ptr += sizeof(barTile);
+
+        ASSERT(ptr - data == size);
+
+        char name[64];
+        getAtlasCacheName(name);
+        Stream::cacheWrite(name, (char*)data, size);
+        delete[] data;
+    }
+    #endif
+
+    static void fillCallback(int id, int tileX, int tileY, int atlasWidth, int atlasHeight, Atlas::Tile &tile, void *userData, void *data, int thread) {
         static const uint32 barColor[UI::BAR_MAX][25] = {
             // flash bar
                 { 0x00000000, 0xFFA20058, 0xFFFFFFFF, 0xFFA20058, 0x00000000 },
@@ -1216,6 +1693,7 @@ struct Level : IGame {
 
         Level *owner = (Level*)userData;
         TR::Level *level = &owner->level;
+        TR::Tile32 *tileData = owner->tileData + thread;
 
         Color32 *src, *dst = (Color32*)data;
         short4 mm;
@@ -1225,11 +1703,11 @@ struct Level : IGame {
         if (id < level->objectTexturesCount) { // textures
             TR::TextureInfo &t = level->objectTextures[id];
             mm      = t.getMinMax();
-            src     = owner->tileData->color;
+            src     = tileData->color;
             uv      = t.texCoordAtlas;
             uvCount = 4;
             if (data) {
-                level->fillObjectTexture(owner->tileData, tile.uv, tile.tex);
+                level->fillObjectTexture(tileData, tile.uv, tile.tex);
             }
         } else {
             id -= level->objectTexturesCount;
@@ -1237,18 +1715,18 @@ struct Level : IGame {
             if (id < level->spriteTexturesCount) { // sprites
                 TR::TextureInfo &t = level->spriteTextures[id];
                 mm       = t.getMinMax();
-                src      = owner->tileData->color;
+                src      = tileData->color;
                 uv       = t.texCoordAtlas;
                 uvCount  = 2;
                 isSprite = true;
                 if (data) {
                     if (id < UI::advGlyphsStart) {
-                        level->fillObjectTexture(owner->tileData, tile.uv, tile.tex);
+                        level->fillObjectTexture(tileData, tile.uv, tile.tex);
                     } else {
                         short4 uv = tile.uv;
                         uv.x -= ATLAS_PAGE_GLYPHS;
                         uv.z -= ATLAS_PAGE_GLYPHS;
-                        level->fillObjectTexture32(owner->tileData, (Color32*)owner->glyphsCyr, uv, tile.tex);
+                        level->fillObjectTexture32(tileData, (Color32*)owner->glyphsCyr, uv, tile.tex);
                     }
                 }
             } else { // common (generated) textures
@@ -1380,16 +1858,8 @@ struct Level : IGame {
     }
 */
 
-    void initTextures() {
     #ifndef SPLIT_BY_TILE
-
-        #ifdef _OS_PSP
-            #error atlas packing is not allowed for this platform
-        #endif
-
-        //dumpGlyphs();
-        UI::patchGlyphs(level);
-
+    void packAtlas() {
         {
             uint32 glyphsW, glyphsH;
             Stream stream(NULL, GLYPH_CYR, size_GLYPH_CYR);
@@ -1438,19 +1908,45 @@ struct Level : IGame {
         }
 
         // get result texture
-        tileData = new TR::Tile32();
+        tileData = new TR::Tile32[Jobs::threadsCount];
         
-        atlas = tiles->pack();
+        uint32 *pixels = NULL;
+        atlas = tiles->pack(cacheKey ? &pixels : NULL);
         delete[] tileData;
         tileData = NULL;
 
         delete[] glyphsCyr;
         glyphsCyr = NULL;
 
-        atlas->setFilterQuality(Core::settings.detail.filter);
-
         delete tiles;
 
+    #ifdef LEVEL_CACHE
+        if (pixels)
+            saveAtlasCache(pixels);
+    #endif
+        delete[] pixels;
+    }
+    #endif
+
+    void initTextures() {
+    #ifndef SPLIT_BY_TILE
+
+        #ifdef _OS_PSP
+            #error atlas packing is not allowed for this platform
+        #endif
+
+        //dumpGlyphs();
+        UI::patchGlyphs(level);
+
+        atlas = NULL;
+    #ifdef LEVEL_CACHE
+        loadAtlasCache();
+    #endif
+        if (!atlas)
+            packAtlas();
+
+        atlas->setFilterQuality(Core::settings.detail.filter);
+
         LOG("atlas: %d x %d\n", atlas->width, atlas->height);
         PROFILE_LABEL(TEXTURE, atlas->ID, "atlas");
 
@@ -1800,6 +2296,8 @@ struct Level : IGame {
     }
 
     void update() {
+        updateSaveResult(false);
+
         if (isEnded) return;
 
         bool invRing = inventory->phaseRing != 0.0f && inventory->phaseRing != 1.0f;
@@ -1857,7 +2355,10 @@ struct Level : IGame {
 
         bool invActive = inventory->isActive();
 
-        inventory->update();
+        {
+            PROFILE_MARKER("INVENTORY");
+            inventory->update();
+        }
 
         if (inventory->titleTimer > 1.0f)
             return;
@@ -1872,7 +2373,8 @@ struct Level : IGame {
             char buf[64];
             TR::getGameLevelFile(buf, level.version, nextLevel);
             nextLevel = TR::LVL_MAX;
-            new Stream(buf, loadLevelAsync);
+            if (!loadLevelPreloaded(buf))
+                new Stream(buf, loadLevelAsync);
             return;
         }
 
@@ -1918,11 +2420,18 @@ struct Level : IGame {
 
             updateEffect();
 
-            Controller *c = Controller::first;
-            while (c) {
-                Controller *next = c->next;
-                c->update();
-                c = next;
+        #ifdef SECTOR_CACHE
+            level.updateSectorCache(); // flipmap or doors changed the sectors
+        #endif
+
+            {
+                PROFILE_MARKER("CONTROLLERS");
+                Controller *c = Controller::first;
+                while (c) {
+                    Controller *next = c->next;
+                    c->update();
+                    c = next;
+                }
             }
 
             if (waterCache) 
@@ -1930,12 +2439,15 @@ struct Level : IGame {
 
             Controller::clearInactive();
 
+            if (snapshots)
+                captureSnapshot();
+
         // underwater ambient sound volume control
             if (camera->isUnderwater()) {
                 if (!sndWater && !level.isCutsceneLevel()) {
                     sndWater = playSound(TR::SND_UNDERWATER, vec3(0.0f), Sound::LOOP | Sound::MUSIC);
                     if (sndWater)
-                        sndWater->volume = sndWater->volumeTarget = 0.0f;
+                        sndWater->setVolume(0.0f, 0.0f);
                 }
                 volWater = 1.0f;
             } else 
@@ -1944,9 +2456,9 @@ struct Level : IGame {
             volTrack = 1.0f;
         }
 
-        if (sndWater && sndWater->volumeTarget != volWater)
+        if (sndWater && sndWater->volumeRequest != volWater)
             sndWater->setVolume(volWater, 0.2f);
-        if (sndTrack && sndTrack->volumeTarget != volTrack)
+        if (sndTrack && sndTrack->volumeRequest != volTrack)
             sndTrack->setVolume(volTrack, 0.2f);
 
     #ifdef _DEBUG
@@ -2159,6 +2671,9 @@ struct Level : IGame {
             return;
         }
 
+        if (count == 0) // potentially visible set of the view room
+            pvs = visibilityCache ? visibilityCache->getMask(to) : NULL;
+
         TR::Room &room = level.rooms[to];
 
         if (!room.flags.visible) {
@@ -2176,7 +2691,7 @@ struct Level : IGame {
             if (Core::pass == Core::passCompose && water && waterCache && (level.rooms[to].flags.water ^ level.rooms[p.roomIndex].flags.water))
                 waterCache->setVisible(to, p.roomIndex);
 
-            if (from != room.portals[i].roomIndex && checkPortal(room, p, viewPort, clipPort))
+            if (from != room.portals[i].roomIndex && (!pvs || VisibilityCache::isVisible(pvs, p.roomIndex)) && checkPortal(room, p, viewPort, clipPort))
                 getVisibleRooms(roomsList, roomsCount, to, p.roomIndex, clipPort, water, count + 1);
         }
     }
@@ -2612,42 +3127,12 @@ struct Level : IGame {
         /*// render ambient cube
             Core::validateRenderState();
 
-            static int dbg_ambient = 0;
-            dbg_ambient = int(params->time * 2) % 4;
-
             shadow->unbind(sShadow);
             Core::whiteCube->unbind(sEnvironment);
 
             glActiveTexture(GL_TEXTURE0);
-            glEnable(GL_TEXTURE_2D);
-            glDisable(GL_CULL_FACE);
-            glColor3f(1, 1, 1);
-            for (int j = 0; j < 6; j++) {
-                glPushMatrix();
-                glTranslatef(player->pos.x, player->pos.y - 1024, player->pos.z);
-                switch (j) {
-                    case 0 : glRotatef( 90, 0, 1, 0); break;
-                    case 1 : glRotatef(-90, 0, 1, 0); break;
-                    case 2 : glRotatef(-90, 1, 0, 0); break;
-                    case 3 : glRotatef( 90, 1, 0, 0); break;
-                    case 4 : glRotatef(  0, 0, 1, 0); break;
-                    case 5 : glRotatef(180, 0, 1, 0); break;
-                }
-                glTranslatef(0, 0, 256);
-                
-                ambientCache->textures[j * 4 + dbg_ambient]->bind(sDiffuse);
-                glBegin(GL_QUADS);
-                    glTexCoord2f(0, 0); glVertex3f(-256,  256, 0);
-                    glTexCoord2f(1, 0); glVertex3f( 256,  256, 0);
-                    glTexCoord2f(1, 1); glVertex3f( 256, -256, 0);
-                    glTexCoord2f(0, 1); glVertex3f(-256, -256, 0);
-                glEnd();
-                glPopMatrix();
-            }
-            glEnable(GL_CULL_FACE);
             glDisable(GL_TEXTURE_2D);
 
-
             glLineWidth(4);
             glBegin(GL_LINES);
             float S = 64.0f;
@@ -2755,14 +3240,29 @@ struct Level : IGame {
             needRedrawReflections = false;
         }
 
-        if (ambientCache)
-            ambientCache->processQueue();
-
         if (shadow && player)
             renderShadows(player->getRoomIndex());
     }
 
+    static void updateJointsJob(int index, int thread, void *userData) {
+        ((Level*)userData)->jointsList[index]->updateJoints();
+    }
+
+    // evaluate skeletons of the entities visible in the last frame at once, render passes of the frame reuse them
+    void updateJoints() {
+        PROFILE_MARKER("JOINTS");
+        jointsList.length = 0;
+        for (int i = 0; i < level.entitiesCount; i++) {
+            Controller *controller = (Controller*)level.entities[i].controller;
+            if (controller && controller->joints && controller->flags.rendered && controller->getEntity().modelIndex > 0)
+                jointsList.push(controller);
+        }
+        Jobs::parallelFor(jointsList.length, updateJointsJob, this);
+    }
+
     void renderGame(bool showUI) {
+        updateJoints();
+
         //if (Core::settings.detail.stereo || Core::settings.detail.splitscreen) {
         //    Core::setTarget(NULL, CLEAR_ALL);
         //    Core::validateRenderState();
@@ -2650,6 +2650,12 @@ void mp3_done(mp3_decoder_t dec) {
     }
 }
 
+void mp3_reset(mp3_decoder_t dec) {
+    if (dec) {
+        libc_memset(dec, 0, sizeof(mp3_context_t));
+    }
+}
+
 int mp3_decode(mp3_decoder_t dec, void *buf, int bytes, signed short *out, mp3_info_t *info) {
     int res, size = -1;
     mp3_context_t *s = (mp3_context_t*) dec;
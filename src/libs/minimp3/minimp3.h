@@ -12,6 +12,7 @@ typedef void* mp3_decoder_t;
 mp3_decoder_t mp3_create(void);
 extern int mp3_decode(mp3_decoder_t dec, void *buf, int bytes, signed short *out, mp3_info_t *info);
 void mp3_done(mp3_decoder_t dec);
+void mp3_reset(mp3_decoder_t dec);
 int  mp3_decode_init();
 void mp3_decode_free();
 
@@ -172,17 +172,43 @@ struct MeshBuilder {
         BLEND_ADD   = 4,
     };
 
-    MeshBuilder(TR::Level *level, Texture *atlas) : atlas(atlas), level(level) {
+// built geometry (from scratch or from the level cache)
+    struct Buffer {
+        Index  *indices;
+        Vertex *vertices;
+        int    iCount, vCount, aCount;
+        int    vStartModel, vStartCommon;
+    };
+
+    MeshBuilder(TR::Level *level, Texture *atlas, uint32 cacheKey = 0) : atlas(atlas), level(level) {
         dynMesh = new Mesh(NULL, COUNT(dynIndices), NULL, COUNT(dynVertices), 1, true);
         dynRange.vStart = 0;
         dynRange.iStart = 0;
         dynMesh->initRange(dynRange);
 
-    // allocate room geometry ranges
-        rooms = new RoomRange[level->roomsCount];
+    // allocate room & model geometry ranges
+        rooms  = new RoomRange[level->roomsCount];
+        models = new ModelRange[level->modelsCount];
 
-        int iCount = 0, vCount = 0;
+        prepare();
+
+        Buffer buffer;
+    #ifdef LEVEL_CACHE
+        if (!loadCache(cacheKey, buffer)) {
+            build(buffer);
+            saveCache(cacheKey, buffer);
+        }
+    #else
+        build(buffer);
+    #endif
+        upload(buffer);
+
+        delete[] buffer.indices;
+        delete[] buffer.vertices;
+    }
 
+// level data modifications (faces order, water levels & surfaces, normals), must be done for cached geometry too
+    void prepare() {
     // sort room faces by material
         for (int i = 0; i < level->roomsCount; i++) {
             TR::Room::Data &data = level->rooms[i].data;
@@ -197,9 +223,6 @@ struct MeshBuilder {
             sort(mesh.faces, mesh.fCount);
         }
 
-    // get size of mesh for rooms (geometry & sprites)
-        int vStartRoom = vCount;
-
     // pre-calculate water level for rooms
         for (int i = 0; i < level->roomsCount; i++) {
             TR::Room &room = level->rooms[i];
@@ -212,6 +235,28 @@ struct MeshBuilder {
             level->flipMap();
         }
 
+    // mark water surfaces and calculate room faces normal
+        for (int i = 0; i < level->roomsCount; i++) {
+            TR::Room       &room = level->rooms[i];
+            TR::Room::Data &d    = room.data;
+
+            int iCount = 0, vCount = 0;
+            roomRemoveWaterSurfaces(room, iCount, vCount);
+
+            for (int j = 0; j < d.fCount; j++) {
+                TR::Face &f = d.faces[j];
+                if (f.water) continue;
+                CHECK_ROOM_NORMAL(f);
+            }
+        }
+    }
+
+    void build(Buffer &buffer) {
+        int iCount = 0, vCount = 0;
+
+    // get size of mesh for rooms (geometry & sprites)
+        int vStartRoom = vCount;
+
     // get reooms geometry info
         for (int i = 0; i < level->roomsCount; i++) {
             TR::Room       &r = level->rooms[i];
@@ -247,7 +292,6 @@ struct MeshBuilder {
         }
 
     // get models info
-        models = new ModelRange[level->modelsCount];
         for (int i = 0; i < level->modelsCount; i++) {
             TR::Model &model = level->models[i];
             for (int j = 0; j < model.mCount; j++) {
@@ -574,12 +618,20 @@ struct MeshBuilder {
         plane.iCount = 0;
     #endif
 
-        LOG("MegaMesh (i:%d v:%d a:%d, size:%d)\n", iCount, vCount, aCount, int(iCount * sizeof(Index) + vCount * sizeof(GAPI::Vertex)));
+        buffer.indices      = indices;
+        buffer.vertices     = vertices;
+        buffer.iCount       = iCount;
+        buffer.vCount       = vCount;
+        buffer.aCount       = aCount;
+        buffer.vStartModel  = vStartModel;
+        buffer.vStartCommon = vStartCommon;
+    }
+
+    void upload(const Buffer &buffer) {
+        LOG("MegaMesh (i:%d v:%d a:%d, size:%d)\n", buffer.iCount, buffer.vCount, buffer.aCount, int(buffer.iCount * sizeof(Index) + buffer.vCount * sizeof(GAPI::Vertex)));
 
     // compile buffer and ranges
-        mesh = new Mesh(indices, iCount, vertices, vCount, aCount, false);
-        delete[] indices;
-        delete[] vertices;
+        mesh = new Mesh(buffer.indices, buffer.iCount, buffer.vertices, buffer.vCount, buffer.aCount, false);
 
         PROFILE_LABEL(BUFFER, mesh->ID[0], "Geometry indices");
         PROFILE_LABEL(BUFFER, mesh->ID[1], "Geometry vertices");
@@ -606,7 +658,7 @@ struct MeshBuilder {
         }
 
         MeshRange rangeModel;
-        rangeModel.vStart = vStartModel;
+        rangeModel.vStart = buffer.vStartModel;
         mesh->initRange(rangeModel);
         for (int i = 0; i < level->modelsCount; i++)
             for (int j = 0; j < 3; j++) {
@@ -616,7 +668,7 @@ struct MeshBuilder {
             }
 
         MeshRange rangeCommon;
-        rangeCommon.vStart = vStartCommon;
+        rangeCommon.vStart = buffer.vStartCommon;
         mesh->initRange(rangeCommon);
         shadowBlob.aIndex = rangeCommon.aIndex;
         quad.aIndex       = rangeCommon.aIndex;
@@ -625,6 +677,159 @@ struct MeshBuilder {
         box.aIndex        = rangeCommon.aIndex;
     }
 
+    #ifdef LEVEL_CACHE
+// <header> <indices> <vertices> <rooms> <models> <common ranges> <dynamic faces>
+    struct CacheHeader {
+        int32 roomsCount;
+        int32 modelsCount;
+        int32 vertexSize;
+        int32 iCount, vCount, aCount;
+        int32 vStartModel, vStartCommon;
+        int32 dynCount;
+    };
+
+    struct CacheRequest {
+        MeshBuilder *owner;
+        Buffer      *buffer;
+        bool        loaded;
+    };
+
+    void getCacheName(char *name, uint32 cacheKey) {
+        sprintf(name, "%08X_%d_%d.mesh", cacheKey, int(Core::settings.detail.water), level->state.flags.flipped ? 1 : 0);
+    }
+
+    int getRangesOffset(const CacheHeader &header) {
+        return sizeof(header) + header.iCount * sizeof(Index) + header.vCount * sizeof(Vertex);
+    }
+
+    int getCacheSize(const CacheHeader &header) {
+        return getRangesOffset(header) + level->roomsCount * sizeof(RoomRange) + level->modelsCount * sizeof(ModelRange) + 5 * sizeof(MeshRange) + header.dynCount * sizeof(uint16);
+    }
+
+    static void readCacheAsync(Stream *stream, void *userData) {
+        CacheRequest *req = (CacheRequest*)userData;
+        if (stream) {
+            req->loaded = req->owner->readCache(*stream, *req->buffer);
+            delete stream;
+        }
+    }
+
+    bool readCache(Stream &stream, Buffer &buffer) {
+        CacheHeader header;
+        if (stream.size < int(sizeof(header)))
+            return false;
+        stream.read(header);
+
+        if (header.roomsCount != level->roomsCount || header.modelsCount != level->modelsCount || header.vertexSize != sizeof(Vertex) ||
+            header.iCount < 0 || header.vCount < 0 || header.dynCount < 0 || stream.size != getCacheSize(header))
+            return false;
+
+    // ranges
+        stream.setPos(getRangesOffset(header));
+        stream.raw(rooms,  level->roomsCount  * sizeof(RoomRange));
+        stream.raw(models, level->modelsCount * sizeof(ModelRange));
+        stream.read(shadowBlob);
+        stream.read(quad);
+        stream.read(circle);
+        stream.read(box);
+        stream.read(plane);
+
+        int dynCount = 0;
+        for (int i = 0; i < level->roomsCount; i++)
+            for (int j = 0; j < COUNT(rooms[i].dynamic); j++)
+                dynCount += rooms[i].dynamic[j].count;
+
+        if (dynCount != header.dynCount) {
+            for (int i = 0; i < level->roomsCount; i++)
+                rooms[i] = RoomRange();
+            for (int i = 0; i < level->modelsCount; i++)
+                models[i] = ModelRange();
+            return false;
+        }
+
+        for (int i = 0; i < level->roomsCount; i++)
+            for (int j = 0; j < COUNT(rooms[i].dynamic); j++)
+                stream.read(rooms[i].dynamic[j].faces, rooms[i].dynamic[j].count);
+
+    // geometry
+        stream.setPos(sizeof(header));
+        buffer.indices      = new Index[header.iCount];
+        buffer.vertices     = new Vertex[header.vCount];
+        stream.raw(buffer.indices,  header.iCount * sizeof(Index));
+        stream.raw(buffer.vertices, header.vCount * sizeof(Vertex));
+        buffer.iCount       = header.iCount;
+        buffer.vCount       = header.vCount;
+        buffer.aCount       = header.aCount;
+        buffer.vStartModel  = header.vStartModel;
+        buffer.vStartCommon = header.vStartCommon;
+
+        LOG("load mesh cache (%d bytes)\n", stream.size);
+        return true;
+    }
+
+    bool loadCache(uint32 cacheKey, Buffer &buffer) {
+        if (!cacheKey)
+            return false;
+
+        char name[64];
+        getCacheName(name, cacheKey);
+
+        CacheRequest req = { this, &buffer, false };
+        Stream::cacheRead(name, readCacheAsync, &req); // synchronous for OS_FILEIO_CACHE
+        return req.loaded;
+    }
+
+    static void writeData(uint8 *&ptr, const void *data, int size) {
+        if (!size) return;
+        memcpy(ptr, data, size);
+        ptr += size;
+    }
+
+    void saveCache(uint32 cacheKey, const Buffer &buffer) {
+        if (!cacheKey)
+            return;
+
+        CacheHeader header;
+        header.roomsCount   = level->roomsCount;
+        header.modelsCount  = level->modelsCount;
+        header.vertexSize   = sizeof(Vertex);
+        header.iCount       = buffer.iCount;
+        header.vCount       = buffer.vCount;
+        header.aCount       = buffer.aCount;
+        header.vStartModel  = buffer.vStartModel;
+        header.vStartCommon = buffer.vStartCommon;
+        header.dynCount     = 0;
+        for (int i = 0; i < level->roomsCount; i++)
+            for (int j = 0; j < COUNT(rooms[i].dynamic); j++)
+                header.dynCount += rooms[i].dynamic[j].count;
+
+        int size = getCacheSize(header);
+        uint8 *data = new uint8[size];
+        uint8 *ptr  = data;
+
+        writeData(ptr, &header,         sizeof(header));
+        writeData(ptr, buffer.indices,  buffer.iCount * sizeof(Index));
+        writeData(ptr, buffer.vertices, buffer.vCount * sizeof(Vertex));
+        writeData(ptr, rooms,           level->roomsCount  * sizeof(RoomRange));
+        writeData(ptr, models,          level->modelsCount * sizeof(ModelRange));
+        writeData(ptr, &shadowBlob,     sizeof(shadowBlob));
+        writeData(ptr, &quad,           sizeof(quad));
+        writeData(ptr, &circle,         sizeof(circle));
+        writeData(ptr, &box,            sizeof(box));
+        writeData(ptr, &plane,          sizeof(plane));
+        for (int i = 0; i < level->roomsCount; i++)
+            for (int j = 0; j < COUNT(rooms[i].dynamic); j++)
+                writeData(ptr, rooms[i].dynamic[j].faces, rooms[i].dynamic[j].count * sizeof(uint16));
+
+        ASSERT(ptr - data == size);
+
+        char name[64];
+        getCacheName(name, cacheKey);
+        Stream::cacheWrite(name, (char*)data, size);
+        delete[] data;
+    }
+    #endif
+
     ~MeshBuilder() {
         for (int i = 0; i < level->roomsCount; i++)
             for (int j = 0; j < COUNT(rooms[i].dynamic); j++)
@@ -933,8 +1138,6 @@ struct MeshBuilder {
 
             if (f.water) continue;
 
-            CHECK_ROOM_NORMAL(f);
-
             if (!(blendMask & getBlendMask(t.attribute)))
                 continue;
 
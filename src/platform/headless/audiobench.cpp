@@ -0,0 +1,446 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "core.h"
+
+// audio engine benchmark
+// plays the scene of positional loops and music into a memory sink by Sound::fill (no audio device and thread)
+// and reports mixed frames/sec, Sound::fill latency per block and the decoding cost of every source
+// usage: OpenLara_audiobench [-frames N] [-block N] [-loops N] [-pitch X] [-reverb 0|1] [-seed N]
+//                            [-music file] [-golden file.wav] [-tolerance N] [-save-golden file.wav] [source...]
+//        OpenLara_audiobench -mixer-check N [-seed N]
+//
+// sources are sound files of any format supported by Sound::createDecoder (WAV PCM/ADPCM/IMA, OGG, MP3, VAG, SEGA PCM)
+//   every loop takes the next source, without sources a generated 22050 Hz PCM tone is used
+// -block is the frames count per Sound::fill call (SND_DATA_SIZE / SND_FRAME_SIZE of the platform)
+// -pitch X sets the random pitch variation of the loops to [1 - X, 1 + X], X < 0.5
+// golden files are 16-bit stereo 44100 Hz WAV of the mixed output, it depends on all the scene options
+// -mixer-check N mixes N random blocks by Sound::mixFrames and Sound::mixFramesRef and fails if the outputs differ
+// -tolerance N accepts the samples differing from the golden by up to N (the SSE2 and scalar reverb may differ by 1 LSB)
+
+#define SND_RATE        44100
+#define SCENE_RADIUS    (SND_FADEOFF_DIST * 0.75f)
+
+// timing
+int64 startTime;
+
+int64 osGetTimeMCS() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64(t.tv_sec) * 1000000 + t.tv_nsec / 1000 - startTime;
+}
+
+int osGetTime() {
+    return int(osGetTimeMCS() / 1000);
+}
+
+// input
+bool osJoyReady(int index) {
+    return false;
+}
+
+void osJoyVibrate(int index, float L, float R) {}
+
+// sources
+struct Source {
+    const char *name;
+    char       *data;
+    int        size;
+};
+
+Array<Source> sources;
+
+bool sourceLoad(const char *fileName, Source &src) {
+    FILE *f = fopen(fileName, "rb");
+    if (!f) {
+        LOG("! can't open source file \"%s\"\n", fileName);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    src.name = fileName;
+    src.size = int(ftell(f));
+    src.data = new char[src.size];
+    fseek(f, 0, SEEK_SET);
+    src.size = int(fread(src.data, 1, src.size, f));
+    fclose(f);
+    return true;
+}
+
+void putLE16(char *&ptr, uint16 x) { memcpy(ptr, &x, 2); ptr += 2; }
+void putLE32(char *&ptr, uint32 x) { memcpy(ptr, &x, 4); ptr += 4; }
+
+void writeWaveHeader(char *&ptr, int channels, int freq, int dataSize) {
+    memcpy(ptr, "RIFF", 4); ptr += 4;
+    putLE32(ptr, 36 + dataSize);
+    memcpy(ptr, "WAVEfmt ", 8); ptr += 8;
+    putLE32(ptr, 16);
+    putLE16(ptr, 1); // PCM
+    putLE16(ptr, channels);
+    putLE32(ptr, freq);
+    putLE32(ptr, freq * channels * 2);
+    putLE16(ptr, channels * 2);
+    putLE16(ptr, 16);
+    memcpy(ptr, "data", 4); ptr += 4;
+    putLE32(ptr, dataSize);
+}
+
+// 1 sec of 440 Hz mono tone (resampled to 44100 Hz by the PCM decoder)
+void sourceGenerate(Source &src) {
+    const int freq  = 22050;
+    const int count = freq;
+
+    src.name = "<tone>";
+    src.size = 44 + count * 2;
+    src.data = new char[src.size];
+
+    char *ptr = src.data;
+    writeWaveHeader(ptr, 1, freq, count * 2);
+    for (int i = 0; i < count; i++)
+        putLE16(ptr, uint16(int16(sinf(i * (PI * 2.0f * 440.0f / freq)) * 8192.0f)));
+}
+
+const char* sourceFormat(const Source &src) {
+    static const char *names[] = { "WAV", "OGG", "MP3", "SEGA", "VAG" }; // by Sound::Format
+
+    if (src.size < 4) return "?";
+    return names[Sound::getFormat(FOURCC(src.data))]; // the same test as Sound::createDecoder
+}
+
+Stream* sourceStream(const Source &src) {
+    return new Stream(NULL, src.data, src.size);
+}
+
+// golden output
+struct Golden {
+    Sound::Frame *frames;
+    int          count;
+};
+
+bool goldenLoad(const char *fileName, Golden &golden) {
+    Source src;
+    if (!sourceLoad(fileName, src))
+        return false;
+
+    Stream stream(NULL, src.data, src.size);
+
+    uint32 fourcc;
+    stream.read(fourcc);
+    if (fourcc == FOURCC("RIFF")) {
+        stream.seek(8);
+        while (stream.pos + 8 <= stream.size) {
+            uint32 type, size;
+            stream.read(type);
+            stream.read(size);
+            if (type == FOURCC("data")) {
+                golden.count  = min(int(size), stream.size - stream.pos) / sizeof(Sound::Frame);
+                golden.frames = new Sound::Frame[golden.count];
+                stream.raw(golden.frames, golden.count * sizeof(Sound::Frame));
+                delete[] src.data;
+                return true;
+            }
+            stream.seek(size);
+        }
+    }
+
+    LOG("! golden file \"%s\" is not a WAV file\n", fileName);
+    delete[] src.data;
+    return false;
+}
+
+bool goldenSave(const char *fileName, const Sound::Frame *frames, int count) {
+    FILE *f = fopen(fileName, "wb");
+    if (!f) {
+        LOG("! can't create golden file \"%s\"\n", fileName);
+        return false;
+    }
+    char header[44], *ptr = header;
+    writeWaveHeader(ptr, 2, SND_RATE, count * sizeof(Sound::Frame));
+    fwrite(header, 1, sizeof(header), f);
+    fwrite(frames, sizeof(Sound::Frame), count, f);
+    fclose(f);
+    return true;
+}
+
+// scene random generator, libc rand differs between the platforms and breaks the golden files
+uint32 sceneSeed;
+
+float sceneRand() {
+    sceneSeed = sceneSeed * 1664525 + 1013904223;
+    return (sceneSeed >> 8) / float(1 << 24);
+}
+
+// SIMD mixer must be bit-exact with the scalar reference
+bool mixerCheck(int trials) {
+    const int maxCount = 2048;
+
+    Sound::Frame   *frames = new Sound::Frame[maxCount * 2 + 2];
+    Sound::FrameHI *simd   = new Sound::FrameHI[maxCount];
+    Sound::FrameHI *ref    = new Sound::FrameHI[maxCount];
+
+    int failed = 0;
+    for (int i = 0; i < trials; i++) {
+        Sound::MixParams p;
+        p.pitch        = (i % 4) ? (0.25f + sceneRand() * 1.75f) : 1.0f; // every 4th block without resampling
+        p.volume       = sceneRand();
+        p.volumeTarget = (i % 3) ? sceneRand() : p.volume;
+        p.volumeDelta  = (p.volumeTarget - p.volume) / (1.0f + sceneRand() * maxCount);
+        p.master       = sceneRand();
+        p.pan          = vec2(sceneRand(), sceneRand());
+
+        int count = 1 + int(sceneRand() * (maxCount - 1));
+        int size  = int(count * p.pitch) + 2;
+
+        for (int j = 0; j < size; j++) {
+            frames[j].L = int16(sceneRand() * 65535.0f - 32768.0f);
+            frames[j].R = int16(sceneRand() * 65535.0f - 32768.0f);
+        }
+
+        for (int j = 0; j < count; j++) {
+            ref[j].L = int32(sceneRand() * 65535.0f - 32768.0f);
+            ref[j].R = int32(sceneRand() * 65535.0f - 32768.0f);
+        }
+        memcpy(simd, ref, count * sizeof(Sound::FrameHI));
+
+        Sound::mixFrames(simd, frames, count, p);
+        Sound::mixFramesRef(ref, frames, count, p);
+
+        if (memcmp(simd, ref, count * sizeof(Sound::FrameHI))) {
+            if (!failed)
+                LOG("! mixer mismatch: block %d, %d frames, pitch %f, volume %f -> %f (delta %e), master %f, pan %f %f\n", i, count, p.pitch, p.volume, p.volumeTarget, p.volumeDelta, p.master, p.pan.x, p.pan.y);
+            failed++;
+        }
+    }
+
+    if (failed)
+        LOG("! mixer      : %d of %d blocks differ from the reference\n", failed, trials);
+    else
+        LOG("mixer      : %d blocks match the reference\n", trials);
+
+    delete[] frames;
+    delete[] simd;
+    delete[] ref;
+
+    return !failed;
+}
+
+// stats
+int cmpTime(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+int percentile(Array<int> &times, int p) {
+    if (!times.length) return 0;
+    return times[min(times.length - 1, times.length * p / 100)];
+}
+
+// decodes the whole source (up to maxFrames) outside of the mixer
+void benchmarkDecoder(const Source &src, int maxFrames) {
+    Sound::Frame frames[1024];
+
+    int64 t = osGetTimeMCS();
+    Sound::Decoder *decoder = Sound::createDecoder(sourceStream(src));
+    int64 openTime = osGetTimeMCS() - t;
+
+    if (!decoder) {
+        LOG("%-6s %s: unsupported format\n", sourceFormat(src), src.name);
+        return;
+    }
+
+    int count = 0;
+    t = osGetTimeMCS();
+    while (count < maxFrames) {
+        decoder->prefetch(); // the game thread part of the streaming decoders
+        int res = decoder->decode(frames, min(int(COUNT(frames)), maxFrames - count));
+        if (res <= 0) break;
+        count += res;
+    }
+    t = osGetTimeMCS() - t;
+    delete decoder;
+
+    float sec = count / float(SND_RATE);
+    LOG("%-6s %s: open %.3f ms, %d frames in %.2f ms, %.3f ms per sec of audio\n", sourceFormat(src), src.name, openTime / 1000.0f, count, t / 1000.0f, sec > 0.0f ? t / 1000.0f / sec : 0.0f);
+}
+
+int main(int argc, char **argv) {
+    cacheDir[0] = saveDir[0] = contentDir[0] = 0;
+
+    startTime = 0;
+    startTime = osGetTimeMCS();
+
+    int   maxFrames  = SND_RATE * 10;
+    int   block      = 1024;
+    int   loops      = 32;
+    int   seed       = 0;
+    int   tolerance  = 0;
+    int   checks     = 0;
+    float pitchVar   = 0.1f;
+    bool  reverb     = true;
+    char  *music      = NULL;
+    char  *goldenName = NULL;
+    char  *saveName   = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-frames") && i + 1 < argc)
+            maxFrames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-block") && i + 1 < argc)
+            block = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-loops") && i + 1 < argc)
+            loops = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-pitch") && i + 1 < argc)
+            pitchVar = clamp(float(atof(argv[++i])), 0.0f, 0.49f);
+        else if (!strcmp(argv[i], "-reverb") && i + 1 < argc)
+            reverb = atoi(argv[++i]) != 0;
+        else if (!strcmp(argv[i], "-seed") && i + 1 < argc)
+            seed = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-music") && i + 1 < argc)
+            music = argv[++i];
+        else if (!strcmp(argv[i], "-golden") && i + 1 < argc)
+            goldenName = argv[++i];
+        else if (!strcmp(argv[i], "-mixer-check") && i + 1 < argc)
+            checks = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-tolerance") && i + 1 < argc)
+            tolerance = max(0, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-save-golden") && i + 1 < argc)
+            saveName = argv[++i];
+        else if (argv[i][0] == '-') {
+            LOG("usage: OpenLara_audiobench [-frames N] [-block N] [-loops N] [-pitch X] [-reverb 0|1] [-seed N] [-music file] [-golden file.wav] [-tolerance N] [-save-golden file.wav] [source...]\n"
+                "       OpenLara_audiobench -mixer-check N [-seed N]\n");
+            return 1;
+        } else {
+            Source src;
+            if (!sourceLoad(argv[i], src))
+                return 1;
+            sources.push(src);
+        }
+    }
+
+    if (checks > 0) {
+        sceneSeed = uint32(seed);
+        return mixerCheck(checks) ? 0 : 1;
+    }
+
+    if (block <= 0 || maxFrames <= 0) {
+        LOG("! invalid block or frames count\n");
+        return 1;
+    }
+
+    if (!sources.length) {
+        Source src;
+        sourceGenerate(src);
+        sources.push(src);
+    }
+
+    Source musicSrc;
+    if (music && !sourceLoad(music, musicSrc))
+        return 1;
+
+    Golden golden = { NULL, 0 };
+    if (goldenName && !goldenLoad(goldenName, golden))
+        return 1;
+
+    Core::settings.audio.music  = SND_MAX_VOLUME;
+    Core::settings.audio.sound  = SND_MAX_VOLUME;
+    Core::settings.audio.reverb = reverb;
+
+    Sound::init();
+    Sound::listenersCount = 1;
+    Sound::listener[0].matrix.identity();
+    Sound::reverb.setRoomSize(vec3(4096.0f, 2048.0f, 4096.0f));
+
+// decoders
+    LOG("decoders:\n");
+    for (int i = 0; i < sources.length; i++)
+        benchmarkDecoder(sources[i], maxFrames);
+    if (music)
+        benchmarkDecoder(musicSrc, maxFrames);
+
+// scene
+    sceneSeed = uint32(seed);
+
+    vec3 *positions = new vec3[max(1, loops)];
+    for (int i = 0; i < loops; i++) {
+        float a = sceneRand() * PI * 2.0f;
+        float r = sceneRand() * SCENE_RADIUS;
+        positions[i] = vec3(sinf(a) * r, (sceneRand() - 0.5f) * 1024.0f, cosf(a) * r);
+
+        float pitch = 1.0f + (sceneRand() * 2.0f - 1.0f) * pitchVar;
+        Sound::play(sourceStream(sources[i % sources.length]), &positions[i], 1.0f, pitch, Sound::PAN | Sound::LOOP, i);
+    }
+
+    if (music)
+        Sound::play(sourceStream(musicSrc), NULL, 1.0f, 1.0f, Sound::MUSIC | Sound::LOOP);
+
+    LOG("\nscene      : %d loops, %d sources%s, pitch +/-%.2f, reverb %s, %d frames per fill\n", loops, sources.length, music ? " + music" : "", pitchVar, reverb ? "on" : "off", block);
+
+// mix
+    int fills = (maxFrames + block - 1) / block;
+    Sound::Frame *output = new Sound::Frame[fills * block];
+    Array<int>   times;
+    int64        total = 0;
+
+    for (int i = 0; i < fills; i++) {
+        int64 t = osGetTimeMCS();
+        Sound::fill(output + i * block, block);
+        t = osGetTimeMCS() - t;
+
+        times.push(int(t));
+        total += t;
+
+        Sound::update(); // release finished channels like the game thread does
+    }
+
+    int count = fills * block;
+
+    qsort(times.items, times.length, sizeof(int), cmpTime);
+
+    float sec    = total / 1000000.0f;
+    float budget = block * 1000.0f / SND_RATE;
+    int   worst  = percentile(times, 100);
+    LOG("channels   : %d playing, %d steals, %d rejects, %d dropped commands\n", Sound::channelsCount, Sound::stats.steals, Sound::stats.rejects, Sound::stats.drops);
+    LOG("mix        : %d frames in %.2f ms, %.0f frames/sec, %.1fx realtime\n", count, total / 1000.0f, sec > 0.0f ? count / sec : 0.0f, sec > 0.0f ? count / float(SND_RATE) / sec : 0.0f);
+    LOG("fill time  : p50 %.3f ms, p99 %.3f ms, max %.3f ms of %.3f ms budget (%.1f%%)\n", percentile(times, 50) / 1000.0f, percentile(times, 99) / 1000.0f, worst / 1000.0f, budget, worst / 10.0f / budget);
+
+    uint32 hash = fnv32((const char*)output, count * sizeof(Sound::Frame));
+    LOG("checksum   : %08X\n", hash);
+
+    int result = 0;
+
+    if (saveName && !goldenSave(saveName, output, count))
+        result = 1;
+
+    if (golden.frames) {
+        uint32 expected = fnv32((const char*)golden.frames, golden.count * sizeof(Sound::Frame));
+        if (golden.count != count || expected != hash) {
+            int mismatches = abs(golden.count - count);
+            int first      = -1;
+            int maxDiff    = 0;
+            for (int i = 0; i < min(count, golden.count); i++) {
+                int d = max(abs(output[i].L - golden.frames[i].L), abs(output[i].R - golden.frames[i].R));
+                maxDiff = max(maxDiff, d);
+                if (d <= tolerance) continue;
+                if (first < 0) first = i;
+                mismatches++;
+            }
+            if (mismatches) {
+                LOG("! golden mismatch: %08X expected %08X, %d frames differ (first %d, max diff %d, tolerance %d), %d frames expected\n", hash, expected, mismatches, first, maxDiff, tolerance, golden.count);
+                result = 1;
+            } else
+                LOG("golden     : match within tolerance %d (max diff %d)\n", tolerance, maxDiff);
+        } else
+            LOG("golden     : match\n");
+        delete[] golden.frames;
+    }
+
+    Sound::deinit();
+
+    delete[] output;
+    delete[] positions;
+    for (int i = 0; i < sources.length; i++)
+        delete[] sources[i].data;
+    if (music)
+        delete[] musicSrc.data;
+
+    return result;
+}
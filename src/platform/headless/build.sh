@@ -0,0 +1,4 @@
+set -e
+g++ -std=c++11 -O2 -fno-exceptions -fno-rtti -ffunction-sections -fdata-sections -Wl,--gc-sections -DNDEBUG -D__HEADLESS__ -D_POSIX_THREADS -D_POSIX_READER_WRITER_LOCKS main.cpp ../../libs/stb_vorbis/stb_vorbis.c ../../libs/minimp3/minimp3.cpp ../../libs/tinf/tinflate.c -I../../ -o../../../bin/OpenLara_headless -lm -lpthread
+g++ -std=c++11 -O2 -fno-exceptions -fno-rtti -ffunction-sections -fdata-sections -Wl,--gc-sections -DNDEBUG -D__HEADLESS__ -D_POSIX_THREADS -D_POSIX_READER_WRITER_LOCKS videobench.cpp ../../libs/stb_vorbis/stb_vorbis.c ../../libs/minimp3/minimp3.cpp ../../libs/tinf/tinflate.c -I../../ -o../../../bin/OpenLara_videobench -lm -lpthread
+g++ -std=c++11 -O2 -fno-exceptions -fno-rtti -ffunction-sections -fdata-sections -Wl,--gc-sections -DNDEBUG -D__HEADLESS__ -D_POSIX_THREADS -D_POSIX_READER_WRITER_LOCKS audiobench.cpp ../../libs/stb_vorbis/stb_vorbis.c ../../libs/minimp3/minimp3.cpp ../../libs/tinf/tinflate.c -I../../ -o../../../bin/OpenLara_audiobench -lm -lpthread
@@ -0,0 +1,319 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "game.h"
+
+// headless simulation benchmark
+// runs N fixed timestep ticks of the level without window, GPU and audio thread
+// usage: OpenLara_headless [-ticks N] [-seed N] [-script file] [-snapshots N] [level file]
+//
+// -snapshots N captures the simulation state every tick into the ring of N snapshots,
+//   at the end the oldest snapshot is restored and the rest of the ticks are simulated again
+//   with the recorded input, the captured snapshots must match the ones of the original run (exit code 1 otherwise)
+//   scripts/weapons.txt draws and fires the weapons within the snapshots of "-ticks 300 -snapshots 200"
+//
+// input script line format: <tick> <+|-><key>
+//   +key press the key at the tick, -key release it, '#' starts a comment
+//   key names: left, right, up, down, space, tab, enter, escape, shift, ctrl, alt, 0..9, a..z
+//   example: "30 +up" "90 -up" "95 +alt" "96 -alt"
+
+#define TICK_RATE       30
+#define SND_FRAMES      (44100 / TICK_RATE)
+
+// timing
+int64 startTime;
+int   simTime;
+
+int64 osGetTimeMCS() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64(t.tv_sec) * 1000000 + t.tv_nsec / 1000 - startTime;
+}
+
+int osGetTime() {
+    return simTime; // simulation time for deterministic replay
+}
+
+// input
+bool osJoyReady(int index) {
+    return false;
+}
+
+void osJoyVibrate(int index, float L, float R) {}
+
+struct ScriptEvent {
+    int      tick;
+    InputKey key;
+    bool     down;
+};
+
+Array<ScriptEvent> script;
+int scriptIndex;
+
+InputKey getInputKey(const char *name) {
+    static const char *names[] = { "left", "right", "up", "down", "space", "tab", "enter", "escape", "shift", "ctrl", "alt" };
+
+    for (int i = 0; i < COUNT(names); i++)
+        if (!strcmp(names[i], name))
+            return InputKey(ikLeft + i);
+
+    if (name[0] && !name[1]) {
+        if (name[0] >= '0' && name[0] <= '9') return InputKey(ik0 + (name[0] - '0'));
+        if (name[0] >= 'a' && name[0] <= 'z') return InputKey(ikA + (name[0] - 'a'));
+    }
+
+    return ikNone;
+}
+
+bool scriptLoad(const char *fileName) {
+    FILE *f = fopen(fileName, "rb");
+    if (!f) {
+        LOG("! can't open input script \"%s\"\n", fileName);
+        return false;
+    }
+
+    char line[256], name[64];
+    int  lineIndex = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineIndex++;
+
+        char *comment = strchr(line, '#');
+        if (comment) *comment = 0;
+
+        ScriptEvent e;
+        char state;
+        int res = sscanf(line, "%d %c%63s", &e.tick, &state, name);
+        if (res <= 0)
+            continue; // empty line
+
+        e.key  = getInputKey(name);
+        e.down = state == '+';
+        if (res != 3 || (state != '+' && state != '-') || e.key == ikNone) {
+            LOG("! input script line %d is invalid\n", lineIndex);
+            continue;
+        }
+
+        if (script.length && script[script.length - 1].tick > e.tick) {
+            LOG("! input script line %d is out of order\n", lineIndex);
+            continue;
+        }
+
+        script.push(e);
+    }
+    fclose(f);
+
+    LOG("input script: %d events\n", script.length);
+    return true;
+}
+
+void scriptUpdate(int tick) {
+    while (scriptIndex < script.length && script[scriptIndex].tick <= tick) {
+        ScriptEvent &e = script[scriptIndex++];
+        Input::setDown(e.key, e.down);
+    }
+}
+
+Sound::Frame *sndData;
+Array<int>   captureTick; // headless tick of the snapshot capture by the snapshot tick
+
+void simulate(int tick) {
+    scriptUpdate(tick);
+
+    simTime = tick * 1000 / TICK_RATE;
+    Core::deltaTime = 1.0f / TICK_RATE;
+
+    Game::update();
+
+    { // mix audio on the game thread to keep the channels state deterministic
+        PROFILE_MARKER("SOUND");
+        Sound::fill(sndData, SND_FRAMES);
+    }
+
+    if (Game::level)
+        while (captureTick.length < Game::level->snapshotTick)
+            captureTick.push(tick);
+}
+
+// restores the oldest snapshot, simulates the next ticks with the recorded input again
+// and compares the captured snapshots with the ones of the original run
+bool testSnapshots() {
+    SnapshotRing *snapshots = Game::level->snapshots;
+    if (!snapshots || !snapshots->count)
+        return true;
+
+// restore timing
+    int64 restoreTime = 0;
+    for (int i = 0; i < snapshots->count; i++) {
+        int64 t = osGetTimeMCS();
+        Game::level->restoreSnapshot(i, false);
+        restoreTime += osGetTimeMCS() - t;
+    }
+
+    LOG("\n");
+    LOG("snapshots  : %d, %d KB (%d bytes avg, %d max)\n", snapshots->count, snapshots->getSize() / 1024, snapshots->getSize() / snapshots->count, snapshots->stride);
+    LOG("restore    : %.3f ms avg\n", restoreTime / 1000.0f / snapshots->count);
+
+// the replay starts from the last snapshot of the headless tick (the fast motion may capture a few per tick)
+    int back = snapshots->count - 1;
+    while (back > 0) {
+        int t = snapshots->get(back)->tick;
+        if (t + 1 >= captureTick.length || captureTick[t + 1] != captureTick[t])
+            break;
+        back--;
+    }
+
+    if (back == 0) {
+        LOG("replay     : not enough snapshots\n");
+        return true;
+    }
+
+// keep the original snapshots, the replay overwrites them in the ring
+    int    count  = back;
+    int    stride = snapshots->stride;
+    uint8  *orig  = new uint8[count * stride];
+    int    *sizes = new int[count];
+    int    *ticks = new int[count];
+    uint32 *seeds = new uint32[count];
+    for (int i = 0; i < count; i++) {
+        SnapshotRing::Snapshot *s = snapshots->get(back - 1 - i);
+        memcpy(orig + i * stride, s->data, s->size);
+        sizes[i] = s->size;
+        ticks[i] = s->tick;
+        seeds[i] = s->seed;
+    }
+
+    int fromTick = captureTick[snapshots->get(back)->tick];
+    int toTick   = captureTick[ticks[count - 1]];
+
+// input state at the end of the snapshot tick
+    Input::reset();
+    scriptIndex = 0;
+    scriptUpdate(fromTick);
+
+    Game::level->restoreSnapshot(back, true);
+    captureTick.length = Game::level->snapshotTick;
+
+    for (int tick = fromTick + 1; tick <= toTick; tick++)
+        simulate(tick);
+
+    int compared   = 0;
+    int mismatches = 0;
+    for (int i = 0; i < count; i++) {
+        SnapshotRing::Snapshot *s = NULL;
+        for (int j = 0; j < snapshots->count && !s; j++)
+            if (snapshots->get(j)->tick == ticks[i])
+                s = snapshots->get(j);
+        if (!s) continue;
+
+        compared++;
+        if (s->size != sizes[i] || s->seed != seeds[i] || memcmp(s->data, orig + i * stride, sizes[i])) {
+            if (!mismatches)
+                LOG("! replay diverged at tick %d (snapshot %d)\n", captureTick[ticks[i]], ticks[i]);
+            mismatches++;
+        }
+    }
+
+    LOG("replay     : ticks %d..%d, %d snapshots compared, %d mismatches\n", fromTick, toTick, compared, mismatches);
+
+    delete[] seeds;
+    delete[] ticks;
+    delete[] sizes;
+    delete[] orig;
+
+    return mismatches == 0;
+}
+
+// stats
+void printStats(int ticks, int64 time) {
+    float sec = time / 1000000.0f;
+
+    LOG("\n");
+    LOG("ticks      : %d (%.1f sec of game time)\n", ticks, float(ticks) / TICK_RATE);
+    LOG("wall time  : %.3f sec\n", sec);
+    LOG("ticks/sec  : %.1f\n", sec > 0.0f ? ticks / sec : 0.0f);
+    LOG("realtime   : x%.1f\n", sec > 0.0f ? (float(ticks) / TICK_RATE) / sec : 0.0f);
+    LOG("\n");
+    // nested markers are indented under the enclosing one, total ms includes them and self % excludes them
+    LOG("%-20s %10s %10s %12s %8s\n", "subsystem", "total ms", "calls", "mcs/tick", "self %");
+    for (int i = 0; i < GAPI::markerStatsCount; i++) {
+        GAPI::MarkerStat &s = GAPI::markerStats[i];
+        LOG("%*s%-*s %10.2f %10d %12.2f %8.2f\n", s.depth * 2, "", 20 - s.depth * 2, s.title, s.time / 1000.0f, s.count, ticks ? float(s.time) / ticks : 0.0f, time ? s.self * 100.0f / time : 0.0f);
+    }
+
+    LOG("\n");
+    LOG("anim store   : %d KB\n", Game::level->level.getAnimStoreSize() / 1024);
+    LOG("sector cache : %d KB\n", Game::level->level.getSectorCacheSize() / 1024);
+#ifdef SND_BANK
+    LOG("sample bank  : %d KB\n", Game::level->sampleBank ? Game::level->sampleBank->size / 1024 : 0);
+#endif
+    LOG("sound voices : %d steals, %d rejects, %d dropped commands\n", Sound::stats.steals, Sound::stats.rejects, Sound::stats.drops);
+
+    ZoneCache *zoneCache = Game::level->zoneCache;
+    if (zoneCache) {
+        int total = zoneCache->pathHits + zoneCache->pathMisses;
+        LOG("\n");
+        LOG("path cache : %d hits, %d misses (%.1f%%)\n", zoneCache->pathHits, zoneCache->pathMisses, total ? zoneCache->pathHits * 100.0f / total : 0.0f);
+    }
+}
+
+int main(int argc, char **argv) {
+    cacheDir[0] = saveDir[0] = contentDir[0] = 0;
+
+    startTime = 0;
+    startTime = osGetTimeMCS();
+    simTime   = 0;
+
+    int  ticks     = 30 * TICK_RATE; // 30 sec of game time by default
+    int  seed      = 0;
+    int  snapshots = 0;
+    char *lvlName  = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-ticks") && i + 1 < argc)
+            ticks = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-seed") && i + 1 < argc)
+            seed = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-snapshots") && i + 1 < argc)
+            snapshots = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-script") && i + 1 < argc) {
+            if (!scriptLoad(argv[++i]))
+                return 1;
+        } else
+            lvlName = argv[i];
+    }
+
+    srand(seed);
+    scriptIndex = 0;
+
+    Core::width  = 1280;
+    Core::height = 720;
+
+    Game::init(lvlName);
+
+    if (!Game::level) {
+        Game::deinit();
+        return 1;
+    }
+
+    Game::level->initSnapshots(snapshots);
+
+    sndData = new Sound::Frame[SND_FRAMES];
+
+    GAPI::resetMarkers(); // ignore level loading time
+
+    int64 time = osGetTimeMCS();
+
+    int tick;
+    for (tick = 0; tick < ticks && !Core::isQuit; tick++)
+        simulate(tick);
+
+    printStats(tick, osGetTimeMCS() - time);
+    bool replayed = testSnapshots();
+
+    delete[] sndData;
+    Game::deinit();
+
+    return replayed ? 0 : 1;
+}
@@ -0,0 +1,12 @@
+set -e
+# usage: test.sh [level file] (run build.sh first)
+# compares the audio mixer output of the default tone scene with the golden files
+# the SSE2 and scalar reverb may differ by 1 LSB, so the reverb golden is compared with tolerance
+../../../bin/OpenLara_audiobench -frames 16384 -reverb 0 -golden golden/tone_reverb0.wav
+../../../bin/OpenLara_audiobench -frames 16384 -reverb 1 -golden golden/tone_reverb1.wav -tolerance 1
+# the SIMD mixer must match the scalar reference bit-exactly
+../../../bin/OpenLara_audiobench -mixer-check 10000
+# with the level file argument replays the snapshots of the weapons script, the replay must match the original run
+if [ -n "$1" ]; then
+    ../../../bin/OpenLara_headless -ticks 300 -snapshots 200 -script scripts/weapons.txt "$1"
+fi
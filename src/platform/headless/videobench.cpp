@@ -0,0 +1,254 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "core.h"
+#include "video.h"
+
+// FMV decoders benchmark
+// decodes the video files by Video::Escape, Video::STR or Video::Cinepak directly (no GAPI, no audio thread)
+// and reports frames/sec, per-frame latency percentiles and the audio decoding cost
+// usage: OpenLara_videobench [-frames N] [-golden file] [-save-golden file] file [file...]
+//
+// golden file line format: <video file name> <frame index> <checksum>
+//   audio checksum of the whole file is stored as the frame index -1
+//   -save-golden writes the checksums of the decoded frames, -golden compares them
+
+#define AUDIO_CHUNK 2048
+
+// timing
+int64 startTime;
+
+int64 osGetTimeMCS() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return int64(t.tv_sec) * 1000000 + t.tv_nsec / 1000 - startTime;
+}
+
+int osGetTime() {
+    return int(osGetTimeMCS() / 1000);
+}
+
+// input
+bool osJoyReady(int index) {
+    return false;
+}
+
+void osJoyVibrate(int index, float L, float R) {}
+
+// checksums
+struct Golden {
+    char   name[256];
+    int    frame;
+    uint32 hash;
+};
+
+Array<Golden> golden;
+
+bool goldenLoad(const char *fileName) {
+    FILE *f = fopen(fileName, "rb");
+    if (!f) {
+        LOG("! can't open golden file \"%s\"\n", fileName);
+        return false;
+    }
+
+    char line[512];
+    Golden g;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "%255s %d %x", g.name, &g.frame, &g.hash) == 3)
+            golden.push(g);
+    fclose(f);
+
+    LOG("golden: %d checksums\n", golden.length);
+    return true;
+}
+
+bool goldenFind(const char *name, int frame, uint32 &hash) {
+    for (int i = 0; i < golden.length; i++)
+        if (golden[i].frame == frame && !strcmp(golden[i].name, name)) {
+            hash = golden[i].hash;
+            return true;
+        }
+    return false;
+}
+
+// stats
+int cmpTime(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+int percentile(Array<int> &times, int p) {
+    if (!times.length) return 0;
+    return times[min(times.length - 1, times.length * p / 100)];
+}
+
+struct Result {
+    int    frames;
+    int64  videoTime;
+    int64  audioTime;
+    int    audioFrames;
+    int    mismatches;
+    int    missing;
+};
+
+bool benchmark(const char *fileName, int maxFrames, FILE *saveGolden, Result &res) {
+    static const char *formats[] = { "Escape", "STR", "Cinepak" };
+
+    memset(&res, 0, sizeof(res));
+
+    Stream *stream = new Stream(fileName);
+    if (stream->size <= 0) {
+        LOG("! can't open video file \"%s\"\n", fileName);
+        delete stream;
+        return false;
+    }
+
+    Video::Format format;
+    Video::Decoder *decoder = Video::createDecoder(stream, format);
+
+    LOG("\n%s: %s %dx%d %d fps, audio %d Hz\n", fileName, formats[format], decoder->width, decoder->height, decoder->fps, decoder->freq);
+
+    Color32      *pixels = new Color32[decoder->width * decoder->height];
+    Sound::Frame *audio  = new Sound::Frame[AUDIO_CHUNK];
+    Array<int>   times;
+
+    int    samplesPerFrame = decoder->fps ? decoder->freq / decoder->fps : 0;
+    int    samplesPending  = 0;
+    uint32 audioHash       = 0x811C9DC5;
+
+    while (res.frames < maxFrames) {
+        int64 t = osGetTimeMCS();
+        bool valid = decoder->decodeVideo(pixels);
+        t = osGetTimeMCS() - t;
+
+        if (!valid)
+            break;
+
+        times.push(int(t));
+        res.videoTime += t;
+
+        uint32 hash = fnv32((const char*)pixels, decoder->width * decoder->height * sizeof(Color32));
+        if (saveGolden)
+            fprintf(saveGolden, "%s %d %08X\n", fileName, res.frames, hash);
+
+        uint32 expected;
+        if (golden.length) {
+            if (!goldenFind(fileName, res.frames, expected))
+                res.missing++;
+            else if (expected != hash) {
+                if (!res.mismatches)
+                    LOG("! frame %d checksum mismatch: %08X expected %08X\n", res.frames, hash, expected);
+                res.mismatches++;
+            }
+        }
+
+    // present the frame and pull its share of audio like the mixer does
+        decoder->shownChunk = decoder->frameChunk;
+        samplesPending += samplesPerFrame;
+        while (samplesPending > 0) {
+            int count = min(samplesPending, AUDIO_CHUNK);
+
+            int64 t = osGetTimeMCS();
+            int decoded = decoder->decode(audio, count);
+            res.audioTime += osGetTimeMCS() - t;
+
+            if (decoded <= 0) {
+                samplesPending = 0;
+                break;
+            }
+
+            audioHash = fnv32((const char*)audio, decoded * sizeof(Sound::Frame), audioHash);
+            res.audioFrames += decoded;
+            samplesPending  -= decoded;
+        }
+
+        res.frames++;
+    }
+
+    if (saveGolden)
+        fprintf(saveGolden, "%s %d %08X\n", fileName, -1, audioHash);
+
+    uint32 expected;
+    if (golden.length && goldenFind(fileName, -1, expected) && expected != audioHash) {
+        LOG("! audio checksum mismatch: %08X expected %08X\n", audioHash, expected);
+        res.mismatches++;
+    }
+
+    qsort(times.items, times.length, sizeof(int), cmpTime);
+
+    float sec = res.videoTime / 1000000.0f;
+    LOG("frames     : %d\n", res.frames);
+    LOG("video      : %.2f ms total, %.1f frames/sec\n", res.videoTime / 1000.0f, sec > 0.0f ? res.frames / sec : 0.0f);
+    LOG("frame time : p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", percentile(times, 50) / 1000.0f, percentile(times, 99) / 1000.0f, percentile(times, 100) / 1000.0f);
+    LOG("audio      : %.2f ms total, %d samples, %.3f ms per frame\n", res.audioTime / 1000.0f, res.audioFrames, res.frames ? res.audioTime / 1000.0f / res.frames : 0.0f);
+    if (golden.length)
+        LOG("golden     : %d mismatches, %d frames missing\n", res.mismatches, res.missing);
+
+    delete[] audio;
+    delete[] pixels;
+    delete decoder; // owns the stream
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    cacheDir[0] = saveDir[0] = contentDir[0] = 0;
+
+    startTime = 0;
+    startTime = osGetTimeMCS();
+
+    int   maxFrames  = 0x7FFFFFFF;
+    FILE  *saveGolden = NULL;
+    Array<char*> files;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-frames") && i + 1 < argc)
+            maxFrames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-golden") && i + 1 < argc) {
+            if (!goldenLoad(argv[++i]))
+                return 1;
+        } else if (!strcmp(argv[i], "-save-golden") && i + 1 < argc) {
+            saveGolden = fopen(argv[++i], "wb");
+            if (!saveGolden) {
+                LOG("! can't create golden file \"%s\"\n", argv[i]);
+                return 1;
+            }
+        } else
+            files.push(argv[i]);
+    }
+
+    if (!files.length) {
+        LOG("usage: OpenLara_videobench [-frames N] [-golden file] [-save-golden file] file [file...]\n");
+        return 1;
+    }
+
+    Sound::init();
+
+    int  failed = 0;
+    Result total;
+    memset(&total, 0, sizeof(total));
+
+    for (int i = 0; i < files.length; i++) {
+        Result res;
+        if (!benchmark(files[i], maxFrames, saveGolden, res)) {
+            failed++;
+            continue;
+        }
+        total.frames      += res.frames;
+        total.videoTime   += res.videoTime;
+        total.audioTime   += res.audioTime;
+        total.mismatches  += res.mismatches + res.missing;
+    }
+
+    float sec = total.videoTime / 1000000.0f;
+    LOG("\n");
+    LOG("total      : %d files, %d frames, %.1f frames/sec, audio %.2f ms\n", files.length - failed, total.frames, sec > 0.0f ? total.frames / sec : 0.0f, total.audioTime / 1000.0f);
+
+    if (saveGolden)
+        fclose(saveGolden);
+
+    Sound::deinit();
+
+    return (failed || total.mismatches) ? 1 : 0;
+}
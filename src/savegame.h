@@ -2,12 +2,14 @@
 #define H_SAVEGAME
 
 #include "utils.h"
+#include "jobs.h"
 
 #define MAX_FLIPMAP_COUNT     32
 #define MAX_TRACKS_COUNT      256
 
 #define SAVE_FILENAME       "savegame.dat"
-#define SAVE_MAGIC          FOURCC("OLS2")
+#define SAVE_MAGIC          FOURCC("OLS3") // checkpoints keep indexed records of the changed entities only
+#define SAVE_MAGIC_V2       FOURCC("OLS2") // checkpoints keep all entities in order
 
 enum SaveResult {
     SAVE_RESULT_SUCCESS,
@@ -75,6 +77,86 @@ struct SaveEntity {
     } extra;
 };
 
+// entity record of the checkpoint slot
+struct SaveEntityRecord {
+    int32      index;
+    SaveEntity entity; // stored up to extraSize
+
+    static int getSize(const SaveEntity &entity) {
+        return (sizeof(SaveEntity) - sizeof(SaveEntity::Extra)) + entity.extraSize;
+    }
+
+    int getSize() const {
+        return sizeof(index) + getSize(entity);
+    }
+};
+
+// full runtime state of the controller for the simulation snapshots (never stored in the save file)
+// enemy path boxes (pathCount - pathIndex) or Lara's SnapshotLara follow the record
+struct SnapshotEntity {
+    int32  index;
+    int32  size; // including the path boxes
+// controller
+    vec3   pos, angle;
+    float  timer;
+    uint16 flags;
+    int16  room;
+// animation
+    int32  animState;
+    int16  animIndex, animPrev, animNext, animFramePrev;
+    float  animTime, animTimeMax, animDir;
+    vec3   animOffset, animJump;
+    int32  animEnded;
+// character
+    float  health, tilt, angleExt, speed;
+    vec3   velocity;
+    int32  stand, input, lastInput, zone, box;
+// enemy
+    int32  ai, mood, nextState;
+    float  thinkTime, targetDist, targetAngle;
+    vec3   waypoint;
+    uint16 targetBox;
+    int16  target; // entity index or -1
+    uint8  wound, targetDead, targetInView, targetFromView, targetCanAttack;
+    int16  pathCount; // -1 if no path
+    uint16 pathBoxes[1];
+
+    static int getSize(int pathCount) {
+        return (int(sizeof(SnapshotEntity) + max(0, pathCount - 1) * sizeof(uint16)) + 3) & ~3;
+    }
+};
+
+// Lara's weapons, arms and camera state (setSaveData resets the weapons to the drawn or hidden state)
+struct SnapshotLara {
+    struct Arm {
+        int16  model;               // arm animation model or -1
+        int16  tracking, target;    // entity index or -1
+        int16  anim;
+        quat   rot, rotAbs;
+        int32  animState;
+        int16  animIndex, animPrev, animNext, animFramePrev;
+        float  animTime, animTimeMax, animDir;
+        int32  animEnded;
+    } arms[2];
+// weapons
+    int32  wpnCurrent, wpnNext, wpnState, itemHolster, usedItem;
+    uint32 layerModel[4], layerMask[4];
+// lara
+    float  oxygen, damageTime, hitTime, hitTimer;
+    int32  hitDir;
+    vec3   collisionOffset, flowVelocity;
+    int16  viewTarget;  // entity index or -1
+    uint8  dozy, canJump;
+// camera
+    int32  camMode, camViewIndex, camViewIndexLast, camSpeed;
+    float  camTimer, camShake;
+    vec3   camAngle, camLookAngle, camTargetAngle;
+    vec3   camEyePos, camTargetPos;
+    int16  camEyeRoom, camTargetRoom;
+    int16  camViewTarget; // entity index or -1
+    uint8  camSmooth, camCenterView;
+};
+
 struct SaveState {
     struct ByteFlags {
         uint8 once:1, active:5, :2;
@@ -110,20 +192,139 @@ struct SaveSlot {
     }
 };
 
+// ring buffer of the simulation state snapshots (rewind, replay and desync debugging)
+// snapshots are stored in the fixed size blocks allocated once, the latest one is get(0)
+struct SnapshotRing {
+    struct Snapshot {
+        int32  tick;
+        uint32 seed;
+        int32  size;
+        uint8  *data;
+    } *items;
+
+    uint8 *buffer;
+    int   stride;
+    int   capacity;
+    int   count;
+    int   head; // index of the next snapshot
+
+    SnapshotRing(int capacity, int stride) : stride(stride), capacity(capacity), count(0), head(0) {
+        buffer = new uint8[capacity * stride];
+        items  = new Snapshot[capacity];
+        for (int i = 0; i < capacity; i++) {
+            items[i].size = 0;
+            items[i].data = buffer + i * stride;
+        }
+    }
+
+    ~SnapshotRing() {
+        delete[] items;
+        delete[] buffer;
+    }
+
+    Snapshot& push() {
+        Snapshot &s = items[head];
+        head  = (head + 1) % capacity;
+        count = min(count + 1, capacity);
+        return s;
+    }
+
+    Snapshot* get(int back) {
+        if (back < 0 || back >= count)
+            return NULL;
+        return &items[(head - 1 - back + capacity) % capacity];
+    }
+
+    void drop(int back) { // remove the latest snapshots
+        back  = min(back, count);
+        head  = (head - back + capacity) % capacity;
+        count -= back;
+    }
+
+    // grow the blocks keeping the snapshots (enemy paths make the snapshot size unbounded)
+    void reserve(int size) {
+        if (size <= stride)
+            return;
+        int newStride = max(size, stride + stride / 2);
+        uint8 *newBuffer = new uint8[capacity * newStride];
+        for (int i = 0; i < capacity; i++) {
+            memcpy(newBuffer + i * newStride, items[i].data, items[i].size);
+            items[i].data = newBuffer + i * newStride;
+        }
+        delete[] buffer;
+        buffer = newBuffer;
+        stride = newStride;
+    }
+
+    int getSize() const {
+        int size = 0;
+        for (int i = 0; i < count; i++)
+            size += items[(head - 1 - i + capacity) % capacity].size;
+        return size;
+    }
+};
+
 Array<SaveSlot> saveSlots;
 SaveResult      saveResult;
 int             loadSlot;
 SaveStats       saveStats;
 
+// the file is written by a background task from a snapshot of the slots list
+// slots data must not be changed or freed while the task is active (see waitSaveSlots)
+Jobs::Background saveTask;
+Array<SaveSlot>  saveTaskSlots;
+uint8            *saveTaskData;
+volatile bool    saveTaskDone;
+volatile bool    saveTaskResult;
+bool             saveTaskPending;
+
+void waitSaveSlots() {
+    Jobs::wait(saveTask);
+}
+
 void freeSaveSlots() {
+    waitSaveSlots();
     for (int i = 0; i < saveSlots.length; i++)
         delete[] saveSlots[i].data;
     saveSlots.clear();
 }
 
+// insert the entity indices into the checkpoint slot of the previous version
+void convertSaveSlotV2(SaveSlot &slot) {
+    if (!((SaveStats*)slot.data)->checkpoint)
+        return;
+
+    uint8 *ptr = slot.data + sizeof(SaveStats);
+    ptr += sizeof(int32) + sizeof(SaveItem) * *(int32*)ptr;
+    ptr += sizeof(SaveState);
+
+    int32 entitiesCount = *(int32*)ptr;
+    ptr += sizeof(entitiesCount);
+
+    uint8 *data = new uint8[slot.size + sizeof(int32) * entitiesCount];
+    uint8 *dst  = data + (ptr - slot.data);
+    memcpy(data, slot.data, dst - data);
+
+    for (int i = 0; i < entitiesCount; i++) {
+        int size = SaveEntityRecord::getSize(*(SaveEntity*)ptr);
+        memcpy(dst, &i, sizeof(int32));
+        memcpy(dst + sizeof(int32), ptr, size);
+        dst += sizeof(int32) + size;
+        ptr += size;
+    }
+
+    delete[] slot.data;
+    slot.data = data;
+    slot.size = uint32(dst - data);
+}
+
 void readSaveSlots(Stream *stream) {
     uint32 magic;
-    if (stream->size < 4 || stream->read(magic) != SAVE_MAGIC)
+    if (stream->size < 4)
+        return;
+
+    stream->read(magic);
+    if (magic != SAVE_MAGIC && magic != SAVE_MAGIC_V2)
         return;
 
     freeSaveSlots();
@@ -132,11 +333,13 @@ void readSaveSlots(Stream *stream) {
     while (stream->pos < stream->size) {
         stream->read(slot.size);
         stream->read(slot.data, slot.size);
+        if (magic == SAVE_MAGIC_V2)
+            convertSaveSlotV2(slot);
         saveSlots.push(slot);
     }
 }
 
-uint8* writeSaveSlots(int &size) {
+uint8* writeSaveSlots(const Array<SaveSlot> &saveSlots, int &size) {
     size = 4;
     for (int i = 0; i < saveSlots.length; i++)
         size += 4 + saveSlots[i].size;
@@ -149,7 +352,7 @@ uint8* writeSaveSlots(int &size) {
     *magic = SAVE_MAGIC;
 
     for (int i = 0; i < saveSlots.length; i++) {
-        SaveSlot &s = saveSlots[i];
+        const SaveSlot &s = saveSlots[i];
         memcpy(ptr + 0, &s.size,  4);
         memcpy(ptr + 4, s.data,   s.size);
         ptr += 4 + s.size;
@@ -158,9 +361,59 @@ uint8* writeSaveSlots(int &size) {
     return data;
 }
 
+static void saveSlotsWriteAsync(Stream *stream, void *userData) {
+    saveTaskResult = stream != NULL;
+    delete stream;
+    MEMORY_BARRIER();
+    saveTaskDone = true;
+}
+
+static void saveSlotsWriteProc(void *userData) {
+    int size;
+    saveTaskData = writeSaveSlots(saveTaskSlots, size);
+    osWriteSlot(new Stream(SAVE_FILENAME, (const char*)saveTaskData, size, saveSlotsWriteAsync, NULL));
+}
+
+// start writing of the current slots list, saveResult is SAVE_RESULT_WAIT until updateSaveSlots finishes it
+void writeSaveSlots() {
+    waitSaveSlots();
+
+    saveTaskSlots.length = 0;
+    for (int i = 0; i < saveSlots.length; i++)
+        saveTaskSlots.push(saveSlots[i]);
+
+    saveResult      = SAVE_RESULT_WAIT;
+    saveTaskDone    = false;
+    saveTaskPending = true;
+
+    if (!Jobs::startBackground(saveTask, saveSlotsWriteProc, NULL))
+        saveSlotsWriteProc(NULL);
+}
+
+// returns true once the pending write is finished and saveResult is updated
+bool updateSaveSlots(bool wait = false) {
+    if (!saveTaskPending)
+        return false;
+
+    if (wait)
+        waitSaveSlots();
+
+    if (!saveTaskDone)
+        return false;
+
+    waitSaveSlots();
+    delete[] saveTaskData;
+    saveTaskData    = NULL;
+    saveTaskPending = false;
+    saveResult      = saveTaskResult ? SAVE_RESULT_SUCCESS : SAVE_RESULT_ERROR;
+    return true;
+}
+
 void removeSaveSlot(TR::LevelID levelID, bool checkpoint) {
     TR::Version version = TR::getGameVersionByLevel(levelID);
 
+    waitSaveSlots();
+
     for (int i = 0; i < saveSlots.length; i++) {
         SaveSlot &slot = saveSlots[i];
 
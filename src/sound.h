@@ -12,6 +12,10 @@
     #define DECODE_MP3
 #endif
 
+#ifndef _OS_PSP
+    #define SND_BANK // decode the level samples at load time
+#endif
+
 #include "utils.h"
 
 #ifdef DECODE_MP3
@@ -24,6 +28,7 @@
 #endif
 
 #define SND_CHANNELS_MAX    128
+#define SND_VOICES_MAX      (SND_CHANNELS_MAX + 32) // + stopped voices waiting for release by the mixer
 #define SND_FADEOFF_DIST    (1024.0f * 8.0f)
 #define SND_MAX_VOLUME      20
 
@@ -50,6 +55,221 @@ namespace Sound {
         int32 L, R;
     };
 
+// channel mixer: resample, volume ramp, pan and accumulate into FrameHI buffer
+    struct MixParams {
+        float pitch;
+        float volume;       // channel volume before the first frame
+        float volumeTarget;
+        float volumeDelta;  // per frame volume change
+        float master;       // music or sound volume setting
+        vec2  pan;
+    };
+
+    inline void mixFrame(FrameHI &result, const Frame *frames, int index, int count, const MixParams &p) {
+        float t    = index * p.pitch;
+        int   idxA = int(t);
+        int   idxB = (index == count - 1) ? idxA : (idxA + 1);
+        float k    = t - idxA;
+
+        float v = p.volume + p.volumeDelta * (index + 1);
+        v = (p.volumeDelta < 0.0f) ? max(v, p.volumeTarget) : min(v, p.volumeTarget);
+        v *= p.master;
+        float g = 1.0f - sqrtf(max(0.0f, 1.0f - v * v));
+
+        float L = float(frames[idxA].L) + (float(frames[idxB].L) - float(frames[idxA].L)) * k;
+        float R = float(frames[idxA].R) + (float(frames[idxB].R) - float(frames[idxA].R)) * k;
+        result.L += int(L * (g * p.pan.x));
+        result.R += int(R * (g * p.pan.y));
+    }
+
+    // scalar reference
+    void mixFramesRef(FrameHI *result, const Frame *frames, int count, const MixParams &p) {
+        for (int i = 0; i < count; i++)
+            mixFrame(result[i], frames, i, count, p);
+    }
+
+#ifdef USE_SSE2
+    void mixFramesSIMD(FrameHI *result, const Frame *frames, int count, const MixParams &p) {
+        const __m128 one    = _mm_set1_ps(1.0f);
+        const __m128 zero   = _mm_setzero_ps();
+        const __m128 pitch  = _mm_set1_ps(p.pitch);
+        const __m128 volume = _mm_set1_ps(p.volume);
+        const __m128 target = _mm_set1_ps(p.volumeTarget);
+        const __m128 delta  = _mm_set1_ps(p.volumeDelta);
+        const __m128 master = _mm_set1_ps(p.master);
+        const __m128 pan    = _mm_setr_ps(p.pan.x, p.pan.y, p.pan.x, p.pan.y);
+        const bool   fadeOut = p.volumeDelta < 0.0f;
+        const bool   noPitch = p.pitch == 1.0f;
+        const int32  *src    = (const int32*)frames; // L & R pair as int32
+
+        int i = 0;
+        for (; i + 4 < count; i += 4) { // the last frame has no next frame to interpolate with
+            __m128 idx = _mm_cvtepi32_ps(_mm_setr_epi32(i, i + 1, i + 2, i + 3));
+
+        // volume ramp
+            __m128 v = _mm_add_ps(volume, _mm_mul_ps(delta, _mm_add_ps(idx, one)));
+            v = fadeOut ? _mm_max_ps(v, target) : _mm_min_ps(v, target);
+            v = _mm_mul_ps(v, master);
+            __m128 g = _mm_sub_ps(one, _mm_sqrt_ps(_mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(v, v)))));
+        // pan
+            __m128 g01 = _mm_mul_ps(_mm_unpacklo_ps(g, g), pan);
+            __m128 g23 = _mm_mul_ps(_mm_unpackhi_ps(g, g), pan);
+
+        // resample
+            __m128 s01, s23;
+            if (noPitch) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+                s01 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16));
+                s23 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16));
+            } else {
+                __m128  t   = _mm_mul_ps(idx, pitch);
+                __m128i idxA = _mm_cvttps_epi32(t);
+                __m128  k    = _mm_sub_ps(t, _mm_cvtepi32_ps(idxA));
+
+                int32 n[4];
+                _mm_storeu_si128((__m128i*)n, idxA);
+                __m128i a = _mm_setr_epi32(src[n[0]],     src[n[1]],     src[n[2]],     src[n[3]]);
+                __m128i b = _mm_setr_epi32(src[n[0] + 1], src[n[1] + 1], src[n[2] + 1], src[n[3] + 1]);
+
+                __m128 a01 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16));
+                __m128 a23 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16));
+                __m128 b01 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16));
+                __m128 b23 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(b, b), 16));
+
+                s01 = _mm_add_ps(a01, _mm_mul_ps(_mm_sub_ps(b01, a01), _mm_unpacklo_ps(k, k)));
+                s23 = _mm_add_ps(a23, _mm_mul_ps(_mm_sub_ps(b23, a23), _mm_unpackhi_ps(k, k)));
+            }
+
+        // accumulate
+            __m128i *dst = (__m128i*)(result + i);
+            _mm_storeu_si128(dst + 0, _mm_add_epi32(_mm_loadu_si128(dst + 0), _mm_cvttps_epi32(_mm_mul_ps(s01, g01))));
+            _mm_storeu_si128(dst + 1, _mm_add_epi32(_mm_loadu_si128(dst + 1), _mm_cvttps_epi32(_mm_mul_ps(s23, g23))));
+        }
+
+        for (; i < count; i++)
+            mixFrame(result[i], frames, i, count, p);
+    }
+#elif defined(USE_NEON)
+    inline float32x4_t sqrt4(float32x4_t x) {
+    #ifdef __aarch64__
+        return vsqrtq_f32(x);
+    #else
+        x = vmaxq_f32(x, vdupq_n_f32(FLT_MIN)); // avoid 0 * inf
+        float32x4_t r = vrsqrteq_f32(x);
+        r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(x, r), r));
+        r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(x, r), r));
+        return vmulq_f32(x, r);
+    #endif
+    }
+
+    inline void unpackFrames(int32x4_t x, float32x4_t &f01, float32x4_t &f23) {
+        int16x8_t s = vreinterpretq_s16_s32(x);
+        f01 = vcvtq_f32_s32(vmovl_s16(vget_low_s16(s)));
+        f23 = vcvtq_f32_s32(vmovl_s16(vget_high_s16(s)));
+    }
+
+    void mixFramesSIMD(FrameHI *result, const Frame *frames, int count, const MixParams &p) {
+        static const int32_t offsets[4] = { 0, 1, 2, 3 };
+
+        const float32x4_t one    = vdupq_n_f32(1.0f);
+        const float32x4_t zero   = vdupq_n_f32(0.0f);
+        const float32x4_t pitch  = vdupq_n_f32(p.pitch);
+        const float32x4_t volume = vdupq_n_f32(p.volume);
+        const float32x4_t target = vdupq_n_f32(p.volumeTarget);
+        const float32x4_t delta  = vdupq_n_f32(p.volumeDelta);
+        const float32x4_t master = vdupq_n_f32(p.master);
+        const float32x4_t pan    = vcombine_f32(vld1_f32((const float*)&p.pan), vld1_f32((const float*)&p.pan));
+        const int32x4_t   offset = vld1q_s32(offsets);
+        const bool        fadeOut = p.volumeDelta < 0.0f;
+        const bool        noPitch = p.pitch == 1.0f;
+        const int32_t     *src    = (const int32_t*)frames; // L & R pair as int32
+
+        int i = 0;
+        for (; i + 4 < count; i += 4) { // the last frame has no next frame to interpolate with
+            float32x4_t idx = vcvtq_f32_s32(vaddq_s32(vdupq_n_s32(i), offset));
+
+        // volume ramp
+            float32x4_t v = vaddq_f32(volume, vmulq_f32(delta, vaddq_f32(idx, one)));
+            v = fadeOut ? vmaxq_f32(v, target) : vminq_f32(v, target);
+            v = vmulq_f32(v, master);
+            float32x4_t g = vsubq_f32(one, sqrt4(vmaxq_f32(zero, vsubq_f32(one, vmulq_f32(v, v)))));
+        // pan
+            float32x4x2_t gg = vzipq_f32(g, g);
+            float32x4_t g01 = vmulq_f32(gg.val[0], pan);
+            float32x4_t g23 = vmulq_f32(gg.val[1], pan);
+
+        // resample
+            float32x4_t s01, s23;
+            if (noPitch) {
+                unpackFrames(vld1q_s32(src + i), s01, s23);
+            } else {
+                float32x4_t t    = vmulq_f32(idx, pitch);
+                int32x4_t   idxA = vcvtq_s32_f32(t);
+                float32x4_t k    = vsubq_f32(t, vcvtq_f32_s32(idxA));
+
+                int32_t n[4], a[4], b[4];
+                vst1q_s32(n, idxA);
+                for (int j = 0; j < 4; j++) {
+                    a[j] = src[n[j]];
+                    b[j] = src[n[j] + 1];
+                }
+
+                float32x4_t a01, a23, b01, b23;
+                unpackFrames(vld1q_s32(a), a01, a23);
+                unpackFrames(vld1q_s32(b), b01, b23);
+
+                float32x4x2_t kk = vzipq_f32(k, k);
+                s01 = vaddq_f32(a01, vmulq_f32(vsubq_f32(b01, a01), kk.val[0]));
+                s23 = vaddq_f32(a23, vmulq_f32(vsubq_f32(b23, a23), kk.val[1]));
+            }
+
+        // accumulate
+            int32_t *dst = (int32_t*)(result + i);
+            vst1q_s32(dst + 0, vaddq_s32(vld1q_s32(dst + 0), vcvtq_s32_f32(vmulq_f32(s01, g01))));
+            vst1q_s32(dst + 4, vaddq_s32(vld1q_s32(dst + 4), vcvtq_s32_f32(vmulq_f32(s23, g23))));
+        }
+
+        for (; i < count; i++)
+            mixFrame(result[i], frames, i, count, p);
+    }
+#endif
+
+    void mixFrames(FrameHI *result, const Frame *frames, int count, const MixParams &p) {
+    #if defined(USE_SSE2) || defined(USE_NEON)
+        mixFramesSIMD(result, frames, count, p);
+    #else
+        mixFramesRef(result, frames, count, p);
+    #endif
+    }
+
+// clamp mixed frames to 16-bit
+    void convFramesRef(const FrameHI *from, Frame *to, int count) {
+        for (int i = 0; i < count; i++) {
+            to[i].L = clamp(from[i].L, -32767, 32767);
+            to[i].R = clamp(from[i].R, -32767, 32767);
+        }
+    }
+
+    void convFrames(const FrameHI *from, Frame *to, int count) {
+        int i = 0;
+    #if defined(USE_SSE2)
+        const __m128i minValue = _mm_set1_epi16(-32767);
+        for (; i + 4 <= count; i += 4) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(from + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(from + i + 2));
+            _mm_storeu_si128((__m128i*)(to + i), _mm_max_epi16(_mm_packs_epi32(a, b), minValue));
+        }
+    #elif defined(USE_NEON)
+        const int16x8_t minValue = vdupq_n_s16(-32767);
+        for (; i + 4 <= count; i += 4) {
+            const int32_t *src = (const int32_t*)(from + i);
+            int16x8_t x = vcombine_s16(vqmovn_s32(vld1q_s32(src)), vqmovn_s32(vld1q_s32(src + 4)));
+            vst1q_s16((int16_t*)(to + i), vmaxq_s16(x, minValue));
+        }
+    #endif
+        convFramesRef(from + i, to + i, count - i);
+    }
+
     namespace Filter {
         #define MAX_FDN     16
         #define MAX_DELAY   1024
@@ -120,7 +340,8 @@ namespace Sound {
                 }
             };
 
-            void process(FrameHI *frames, int count) {
+        // scalar reference
+            void processRef(FrameHI *frames, int count) {
                 float buffer[MAX_FDN];
 
                 for (int i = 0; i < count; i++) {
@@ -151,6 +372,224 @@ namespace Sound {
                     frame.R = int(R * 32767.0f);
                 }
             }
+
+        // the block is shorter than the shortest delay line, so the values read in the block were written before it
+        // delay lines are gathered to (and scattered from) lines[frame][fdn] by two ring segments instead of the modulo per sample
+            #define REVERB_BLOCK 256
+
+            float lines[REVERB_BLOCK][MAX_FDN];
+
+            void readLines(int count) {
+                for (int j = 0; j < MAX_FDN; j++) {
+                    const Delay &d = df[j];
+                    int idx = d.index;
+                    int a = min(count, FDN[j] - 1 - idx);
+                    for (int i = 0; i < a; i++)
+                        lines[i][j] = d.out[++idx];
+                    idx = -1;
+                    for (int i = a; i < count; i++)
+                        lines[i][j] = d.out[++idx];
+                }
+            }
+
+            void writeLines(int count) {
+                for (int j = 0; j < MAX_FDN; j++) {
+                    Delay &d = df[j];
+                    int idx = d.index;
+                    int a = min(count, FDN[j] - 1 - idx);
+                    for (int i = 0; i < a; i++)
+                        d.out[++idx] = lines[i][j];
+                    idx = -1;
+                    for (int i = a; i < count; i++)
+                        d.out[++idx] = lines[i][j];
+                    d.index = a < count ? idx : d.index + count;
+                }
+            }
+
+        // 16 feedback lines as SIMD lanes, lines[i] is replaced by the delay input of the frame
+            void processLanes(FrameHI *frames, int count) {
+            #if defined(USE_SSE2)
+                const __m128 eps = _mm_set1_ps(EPS);
+                __m128 gain[4], damp[4], undamp[4], panL[4], panR[4], absorb[4], feed[4];
+                for (int q = 0; q < 4; q++) {
+                    float g[4], d[4], u[4], pl[4], pr[4], a[4];
+                    for (int k = 0; k < 4; k++) {
+                        int j = q * 4 + k;
+                        g[k]  = absCoeff[j][0];
+                        d[k]  = absCoeff[j][1];
+                        u[k]  = 1.0f - absCoeff[j][1];
+                        pl[k] = panCoeff[j][0];
+                        pr[k] = panCoeff[j][1];
+                        a[k]  = af[j].out;
+                    }
+                    gain[q]   = _mm_loadu_ps(g);
+                    damp[q]   = _mm_loadu_ps(d);
+                    undamp[q] = _mm_loadu_ps(u);
+                    panL[q]   = _mm_loadu_ps(pl);
+                    panR[q]   = _mm_loadu_ps(pr);
+                    absorb[q] = _mm_loadu_ps(a);
+                    feed[q]   = _mm_loadu_ps(output + q * 4);
+                }
+
+                for (int i = 0; i < count; i++) {
+                    FrameHI &frame = frames[i];
+                    float L = frame.L * (1.0f / 32767.0f);
+                    float R = frame.R * (1.0f / 32767.0f);
+                    __m128 in = _mm_set1_ps((L + R) * 0.5f);
+                    __m128 sum = _mm_setzero_ps(), sumL = _mm_setzero_ps(), sumR = _mm_setzero_ps();
+
+                    for (int q = 0; q < 4; q++) {
+                        float *line = lines[i] + q * 4;
+                        __m128 y = _mm_loadu_ps(line);
+                        _mm_storeu_ps(line, _mm_add_ps(in, feed[q]));
+
+                        __m128 a = _mm_add_ps(_mm_mul_ps(absorb[q], damp[q]), _mm_mul_ps(_mm_mul_ps(y, gain[q]), undamp[q]));
+                        a = _mm_and_ps(a, _mm_cmpge_ps(a, eps));
+                        absorb[q] = a;
+                        sum  = _mm_add_ps(sum, a);
+                        sumL = _mm_add_ps(sumL, _mm_mul_ps(a, panL[q]));
+                        sumR = _mm_add_ps(sumR, _mm_mul_ps(a, panR[q]));
+                    }
+
+                // horizontal sums of (sum, sumL, sumR)
+                    __m128 t0 = _mm_unpacklo_ps(sum, sumL);
+                    __m128 t1 = _mm_unpackhi_ps(sum, sumL);
+                    __m128 t2 = _mm_unpacklo_ps(sumR, sumR);
+                    __m128 t3 = _mm_unpackhi_ps(sumR, sumR);
+                    __m128 h  = _mm_add_ps(_mm_add_ps(_mm_movelh_ps(t0, t2), _mm_movehl_ps(t2, t0)),
+                                           _mm_add_ps(_mm_movelh_ps(t1, t3), _mm_movehl_ps(t3, t1)));
+                    float hs[4];
+                    _mm_storeu_ps(hs, h);
+
+                // feedback of the previous line
+                    __m128 out = _mm_set1_ps(hs[0] * (2.0f / MAX_FDN));
+                    for (int q = 0; q < 4; q++) {
+                        __m128 t = _mm_shuffle_ps(absorb[(q + 3) % 4], absorb[q], _MM_SHUFFLE(0, 0, 3, 3));
+                        __m128 f = _mm_sub_ps(out, _mm_shuffle_ps(t, absorb[q], _MM_SHUFFLE(2, 1, 2, 0)));
+                        feed[q] = _mm_and_ps(f, _mm_cmpge_ps(f, eps));
+                    }
+
+                    frame.L = int((L + hs[1]) * 32767.0f);
+                    frame.R = int((R + hs[2]) * 32767.0f);
+                }
+
+                for (int q = 0; q < 4; q++) {
+                    _mm_storeu_ps(output + q * 4, feed[q]);
+                    float a[4];
+                    _mm_storeu_ps(a, absorb[q]);
+                    for (int k = 0; k < 4; k++)
+                        af[q * 4 + k].out = a[k];
+                }
+            #elif defined(USE_NEON)
+                const float32x4_t eps  = vdupq_n_f32(EPS);
+                const float32x4_t zero = vdupq_n_f32(0.0f);
+                float32x4_t gain[4], damp[4], undamp[4], panL[4], panR[4], absorb[4], feed[4];
+                for (int q = 0; q < 4; q++) {
+                    float g[4], d[4], u[4], pl[4], pr[4], a[4];
+                    for (int k = 0; k < 4; k++) {
+                        int j = q * 4 + k;
+                        g[k]  = absCoeff[j][0];
+                        d[k]  = absCoeff[j][1];
+                        u[k]  = 1.0f - absCoeff[j][1];
+                        pl[k] = panCoeff[j][0];
+                        pr[k] = panCoeff[j][1];
+                        a[k]  = af[j].out;
+                    }
+                    gain[q]   = vld1q_f32(g);
+                    damp[q]   = vld1q_f32(d);
+                    undamp[q] = vld1q_f32(u);
+                    panL[q]   = vld1q_f32(pl);
+                    panR[q]   = vld1q_f32(pr);
+                    absorb[q] = vld1q_f32(a);
+                    feed[q]   = vld1q_f32(output + q * 4);
+                }
+
+                for (int i = 0; i < count; i++) {
+                    FrameHI &frame = frames[i];
+                    float L = frame.L * (1.0f / 32767.0f);
+                    float R = frame.R * (1.0f / 32767.0f);
+                    float32x4_t in = vdupq_n_f32((L + R) * 0.5f);
+                    float32x4_t sum = zero, sumL = zero, sumR = zero;
+
+                    for (int q = 0; q < 4; q++) {
+                        float *line = lines[i] + q * 4;
+                        float32x4_t y = vld1q_f32(line);
+                        vst1q_f32(line, vaddq_f32(in, feed[q]));
+
+                        float32x4_t a = vaddq_f32(vmulq_f32(absorb[q], damp[q]), vmulq_f32(vmulq_f32(y, gain[q]), undamp[q]));
+                        a = vbslq_f32(vcgeq_f32(a, eps), a, zero);
+                        absorb[q] = a;
+                        sum  = vaddq_f32(sum, a);
+                        sumL = vaddq_f32(sumL, vmulq_f32(a, panL[q]));
+                        sumR = vaddq_f32(sumR, vmulq_f32(a, panR[q]));
+                    }
+
+                    float32x2_t s  = vadd_f32(vget_low_f32(sum),  vget_high_f32(sum));
+                    float32x2_t sL = vadd_f32(vget_low_f32(sumL), vget_high_f32(sumL));
+                    float32x2_t sR = vadd_f32(vget_low_f32(sumR), vget_high_f32(sumR));
+                    float hs  = vget_lane_f32(vpadd_f32(s,  s),  0);
+                    float hsL = vget_lane_f32(vpadd_f32(sL, sL), 0);
+                    float hsR = vget_lane_f32(vpadd_f32(sR, sR), 0);
+
+                // feedback of the previous line
+                    float32x4_t out = vdupq_n_f32(hs * (2.0f / MAX_FDN));
+                    for (int q = 0; q < 4; q++) {
+                        float32x4_t f = vsubq_f32(out, vextq_f32(absorb[(q + 3) % 4], absorb[q], 3));
+                        feed[q] = vbslq_f32(vcgeq_f32(f, eps), f, zero);
+                    }
+
+                    frame.L = int((L + hsL) * 32767.0f);
+                    frame.R = int((R + hsR) * 32767.0f);
+                }
+
+                for (int q = 0; q < 4; q++) {
+                    vst1q_f32(output + q * 4, feed[q]);
+                    float a[4];
+                    vst1q_f32(a, absorb[q]);
+                    for (int k = 0; k < 4; k++)
+                        af[q * 4 + k].out = a[k];
+                }
+            #else
+                float buffer[MAX_FDN];
+
+                for (int i = 0; i < count; i++) {
+                    FrameHI &frame = frames[i];
+                    float L   = frame.L * (1.0f / 32767.0f);
+                    float R   = frame.R * (1.0f / 32767.0f);
+                    float in  = (L + R) * 0.5f;
+                    float out = 0.0f;
+
+                    for (int j = 0; j < MAX_FDN; j++) {
+                        float y = lines[i][j];
+                        lines[i][j] = in + output[j];
+                        float k = af[j].process(y, absCoeff[j][0], absCoeff[j][1]);
+                        out += k * (2.0f / MAX_FDN);
+                        buffer[j] = k;
+                    }
+
+                    for (int j = 0; j < MAX_FDN; j++) {
+                        output[j] = out - buffer[(j + MAX_FDN - 1) % MAX_FDN];
+                        if (output[j] < EPS) output[j] = 0.0f;
+                        L += buffer[j] * panCoeff[j][0];
+                        R += buffer[j] * panCoeff[j][1];
+                    }
+
+                    frame.L = int(L * 32767.0f);
+                    frame.R = int(R * 32767.0f);
+                }
+            #endif
+            }
+
+            void process(FrameHI *frames, int count) {
+                for (int i = 0; i < count; i += REVERB_BLOCK) {
+                    int n = min(REVERB_BLOCK, count - i);
+                    readLines(n);
+                    processLanes(frames + i, n);
+                    writeLines(n);
+                }
+            }
+
+            #undef REVERB_BLOCK
         };
 
         #undef MAX_FDN
@@ -169,6 +608,7 @@ namespace Sound {
         virtual ~Decoder() { delete stream; }
         virtual int decode(Frame *frames, int count) { return 0; }
         virtual void replay() { stream->seek(offset - stream->pos); }
+        virtual void prefetch() {} // called by the game thread to read the stream ahead of the mixer
 
         int resample(Sound::Frame *frames, Sound::Frame &frame) {
             if (freq == 44100) {
@@ -593,93 +1033,636 @@ namespace Sound {
     };
 #endif
 
+#if defined(DECODE_MP3) || defined(DECODE_OGG)
+    #define SND_STREAM_RING  (256 * 1024) // ~16 sec of 128 kbps
+    #define SND_STREAM_CHUNK (16 * 1024)  // min size of the file reads
+
+// compressed data of the music streams, only a part of the file is resident
+// the game thread reads the file ahead into the ring (prefetch), the mixer thread moves it to the linear input of the codec
+// so the mixer doesn't do any file IO or allocations, it plays silence if the game thread is late with the data
+// the file is read over and over, the queued ends of the passes let the looped tracks continue without a gap
+    struct StreamBuffer {
+        struct End {
+            int32 pos;      // ring position at the end of the pass
+            bool  restart;  // the pass is cut by the replay request
+        };
+
+    // producer (game thread)
+        Stream *stream;
+        int    offset;          // start of the data in the stream
+        int    passSize;
+        volatile bool eof;      // the stream has no data, nothing to loop
+
+        uint8  *ring;
+        int32  ringSize;
+        volatile int32 written; // total counts, written by the producer
+        volatile int32 read;    // by the consumer
+        volatile bool  restart; // consumer -> producer, replay from the start
+        RingQueue<End, 4> ends;
+
+    // consumer (mixer thread)
+        uint8  *data;
+        int    capacity, start, end;
+        bool   skipping;        // drops the data of the cut pass
+
+        StreamBuffer() : stream(NULL), ring(NULL), data(NULL) {}
+
+        ~StreamBuffer() {
+            delete[] ring;
+            delete[] data;
+        }
+
+    // called by the game thread, the input size is the max data the codec needs at once
+        void init(Stream *stream, int offset, int inputSize) {
+            this->stream = stream;
+            this->offset = offset;
+
+            int size = clamp(stream->size - offset, SND_STREAM_CHUNK, SND_STREAM_RING);
+            ringSize = SND_STREAM_CHUNK;
+            while (ringSize < size)
+                ringSize *= 2;
+
+            ring     = new uint8[ringSize];
+            data     = new uint8[inputSize];
+            capacity = inputSize;
+            start    = end = 0;
+            written  = read = 0;
+            passSize = 0;
+            eof      = restart = skipping = false;
+
+            stream->setPos(offset);
+            prefetch();
+        }
+
+        void prefetch() {
+            if (restart) {
+                End e = { written, true };
+                if (!ends.push(e))
+                    return;
+                stream->setPos(offset);
+                passSize = 0;
+                eof      = false;
+                MEMORY_BARRIER();
+                restart  = false;
+            }
+
+            while (!eof) {
+                int free = ringSize - (written - read);
+                if (free < min(SND_STREAM_CHUNK, ringSize / 4))
+                    break;
+
+                if (stream->pos >= stream->size) {
+                    End e = { written, false };
+                    if (!ends.push(e))
+                        break;
+                    if (!passSize) {
+                        eof = true;
+                        break;
+                    }
+                    stream->setPos(offset);
+                    passSize = 0;
+                    continue;
+                }
+
+                int pos   = written & (ringSize - 1);
+                int count = min(min(free, ringSize - pos), stream->size - stream->pos);
+                stream->raw(ring + pos, count);
+                passSize += count;
+                MEMORY_BARRIER(); // publish the data before the counter
+                written += count;
+            }
+        }
+
+        const uint8* ptr() const {
+            return data + start;
+        }
+
+        int length() const {
+            return end - start;
+        }
+
+        void consume(int bytes) {
+            start += bytes;
+        }
+
+    // drops the data of the cut pass until its end, returns false while the producer is still on it
+        bool skip() {
+            End e;
+            while (skipping) {
+                bool cut = ends.peek(e);
+                read = cut ? e.pos : written;
+                if (!cut)
+                    return false;
+                ends.pop(e);
+                skipping = !e.restart;
+            }
+            return true;
+        }
+
+    // moves the available data of the current pass to the codec input
+        void fetch() {
+            if (!skip())
+                return;
+
+            if (start) {
+                memmove(data, data + start, end - start);
+                end  -= start;
+                start = 0;
+            }
+
+            End e;
+            int32 limit = ends.peek(e) ? e.pos : written;
+            MEMORY_BARRIER(); // read the counter before the data
+
+            int count = min(capacity - end, int(limit - read));
+            int pos   = read & (ringSize - 1);
+            int part  = min(count, ringSize - pos);
+            memcpy(data + end, ring + pos, part);
+            memcpy(data + end + part, ring, count - part);
+            end += count;
+
+            MEMORY_BARRIER(); // read the data before the space is released
+            read += count;
+        }
+
+    // all data of the pass is in the codec input (or the stream is empty)
+        bool isPassEnd() const {
+            if (skipping)
+                return false;
+            End e;
+            if (ends.peek(e))
+                return e.pos == read;
+            return eof && written == read;
+        }
+
+    // continues with the next pass after the end of the current one (looping), or cuts the current one (replay)
+        void replay() {
+            End e;
+            if (isPassEnd() && start == end) {
+                ends.pop(e);
+                return;
+            }
+            start = end = 0;
+            skipping = true;
+            MEMORY_BARRIER();
+            restart  = true;
+        }
+    };
+#endif
+
 #ifdef DECODE_MP3
+    #define MP3_FRAME_SIZE_MAX 2881 // 320 kbps at 8 kHz with padding
+
     struct MP3 : Decoder {
         mp3_decoder_t   mp3;
-        char    *buffer;
-        int     size, pos;        
+        StreamBuffer    input;
+        int16           pcm[1152 * 2];
+        int             pcmPos, pcmCount, pcmChannels;
 
-        MP3(Stream *stream, int channels) : Decoder(stream, channels, 0), size(stream->size), pos(0) {
+        MP3(Stream *stream, int channels, bool tagged) : Decoder(stream, channels, 0), pcmPos(0), pcmCount(0) {
             mp3 = mp3_create();
-            buffer = new char[size]; // TODO: file streaming
-            stream->raw(buffer, size);
+            if (tagged) {
+            // skip ID3v2 tag ("ID3" and major version are already read by createDecoder)
+                uint8 header[6];
+                stream->raw(header, sizeof(header));
+                int size = (header[2] << 21) | (header[3] << 14) | (header[4] << 7) | header[5];
+                if (header[1] & 0x10) size += 10; // footer
+                stream->seek(size);
+            }
+            offset = stream->pos;
+            input.init(stream, offset, MP3_FRAME_SIZE_MAX * 4);
         }
 
         virtual ~MP3() {
-            delete[] buffer;
             mp3_done(mp3);
         }
 
+        virtual void prefetch() {
+            input.prefetch();
+        }
+
+    // returns 1 if the frame is decoded, 0 at the end of the pass, -1 if the data is not read yet
+        int decodeFrame() {
+            while (1) {
+                if (input.length() < MP3_FRAME_SIZE_MAX)
+                    input.fetch();
+
+                mp3_info_t info;
+                int res = mp3_decode(mp3, (void*)input.ptr(), input.length(), pcm, &info);
+                if (!res) {
+                    if (input.length() < MP3_FRAME_SIZE_MAX) {
+                        if (!input.isPassEnd())
+                            return -1;
+                        input.consume(input.length()); // incomplete frame at the end
+                        return 0;
+                    }
+                    input.consume(input.length() - 3); // garbage, resync on the next header
+                    continue;
+                }
+                input.consume(res);
+
+                if (info.audio_bytes > 0) {
+                    pcmChannels = info.channels;
+                    pcmCount    = info.audio_bytes / (sizeof(int16) * pcmChannels);
+                    pcmPos      = 0;
+                    return 1;
+                }
+            }
+        }
+
         virtual int decode(Frame *frames, int count) {
-            mp3_info_t info;
             int i = 0;
-            char *ptr = (char*)frames;
-            while (ptr < (char*)&frames[count]) {
-                int res = mp3_decode(mp3, buffer + pos, size - pos, (short*)ptr, &info);
-                if (res) {
-                    pos += res;
-                    ptr += info.audio_bytes;
-                    i   += info.audio_bytes;
+            while (i < count) {
+                if (pcmPos == pcmCount) {
+                    int res = decodeFrame();
+                    if (res < 0) { // underrun
+                        memset(frames + i, 0, (count - i) * sizeof(Frame));
+                        return count;
+                    }
+                    if (!res)
+                        break;
+                }
+
+                int n = min(count - i, pcmCount - pcmPos);
+                if (pcmChannels == 1) {
+                    for (int j = 0; j < n; j++)
+                        frames[i + j].L = frames[i + j].R = pcm[pcmPos + j];
                 } else
-                    break;
+                    memcpy(frames + i, pcm + pcmPos * 2, n * sizeof(Frame));
+                pcmPos += n;
+                i      += n;
             }
             return i;
         }
 
         virtual void replay() {
-            mp3_done(mp3);
-            mp3 = mp3_create();
-            pos = 0;
+            mp3_reset(mp3);
+            input.replay();
+            pcmPos = pcmCount = 0;
         }
     };
 #endif
 
 #ifdef DECODE_OGG
+    #define OGG_PACKET_SIZE_MAX (64 * 1024) // the max page size, packets are much smaller in practice
+
     struct OGG : Decoder {
         stb_vorbis       *ogg;
         stb_vorbis_alloc alloc;
+        StreamBuffer     input;
+        float            **output;
+        int              outputPos, outputCount;
 
-        uint8 *data;
-
-        OGG(Stream *stream, int channels) : Decoder(stream, channels, 0), ogg(NULL) {
-            char buf[255];
-            strcpy(buf, contentDir);
-            strcat(buf, stream->name);
-
-            data = new uint8[stream->size];
-            stream->raw(data, stream->size);
-
+        OGG(Stream *stream, int channels) : Decoder(stream, channels, 0), ogg(NULL), outputPos(0), outputCount(0) {
             alloc.alloc_buffer_length_in_bytes = 256 * 1024;
             alloc.alloc_buffer = new char[alloc.alloc_buffer_length_in_bytes];
-            ogg = stb_vorbis_open_memory(data, stream->size, NULL, &alloc);
-            ASSERT(ogg);
-            stb_vorbis_info info = stb_vorbis_get_info(ogg);
-            this->channels = info.channels;
-            this->freq     = info.sample_rate;
+            if (open()) {
+                stb_vorbis_info info = stb_vorbis_get_info(ogg);
+                this->channels = info.channels;
+                this->freq     = info.sample_rate;
+                input.init(stream, offset, OGG_PACKET_SIZE_MAX);
+            }
         }
 
         virtual ~OGG() {
-            stb_vorbis_close(ogg);
+            if (ogg) stb_vorbis_close(ogg);
             delete[] alloc.alloc_buffer;
+        }
+
+    // the headers (with codebooks) must be in the buffer at once, it grows until they fit
+    // called once by the game thread, the loops continue from the audio data after the headers
+        bool open() {
+            int   size = SND_STREAM_CHUNK, length = 0;
+            uint8 *data = new uint8[size];
+
+            while (1) {
+                int used, error;
+                ogg = stb_vorbis_open_pushdata(data, length, &used, &error, &alloc);
+                if (ogg) {
+                    offset += used;
+                    break;
+                }
+
+                int count = min(size - length, stream->size - stream->pos);
+                if (error != VORBIS_need_more_data || count <= 0) {
+                    LOG("! can't open ogg stream (%d)\n", error);
+                    break;
+                }
+
+                stream->raw(data + length, count);
+                length += count;
+
+                if (length == size) {
+                    uint8 *tmp = new uint8[size * 2];
+                    memcpy(tmp, data, length);
+                    delete[] data;
+                    data  = tmp;
+                    size *= 2;
+                }
+            }
+
             delete[] data;
+            return ogg != NULL;
+        }
+
+        virtual void prefetch() {
+            if (ogg) input.prefetch();
         }
 
         virtual int decode(Frame *frames, int count) {
+            if (!ogg) return 0;
+
             int i = 0;
             while (i < count) {
-                int res = stb_vorbis_get_samples_short_interleaved(ogg, channels, (short*)frames + i, (count - i) * 2);
-                if (!res) break;
-                i += res;
+                if (outputPos == outputCount) {
+                    int samples;
+                    int used = stb_vorbis_decode_frame_pushdata(ogg, input.ptr(), input.length(), NULL, &output, &samples);
+                    input.consume(used);
+                    outputPos   = 0;
+                    outputCount = samples;
+                    if (used || samples)
+                        continue;
+
+                    int length = input.length();
+                    input.fetch();
+                    if (input.length() > length)
+                        continue;
+
+                    if (input.isPassEnd()) {
+                        input.consume(input.length()); // incomplete packet at the end
+                        break;
+                    }
+
+                    if (length == input.capacity) // the packet doesn't fit, drop it and resync on the next page
+                        input.consume(length);
+
+                    memset(frames + i, 0, (count - i) * sizeof(Frame)); // underrun
+                    return count;
+                }
+
+                int n = min(count - i, outputCount - outputPos);
+                const float *L = output[0] + outputPos;
+                const float *R = output[channels > 1 ? 1 : 0] + outputPos;
+                for (int j = 0; j < n; j++) {
+                    frames[i + j].L = clamp(int(L[j] * 32768.0f), -32768, 32767);
+                    frames[i + j].R = clamp(int(R[j] * 32768.0f), -32768, 32767);
+                }
+                outputPos += n;
+                i         += n;
             }
             return i;
         }
 
         virtual void replay() {
-            stb_vorbis_seek_start(ogg);
+            if (!ogg) return;
+            stb_vorbis_flush_pushdata(ogg);
+            input.replay();
+            outputPos = outputCount = 0;
         }
     };
 #endif
-    Core::Mutex lock;
+
+    enum Format { FMT_WAV, FMT_OGG, FMT_MP3, FMT_SEGA, FMT_VAG };
+
+// sound file format by the first 4 bytes, the one test for createDecoder and the sample bank
+    Format getFormat(uint32 fourcc) {
+        if (fourcc == FOURCC("RIFF")) return FMT_WAV;
+        if (fourcc == FOURCC("OggS")) return FMT_OGG;
+        if (fourcc == FOURCC("ID3\3")) return FMT_MP3;
+        if ((fourcc & 0xE0FF) == 0xE0FF && (fourcc & 0x0600)) return FMT_MP3; // MP3 without ID3 tag (frame sync and not reserved layer)
+        if (fourcc == FOURCC("SEGA")) return FMT_SEGA;
+        return FMT_VAG;
+    }
+
+// creates the sample decoder by the stream header, takes the stream ownership
+    Decoder* createDecoder(Stream *stream) {
+        Decoder *decoder = NULL;
+
+        uint32 fourcc;
+        stream->read(fourcc);
+        Format format = getFormat(fourcc);
+        if (format == FMT_WAV) {
+
+            struct {
+                uint16  format;
+                uint16  channels;
+                uint32  samplesPerSec;
+                uint32  bytesPerSec;
+                uint16  block;
+                uint16  sampleBits;
+            } waveFmt;
+
+            stream->seek(8);
+            while (stream->pos < stream->size) {
+                uint32 type, size;
+                stream->read(type);
+                stream->read(size);
+                if (type == FOURCC("fmt ")) {
+                    stream->raw(&waveFmt, sizeof(waveFmt));
+                    stream->seek(size - sizeof(waveFmt));
+                } else if (type == FOURCC("data")) {
+                    if (waveFmt.format == 1) decoder = new PCM(stream, waveFmt.channels, waveFmt.samplesPerSec, size, waveFmt.sampleBits);
+                    #ifdef DECODE_ADPCM
+                    if (waveFmt.format == 2) decoder = new ADPCM(stream, waveFmt.channels, waveFmt.samplesPerSec, size, waveFmt.block);
+                    #endif
+                    break;
+                } else
+                    stream->seek(size);
+            }
+        } 
+        else if (format == FMT_OGG) {
+            stream->seek(-4);
+            #ifdef DECODE_OGG
+                decoder = new OGG(stream, 2);
+            #endif 
+        }
+        else if (format == FMT_MP3) {
+            bool tagged = fourcc == FOURCC("ID3\3");
+            if (!tagged)
+                stream->seek(-4); // starts with the first frame
+            #ifdef DECODE_MP3
+                decoder = new MP3(stream, 2, tagged);
+            #endif
+        }
+        else if (format == FMT_SEGA) { // Sega Saturn PCM mono signed 8-bit 11025 Hz
+            decoder = new PCM(stream, 1, 11025, stream->size, -8);
+        }
+        else {
+            stream->setPos(0);
+            #ifdef DECODE_VAG
+                decoder = new VAG(stream);
+            #endif
+        }
+
+        if (!decoder)
+            delete stream;
+
+        return decoder;
+    }
+
+#ifdef SND_BANK
+    #define SND_BANK_SIZE   (32 * 1024 * 1024)
+    #define SND_BANK_CHUNK  4096
+
+// samples decoded to 44.1 kHz frames the same way the streaming decoders do it
+// the least recently used items get evicted above SND_BANK_SIZE and decoded again on the next play
+    struct Bank {
+        typedef Stream* (GetStream)(int index, void *userData);
+
+        struct Item {
+            int16   *data;      // mono or interleaved stereo frames
+            int     length;     // in frames
+            int     channels;
+            int     bytes;      // decoded size, known after the first decode even if it didn't fit
+            int     refs;       // playing channels, owned by the game thread
+            uint32  lastUse;
+            bool    failed;     // compressed music formats, empty or broken samples use the streaming decoder
+
+            int getSize() const {
+                return length * channels * sizeof(int16);
+            }
+        } *items;
+
+        int         count;
+        int         size;
+        uint32      useCounter;
+        GetStream   *getStream;
+        void        *userData;
+        Core::Mutex mutex;
+
+        Bank(int count, GetStream *getStream, void *userData) : count(count), size(0), useCounter(0), getStream(getStream), userData(userData) {
+            items = new Item[count];
+            memset(items, 0, sizeof(Item) * count);
+        }
+
+        ~Bank() {
+            for (int i = 0; i < count; i++)
+                delete[] items[i].data;
+            delete[] items;
+        }
+
+    // can be called from the worker threads for the different items, evict is for the game thread only
+        void decode(int index, bool evict) {
+            Item &item = items[index];
+            if (item.data || item.failed) return;
+
+            if (item.bytes) { // check the capacity before decoding the sample that didn't fit once
+                OS_LOCK(mutex);
+                if (size + item.bytes > SND_BANK_SIZE && (!evict || !reserve(item.bytes)))
+                    return;
+            }
+
+            Stream *stream = getStream(index, userData);
+            if (!stream) {
+                item.failed = true;
+                return;
+            }
+
+            uint32 fourcc;
+            stream->read(fourcc);
+            stream->seek(-4);
+            Format format = getFormat(fourcc);
+            if (format == FMT_OGG || format == FMT_MP3) {
+                delete stream;
+                item.failed = true;
+                return;
+            }
+
+            Decoder *decoder = createDecoder(stream);
+            if (!decoder) {
+                item.failed = true;
+                return;
+            }
+
+            int    channels = decoder->channels == 2 ? 2 : 1;
+            int    length   = 0;
+            int    capacity = 0;
+            int16  *data    = NULL;
+            Frame  chunk[SND_BANK_CHUNK];
+
+            while (1) {
+                int n = 0;
+                while (n < SND_BANK_CHUNK - 8) { // decoders may return a few frames more than requested
+                    int res = decoder->decode(chunk + n, SND_BANK_CHUNK - 8 - n);
+                    if (!res) break;
+                    n += res;
+                }
+                if (!n) break;
+
+                if (length + n > capacity) {
+                    capacity = max(capacity * 2, length + n);
+                    int16 *tmp = new int16[capacity * channels];
+                    if (data) memcpy(tmp, data, length * channels * sizeof(int16));
+                    delete[] data;
+                    data = tmp;
+                }
+
+                int16 *dst = data + length * channels;
+                if (channels == 1) {
+                    for (int i = 0; i < n; i++)
+                        dst[i] = chunk[i].L;
+                } else
+                    memcpy(dst, chunk, n * sizeof(Frame));
+                length += n;
+            }
+            delete decoder;
+
+            if (!length) {
+                delete[] data;
+                item.failed = true;
+                return;
+            }
+
+            int bytes = length * channels * sizeof(int16);
+            item.bytes = bytes;
+            {
+                OS_LOCK(mutex);
+                if (size + bytes > SND_BANK_SIZE && (!evict || !reserve(bytes))) {
+                    delete[] data; // doesn't fit, the next plays stream it until the bank has room for its size
+                    return;
+                }
+                size += bytes;
+            }
+
+            item.data     = data;
+            item.length   = length;
+            item.channels = channels;
+        }
+
+    // evicts the least recently used items that are not playing now
+        bool reserve(int bytes) {
+            while (size + bytes > SND_BANK_SIZE) {
+                Item *lru = NULL;
+                for (int i = 0; i < count; i++) {
+                    Item &item = items[i];
+                    if (item.data && !item.refs && (!lru || item.lastUse < lru->lastUse))
+                        lru = &item;
+                }
+                if (!lru)
+                    return false;
+                size -= lru->getSize();
+                delete[] lru->data;
+                lru->data   = NULL;
+                lru->length = 0;
+            }
+            return true;
+        }
+
+    // returns NULL if the sample must be played by the streaming decoder
+        Item* get(int index) {
+            if (index < 0 || index >= count)
+                return NULL;
+            Item &item = items[index];
+            decode(index, true);
+            if (!item.data)
+                return NULL;
+            item.lastUse = ++useCounter;
+            return &item;
+        }
+    };
+
+    #undef SND_BANK_CHUNK
+#endif
 
     struct Listener {
         mat4 matrix;
@@ -705,92 +1688,172 @@ namespace Sound {
 
     bool flipped;
 
+// game thread -> mixer commands (lock-free, the game thread is the only producer)
+    struct Sample;
+
+    enum CommandType {
+        CMD_PLAY,   // add new sample to the mixer
+        CMD_FREE,   // return finished sample to the game thread for release
+        CMD_STOP,   // stop the sample or all samples by id (-1 for all)
+        CMD_VOLUME,
+        CMD_PAUSE,
+        CMD_RESUME,
+        CMD_UPDATE, // set position and pitch of unique sample, replay if needed
+    };
+
+    struct Command {
+        CommandType type;
+        Sample      *sample;
+        int         id;
+        vec3        pos;
+        float       value;
+        float       time;
+        bool        replay;
+        uint32      epoch;
+    };
+
+    #define SND_COMMANDS_MAX 1024
+
+    RingQueue<Command, SND_COMMANDS_MAX>   commands;
+    RingQueue<Sample*, SND_VOICES_MAX + 1> finished; // mixer -> game thread
+    RingQueue<Sample*, SND_VOICES_MAX + 1> released; // mixer -> game thread, the mixer doesn't touch the voice anymore
+
+// stopAll takes the voices back from the mixer without a lock, the mixer drops its state and the stale commands of the old epoch
+    volatile uint32 epoch;      // game thread
+    volatile uint32 mixerEpoch; // mixer, the epoch of its active voices
+    volatile bool   mixing;     // mixer is inside fill
+
+    bool pushCommand(const Command &cmd);
+
+    bool pushCommand(CommandType type, Sample *sample, float value = 0.0f, float time = 0.0f) {
+        Command cmd;
+        cmd.type   = type;
+        cmd.sample = sample;
+        cmd.id     = -1;
+        cmd.value  = value;
+        cmd.time   = time;
+        cmd.replay = false;
+        return pushCommand(cmd);
+    }
+
     struct Sample {
         const vec3 *uniquePtr;
         Decoder *decoder;
+    #ifdef SND_BANK
+        Bank::Item *item;   // decoded sample of the bank, used instead of the decoder
+        int     itemPos;
+    #endif
         vec3    pos;
         float   volume;
         float   volumeTarget;
         float   volumeDelta;
+        float   volumeRequest; // last volume target requested by the game thread
         float   pitch;
         int     flags;
         int     id;
-        bool    isPlaying;
+        bool    isPlaying;  // mixer, the game thread knows the voice is done when it comes through the finished queue
         bool    isPaused;
         bool    stopAfterFade;
+        bool    stolen;     // stopped by the game thread to free the channel for a more audible sound
+        bool    external;   // the decoder is owned by the caller (video player) and is not deleted with the voice
+        vec3    posRequest; // last position requested by the game thread
+        Sample  *nextFree;
+        uint32  generation; // changes when the voice returns to the pool, the pointer alone may refer to another sound then
+
+    // voices are pooled, init is called by the game thread for a free voice
+        void reset(const vec3 *pos, float volume, float pitch, int flags, int id) {
+            this->uniquePtr     = pos;
+            this->pos           = pos ? *pos : vec3(0.0f);
+            this->posRequest    = this->pos;
+            this->decoder       = NULL;
+        #ifdef SND_BANK
+            this->item          = NULL;
+            this->itemPos       = 0;
+        #endif
+            this->volume        = volume;
+            this->volumeTarget  = volume;
+            this->volumeDelta   = 0.0f;
+            this->volumeRequest = volume;
+            this->pitch         = pitch;
+            this->flags         = flags;
+            this->id            = id;
+            this->isPaused      = false;
+            this->stopAfterFade = false;
+            this->stolen        = false;
+            this->external      = false;
+        }
 
-        Sample(Decoder *decoder, float volume, float pitch, int flags, int id) : uniquePtr(NULL), decoder(decoder), volume(volume), volumeTarget(volume), volumeDelta(0.0f), pitch(pitch), flags(flags), id(id) {
+        void init(Decoder *decoder, float volume, float pitch, int flags, int id) {
+            reset(NULL, volume, pitch, flags, id);
+            this->decoder  = decoder;
+            this->external = true;
             isPlaying = decoder != NULL;
-            isPaused  = false;
         }
 
-        Sample(Stream *stream, const vec3 *pos, float volume, float pitch, int flags, int id) : uniquePtr(pos), decoder(NULL), volume(volume), volumeTarget(volume), volumeDelta(0.0f), pitch(pitch), flags(flags), id(id) {
-            this->pos = pos ? *pos : vec3(0.0f);
-            
-            uint32 fourcc;
-            stream->read(fourcc);
-            if (fourcc == FOURCC("RIFF")) { // wav
-
-                struct {
-                    uint16  format;
-                    uint16  channels;
-                    uint32  samplesPerSec;
-                    uint32  bytesPerSec;
-                    uint16  block;
-                    uint16  sampleBits;
-                } waveFmt;
-
-                stream->seek(8);
-                while (stream->pos < stream->size) {
-                    uint32 type, size;
-                    stream->read(type);
-                    stream->read(size);
-                    if (type == FOURCC("fmt ")) {
-                        stream->raw(&waveFmt, sizeof(waveFmt));
-                        stream->seek(size - sizeof(waveFmt));
-                    } else if (type == FOURCC("data")) {
-                        if (waveFmt.format == 1) decoder = new PCM(stream, waveFmt.channels, waveFmt.samplesPerSec, size, waveFmt.sampleBits);
-                        #ifdef DECODE_ADPCM
-                        if (waveFmt.format == 2) decoder = new ADPCM(stream, waveFmt.channels, waveFmt.samplesPerSec, size, waveFmt.block);
-                        #endif
-                        break;
-                    } else
-                        stream->seek(size);
-                }
-            } 
-            else if (fourcc == FOURCC("OggS")) { // ogg
-                stream->seek(-4);
-                #ifdef DECODE_OGG
-                    decoder = new OGG(stream, 2);
-                #endif 
-            }
-            else if (fourcc == FOURCC("ID3\3")) { // mp3
-                #ifdef DECODE_MP3
-                    decoder = new MP3(stream, 2);
-                #endif
-            }
-            else if (fourcc == FOURCC("SEGA")) { // Sega Saturn PCM mono signed 8-bit 11025 Hz
-                decoder = new PCM(stream, 1, 11025, stream->size, -8);
-            }
-            else { // vag
-                stream->setPos(0);
-                #ifdef DECODE_VAG
-                    decoder = new VAG(stream);
-                #endif
-            }
+        void init(Stream *stream, const vec3 *pos, float volume, float pitch, int flags, int id) {
+            reset(pos, volume, pitch, flags, id);
+            decoder   = createDecoder(stream);
+            isPlaying = decoder != NULL;
+        }
 
-            if (!decoder)
-                delete stream;
+    #ifdef SND_BANK
+        void init(Bank::Item *item, const vec3 *pos, float volume, float pitch, int flags, int id) {
+            reset(pos, volume, pitch, flags, id);
+            this->item = item;
+            item->refs++;
+            isPlaying = true;
+        }
 
-            isPlaying = decoder != NULL;
-            isPaused  = false;
+        int decodeItem(Frame *frames, int count) {
+            int n = min(count, item->length - itemPos);
+            const int16 *src = item->data + itemPos * item->channels;
+            if (item->channels == 1) {
+                for (int i = 0; i < n; i++)
+                    frames[i].L = frames[i].R = src[i];
+            } else
+                memcpy(frames, src, n * sizeof(Frame));
+            itemPos += n;
+            return n;
+        }
+    #endif
+
+        int decode(Frame *frames, int count) {
+        #ifdef SND_BANK
+            if (item)
+                return decodeItem(frames, count);
+        #endif
+            return decoder->decode(frames, count);
         }
 
-        ~Sample() {
-            delete decoder;
+        void replay() {
+        #ifdef SND_BANK
+            if (item) {
+                itemPos = 0;
+                return;
+            }
+        #endif
+            decoder->replay();
+        }
+
+    // called by the game thread when the mixer released the voice
+        void free() {
+            if (!external)
+                delete decoder;
+            decoder = NULL;
+        #ifdef SND_BANK
+            if (item) {
+                item->refs--;
+                item = NULL;
+            }
+        #endif
         }
 
         void setVolume(float value, float time) {
+            volumeRequest = value;
+            pushCommand(CMD_VOLUME, this, value, time);
+        }
+
+        void applyVolume(float value, float time) {
             if (value < 0.0f) {
                 stopAfterFade = true;
                 value = 0.0f;
@@ -828,63 +1891,73 @@ namespace Sound {
 
         // decode
             int i = 0;
+            bool replayed = false;
             while (i < count) {
-                int res = decoder->decode(&frames[i], count - i);
+                int res = decode(&frames[i], count - i);
                 if (res == 0) {
-                    if (!(flags & LOOP)) {
+                    if (!(flags & LOOP) || replayed) { // empty or broken stream can't loop
                         isPlaying = false;
                         break;
-                    } else
-                        decoder->replay();
-                }
-                i += res;
-            }
-        // apply volume
-            #define VOL_CONV(x) (1.0f - sqrtf(1.0f - x * x));
-
-            float m = ((flags & MUSIC) ? Core::settings.audio.music : Core::settings.audio.sound) / float(SND_MAX_VOLUME);
-            float v = volume * m;
-            vec2 pan = getPan();
-            vec2 vol = pan * VOL_CONV(v);
-            for (int j = 0; j < i; j++) {
-                if (volumeDelta != 0.0f) { // increase / decrease channel volume
-                    volume += volumeDelta;
-                    if ((volumeDelta < 0.0f && volume < volumeTarget) ||
-                        (volumeDelta > 0.0f && volume > volumeTarget)) {
-                        volume = volumeTarget;
-                        volumeDelta = 0.0f;
-                        if (stopAfterFade)
-                            isPlaying = false;
                     }
-                    v   = volume * m;
-                    vol = pan * VOL_CONV(v);
-                }
-                frames[j].L = int(frames[j].L * vol.x);
-                frames[j].R = int(frames[j].R * vol.y);
+                    replay();
+                    replayed = true;
+                } else
+                    replayed = false;
+                i += res;
             }
-            #undef VOL_CONV
-
             return true;
         }
 
-        void stop() {
-            isPlaying = false;
+        void mix(FrameHI *result, const Frame *frames, int count) {
+            MixParams p;
+            p.pitch        = pitch;
+            p.volume       = volume;
+            p.volumeTarget = volumeDelta != 0.0f ? volumeTarget : volume;
+            p.volumeDelta  = volumeDelta;
+            p.master       = ((flags & MUSIC) ? Core::settings.audio.music : Core::settings.audio.sound) / float(SND_MAX_VOLUME);
+            p.pan          = getPan();
+
+            mixFrames(result, frames, count, p);
+
+            if (volumeDelta != 0.0f) { // increase / decrease channel volume
+                volume += volumeDelta * count;
+                if ((volumeDelta < 0.0f && volume <= volumeTarget) ||
+                    (volumeDelta > 0.0f && volume >= volumeTarget)) {
+                    volume = volumeTarget;
+                    volumeDelta = 0.0f;
+                    if (stopAfterFade)
+                        isPlaying = false;
+                }
+            }
         }
 
-        void replay() {
-            decoder->replay();
+        void stop() {
+            pushCommand(CMD_STOP, this);
         }
 
         void pause() {
-            isPaused = true;
+            pushCommand(CMD_PAUSE, this);
         }
 
         void resume() {
-            isPaused = false;
+            pushCommand(CMD_RESUME, this);
         }
-    } *channels[SND_CHANNELS_MAX];
+    } *channels[SND_VOICES_MAX]; // owned by the game thread
     int channelsCount;
 
+    Sample *active[SND_VOICES_MAX]; // owned by the mixer
+    int    activeCount;
+
+// voice pool (game thread), busy scenes steal the least audible channel instead of dropping the new sound
+    Sample voices[SND_VOICES_MAX];
+    Sample *freeVoices;
+
+    struct Stats {
+        int steals;     // channels stopped for the more audible sounds
+        int rejects;    // sounds dropped because of no free channels
+        int drops;      // commands dropped because the mixer doesn't drain the queue
+    } stats;
+
     typedef void (Callback)(Sample *channel);
     Callback *callback;
 
@@ -895,7 +1968,16 @@ namespace Sound {
     void init() {
         flipped = false;
         channelsCount = 0;
+        activeCount = 0;
         callback = NULL;
+        epoch = mixerEpoch = 0;
+        mixing = false;
+        freeVoices = NULL;
+        for (int i = SND_VOICES_MAX - 1; i >= 0; i--) {
+            voices[i].nextFree = freeVoices;
+            freeVoices = &voices[i];
+        }
+        memset(&stats, 0, sizeof(stats));
         buffer = NULL;
         result = NULL;
     #ifdef DECODE_MP3
@@ -903,9 +1985,10 @@ namespace Sound {
     #endif
     }
 
+    void stopAll();
+
     void deinit() {
-        for (int i = 0; i < channelsCount; i++)
-            delete channels[i];
+        stopAll();
     #ifdef DECODE_MP3
         mp3_decode_free();
     #endif
@@ -917,54 +2000,124 @@ namespace Sound {
         int bufSize = count + count / 2;
         if (!buffer) buffer = new Frame[bufSize]; // + 50% for pitch
 
-        for (int i = 0; i < channelsCount; i++) {
-            if (music != ((channels[i]->flags & MUSIC) != 0))
+        for (int i = 0; i < activeCount; i++) {
+            if (music != ((active[i]->flags & MUSIC) != 0))
                 continue;
             
-            if (channels[i]->flags & (FLIPPED | UNFLIPPED)) {
-                if (!(channels[i]->flags & (flipped ? FLIPPED : UNFLIPPED)))
+            if (active[i]->flags & (FLIPPED | UNFLIPPED)) {
+                if (!(active[i]->flags & (flipped ? FLIPPED : UNFLIPPED)))
                     continue;
 
-                vec3 d = channels[i]->pos - getListener(channels[i]->pos).matrix.getPos();
+                vec3 d = active[i]->pos - getListener(active[i]->pos).matrix.getPos();
                 if (fabsf(d.x) > SND_FADEOFF_DIST || fabsf(d.y) > SND_FADEOFF_DIST || fabsf(d.z) > SND_FADEOFF_DIST)
                     continue;
             }
 
-            if ((channels[i]->flags & LOOP) && channels[i]->volume < EPS && channels[i]->volumeTarget < EPS)
+            if ((active[i]->flags & LOOP) && active[i]->volume < EPS && active[i]->volumeTarget < EPS)
                 continue;
 
             memset(buffer, 0, sizeof(Frame) * bufSize);
-            channels[i]->render(buffer, int(count * channels[i]->pitch));
+            if (!active[i]->render(buffer, int(count * active[i]->pitch)) || active[i]->isPaused)
+                continue;
 
-            if (channels[i]->pitch == 1.0f) { // no pitch
-                for (int j = 0; j < count; j++) {
-                    result[j].L += buffer[j].L;
-                    result[j].R += buffer[j].R;
-                }
-            } else { // has pitch (interpolate values for smooth wave)
-                float t = 0.0f;
-                for (int j = 0; j < count; j++, t += channels[i]->pitch) {
-                    int idxA = int(t);
-                    int idxB = (j == (count - 1)) ? idxA : (idxA + 1);
-                    float k = t - idxA;
-                    result[j].L += int(lerp(buffer[idxA].L, buffer[idxB].L, k));
-                    result[j].R += int(lerp(buffer[idxA].R, buffer[idxB].R, k));
+            active[i]->mix(result, buffer, count);
+        }
+    }
+
+    void applyCommand(const Command &cmd) {
+        Sample *sample = cmd.sample;
+
+        switch (cmd.type) {
+            case CMD_PLAY   :
+                ASSERT(activeCount < SND_VOICES_MAX);
+                active[activeCount++] = sample;
+                break;
+            case CMD_FREE   :
+                released.push(sample);
+                break;
+            case CMD_STOP   :
+                if (sample) {
+                    sample->isPlaying = false;
+                    break;
                 }
-            }
+                for (int i = 0; i < activeCount; i++)
+                    if (cmd.id == -1 || active[i]->id == cmd.id)
+                        active[i]->isPlaying = false;
+                break;
+            case CMD_VOLUME :
+                sample->applyVolume(cmd.value, cmd.time);
+                break;
+            case CMD_PAUSE  :
+                sample->isPaused = true;
+                break;
+            case CMD_RESUME :
+                sample->isPaused = false;
+                break;
+            case CMD_UPDATE :
+                if (sample->uniquePtr)
+                    sample->pos = cmd.pos;
+                sample->pitch = cmd.value;
+                if (cmd.replay && sample->isPlaying)
+                    sample->replay();
+                break;
         }
     }
 
-    void convFrames(FrameHI *from, Frame *to, int count) {
-        for (int i = 0; i < count; i++) {
-            to[i].L = clamp(from[i].L, -32767, 32767);
-            to[i].R = clamp(from[i].R, -32767, 32767);
+    void applyCommands() {
+        Command cmd;
+        while (commands.pop(cmd))
+            if (cmd.epoch == mixerEpoch) // the voices of the commands pushed before stopAll may be reused already
+                applyCommand(cmd);
+    }
+
+// the mixer doesn't drain the queue (audio thread is stalled or paused), the command is dropped then
+    bool pushCommand(const Command &cmd) {
+        Command c = cmd;
+        c.epoch = epoch;
+        if (commands.push(c))
+            return true;
+        stats.drops++;
+        LOG("! sound command queue is full\n");
+        return false;
+    }
+
+    void freeVoice(Sample *sample) {
+        sample->free();
+        sample->generation++;
+        sample->nextFree = freeVoices;
+        freeVoices = sample;
+    }
+
+    // called by the game thread, releases the channels finished by the mixer and reads the music streams ahead
+    void update() {
+        Sample *sample;
+        while (released.pop(sample))
+            freeVoice(sample);
+
+        for (int i = 0; i < channelsCount; i++)
+            if (channels[i]->decoder)
+                channels[i]->decoder->prefetch();
+
+    // the voice stays in the finished queue until CMD_FREE gets into the command queue, retried on the next update
+        while (finished.peek(sample)) {
+            if (!pushCommand(CMD_FREE, sample)) // after the commands already queued for the sample
+                break;
+            finished.pop(sample);
+
+            for (int i = 0; i < channelsCount; i++)
+                if (channels[i] == sample) {
+                    channels[i] = channels[--channelsCount];
+                    break;
+                }
+
+            if (callback) callback(sample);
         }
     }
 
-    void fill(Frame *frames, int count) {
-        OS_LOCK(lock);
+    void mixChannels(Frame *frames, int count) {
+        applyCommands();
 
-        if (!channelsCount) {
+        if (!activeCount) {
             if (result) {
                 memset(result, 0, sizeof(FrameHI) * count);
                 if (Core::settings.audio.reverb)
@@ -987,15 +2140,28 @@ namespace Sound {
 
         convFrames(result, frames, count);
 
-        for (int i = 0; i < channelsCount; i++) 
-            if (!channels[i]->isPlaying) {
-                if (callback) callback(channels[i]);
-                delete channels[i];
-                channels[i] = channels[--channelsCount];
+        for (int i = 0; i < activeCount; i++)
+            if (!active[i]->isPlaying && finished.push(active[i])) { // the game thread will release it
+                active[i] = active[--activeCount];
                 i--;
             }
     }
 
+    void fill(Frame *frames, int count) {
+        mixing = true;
+        MEMORY_BARRIER(); // stopAll sees the flag or we see its epoch
+        if (mixerEpoch != epoch) { // the voices are taken back by stopAll
+            activeCount = 0;
+            MEMORY_BARRIER();
+            mixerEpoch  = epoch;
+        }
+
+        mixChannels(frames, count);
+
+        MEMORY_BARRIER();
+        mixing = false;
+    }
+
     Stream *openCDAudioWAD(const char *name, int index = -1) {
         if (!Stream::existsContent(name))
             return NULL;
@@ -1026,75 +2192,163 @@ namespace Sound {
 
     Sample* getChannel(int id, const vec3 *pos) {
         for (int i = 0; i < channelsCount; i++)
-            if (channels[i]->id == id && channels[i]->uniquePtr == pos)
+            if (channels[i]->id == id && channels[i]->uniquePtr == pos && !channels[i]->stolen)
                 return channels[i];
         return NULL;
     }
 
-    Sample* play(Stream *stream, const vec3 *pos = NULL, float volume = 1.0f, float pitch = 0.0f, int flags = 0, int id = - 1) {
-        OS_LOCK(lock);
+// rough loudness of the sound for the voice stealing, music and loops are never stolen
+    float getAudibility(const vec3 *pos, float volume, int flags) {
+        if (flags & (MUSIC | LOOP))
+            return INF;
+        if (!pos || !(flags & PAN))
+            return volume;
+        vec3 d = *pos - getListener(*pos).matrix.getPos();
+        return volume * max(0.0f, 1.0f - d.length() / SND_FADEOFF_DIST);
+    }
+
+    Sample* allocVoice(const vec3 *pos, float volume, int flags) {
+        int playing = 0;
+        Sample *victim = NULL;
+        float  victimAudibility = INF;
+
+        for (int i = 0; i < channelsCount; i++) {
+            Sample *ch = channels[i];
+            if (ch->stolen)
+                continue;
+            playing++;
+
+            float audibility = getAudibility(&ch->posRequest, ch->volumeRequest, ch->flags);
+            if (audibility < victimAudibility) {
+                victim = ch;
+                victimAudibility = audibility;
+            }
+        }
+
+        if (playing >= SND_CHANNELS_MAX || !freeVoices) {
+            if (!freeVoices || !victim || victimAudibility >= getAudibility(pos, volume, flags)) {
+                stats.rejects++;
+                LOG("! no free channels\n");
+                return NULL;
+            }
+            victim->stolen = true;
+            victim->stop();
+            stats.steals++;
+        }
+
+        Sample *sample = freeVoices;
+        freeVoices = sample->nextFree;
+        return sample;
+    }
+
+    Sample* addChannel(Sample *sample) {
+        if (!pushCommand(CMD_PLAY, sample)) {
+            stats.rejects++;
+            freeVoice(sample);
+            return NULL;
+        }
+        channels[channelsCount++] = sample;
+        return sample;
+    }
 
+// returns false if the new channel is not needed, ch is the updated unique channel then
+    bool prepare(const vec3 *pos, float volume, float pitch, int flags, int id, Sample *&ch) {
         ASSERT(pitch >= 0.0f);
-        if (!stream) return NULL;
+        ch = NULL;
         if (volume > 0.001f) {
             if (pos && !(flags & (FLIPPED | UNFLIPPED | MUSIC)) && (flags & PAN)) {
                 vec3 listenerPos = getListener(*pos).matrix.getPos();
                 vec3 d = *pos - listenerPos;
 
-                if (fabsf(d.x) > SND_FADEOFF_DIST || fabsf(d.y) > SND_FADEOFF_DIST || fabsf(d.z) > SND_FADEOFF_DIST) {
-                    delete stream;
-                    return NULL;
-                }
+                if (fabsf(d.x) > SND_FADEOFF_DIST || fabsf(d.y) > SND_FADEOFF_DIST || fabsf(d.z) > SND_FADEOFF_DIST)
+                    return false;
             }
 
             if (flags & (UNIQUE | REPLAY)) {
-                Sample *ch = getChannel(id, pos);
+                ch = getChannel(id, pos);
 
                 if (ch) {
-                    if (pos)
-                        ch->pos = *pos;
-                    ch->pitch = pitch;
-
-                    if (flags & REPLAY)
-                        ch->replay();
-
-                    delete stream;
-                    return ch;
+                    ch->posRequest = pos ? *pos : vec3(0.0f);
+
+                    Command cmd;
+                    cmd.type   = CMD_UPDATE;
+                    cmd.sample = ch;
+                    cmd.id     = id;
+                    cmd.pos    = pos ? *pos : vec3(0.0f);
+                    cmd.value  = pitch;
+                    cmd.time   = 0.0f;
+                    cmd.replay = (flags & REPLAY) != 0;
+                    pushCommand(cmd);
+                    return false;
                 }
             }
 
-            if (channelsCount < SND_CHANNELS_MAX)
-                return channels[channelsCount++] = new Sample(stream, pos, volume, pitch, flags, id);
+            return true;
+        }
+        return false;
+    }
+
+    Sample* play(Stream *stream, const vec3 *pos = NULL, float volume = 1.0f, float pitch = 0.0f, int flags = 0, int id = - 1) {
+        if (!stream) return NULL;
 
-            LOG("! no free channels\n");
+        Sample *ch;
+        if (prepare(pos, volume, pitch, flags, id, ch) && (ch = allocVoice(pos, volume, flags))) {
+            ch->init(stream, pos, volume, pitch, flags, id);
+            return addChannel(ch);
         }
+
         delete stream;
-        return NULL;
+        return ch;
     }
 
-    Sample* play(Decoder *decoder) {
-        OS_LOCK(lock);
+#ifdef SND_BANK
+    Sample* play(Bank::Item *item, const vec3 *pos = NULL, float volume = 1.0f, float pitch = 0.0f, int flags = 0, int id = - 1) {
+        Sample *ch;
+        if (!prepare(pos, volume, pitch, flags, id, ch) || !(ch = allocVoice(pos, volume, flags)))
+            return ch;
 
-        if (channelsCount < SND_CHANNELS_MAX)
-            return channels[channelsCount++] = new Sample(decoder, 1.0f, 1.0f, MUSIC, -1);
-        return NULL;
+        ch->init(item, pos, volume, pitch, flags, id);
+        return addChannel(ch);
     }
+#endif
 
-    void stop(int id = -1) {
-        OS_LOCK(lock);
+    Sample* play(Decoder *decoder, float pitch = 1.0f) {
+        Sample *ch = allocVoice(NULL, 1.0f, MUSIC);
+        if (!ch)
+            return NULL;
+        ch->init(decoder, 1.0f, pitch, MUSIC, -1);
+        return addChannel(ch);
+    }
 
-        for (int i = 0; i < channelsCount; i++)
-            if (id == -1 || channels[i]->id == id)
-                channels[i]->stop();
+    void stop(int id = -1) {
+        Command cmd;
+        cmd.type   = CMD_STOP;
+        cmd.sample = NULL;
+        cmd.id     = id;
+        cmd.value  = 0.0f;
+        cmd.time   = 0.0f;
+        cmd.replay = false;
+        pushCommand(cmd);
     }
 
+// synchronous, the caller may delete the sounds data right after it
     void stopAll() {
-        OS_LOCK(lock);
-
-        for (int i = 0; i < channelsCount; i++)
-            delete channels[i];
+        epoch++;
+        MEMORY_BARRIER();
+        while (mixing && mixerEpoch != epoch) // the mixer uses the old voices until the end of the current fill
+            SPIN_WAIT();
+
+        Sample *sample;
+        while (released.pop(sample)) {}
+        while (finished.pop(sample)) {}
+
+        freeVoices = NULL;
+        for (int i = SND_VOICES_MAX - 1; i >= 0; i--)
+            freeVoice(&voices[i]);
         channelsCount = 0;
     }
+
+    #undef SND_COMMANDS_MAX
 }
 
 #endif
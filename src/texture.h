@@ -3,6 +3,7 @@
 
 #include "core.h"
 #include "format.h"
+#include "jobs.h"
 
 struct Texture : GAPI::Texture {
 
@@ -692,7 +693,8 @@ struct Atlas {
         short4          uv;
     } *tiles;
 
-    typedef void (Callback)(int id, int tileX, int tileY, int atalsWidth, int atlasHeight, Tile &tile, void *userData, void *data);
+    // called in parallel for the packed tiles, thread is the Jobs thread index
+    typedef void (Callback)(int id, int tileX, int tileY, int atalsWidth, int atlasHeight, Tile &tile, void *userData, void *data, int thread);
 
     struct Node {
         Node   *child[2];
@@ -748,29 +750,64 @@ struct Atlas {
         }
     } *root;
 
+    struct SortItem {
+        int   index;
+        int16 width;
+
+        static int cmp(const SortItem &a, const SortItem &b) { // by width descending, keep the order of equal tiles
+            if (a.width != b.width)
+                return b.width - a.width;
+            return a.index - b.index;
+        }
+    };
+
     int      tilesCount;
     int      size;
     int      width, height;
     void     *userData;
     Callback *callback;
 
+    int      *hashTable; // unique tile indices (open addressing)
+    int      hashMask;
+
+    Node     **nodes;    // packed tiles to fill
+    int      nodesCount;
+    void     *fillData;
+
     Atlas(int maxTiles, void *userData, Callback *callback) : root(NULL), tilesCount(0), size(0), userData(userData), callback(callback) {
         tiles = new Tile[maxTiles];
+
+        hashMask  = nextPow2(maxTiles * 2) - 1;
+        hashTable = new int[hashMask + 1];
+        memset(hashTable, 0xFF, sizeof(int) * (hashMask + 1));
     }
 
     ~Atlas() {
         delete root;
         delete[] tiles;
+        delete[] hashTable;
+    }
+
+    static uint32 getHash(const short4 &uv, const TR::TextureInfo *tex) {
+        int32 key[5] = { uv.x, uv.y, uv.z, uv.w, (tex->type << 16) ^ (tex->tile << 8) ^ tex->clut };
+        return fnv32((const char*)key, sizeof(key));
     }
 
     void add(uint16 id, short4 uv, TR::TextureInfo *tex) {
-        for (int i = 0; i < tilesCount; i++)
-            if (tiles[i].uv == uv && tiles[i].tex->type == tex->type && tiles[i].tex->tile == tex->tile && tiles[i].tex->clut == tex->clut) {
+        uint32 h = getHash(uv, tex) & hashMask;
+        while (hashTable[h] != -1) {
+            Tile &t = tiles[hashTable[h]];
+            if (t.uv == uv && t.tex->type == tex->type && t.tex->tile == tex->tile && t.tex->clut == tex->clut) {
                 uv.x = 0x7FFF;
-                uv.y = tiles[i].id;
+                uv.y = t.id;
                 uv.z = uv.w = 0;
                 break;
             }
+            h = (h + 1) & hashMask;
+        }
+
+        if (uv.x != 0x7FFF)
+            hashTable[h] = tilesCount;
 
         tiles[tilesCount].id  = id;
         tiles[tilesCount].tex = tex;
@@ -790,32 +827,24 @@ struct Atlas {
         return true;
     }
 
-    Texture* pack() {
+    Texture* pack(uint32 **pixels = NULL) { // returns atlas pixels to the caller if requested
     // TODO TR2 fix CUT2 AV
 //        width  = 4096;//nextPow2(int(sqrtf(float(size))));
 //        height = 2048;//(width * width / 2 > size) ? (width / 2) : width;
         width  = nextPow2(int(sqrtf(float(size))));
         height = (width * width / 2 > size) ? (width / 2) : width;
     // sort
+        SortItem *items = new SortItem[tilesCount];
+        for (int i = 0; i < tilesCount; i++) {
+            items[i].index = i;
+            items[i].width = tiles[i].uv.z - tiles[i].uv.x;
+        }
+        sort(items, tilesCount);
+
         int *indices = new int[tilesCount];
         for (int i = 0; i < tilesCount; i++)
-            indices[i] = i;
-
-        int n = tilesCount;
-        bool swapped;
-        do {
-            swapped = false;
-            for (int i = 1; i < n; i++) {
-                short4 &a = tiles[indices[i - 1]].uv;
-                short4 &b = tiles[indices[i]].uv;
-                //if ((a.z - a.x + ATLAS_BORDER * 2) * (a.w - a.y + ATLAS_BORDER * 2) < (b.z - b.x + ATLAS_BORDER * 2) * (b.w - b.y + ATLAS_BORDER * 2)) {
-                if ((a.z - a.x + ATLAS_BORDER * 2) < (b.z - b.x + ATLAS_BORDER * 2)) {
-                    swap(indices[i - 1], indices[i]);
-                    swapped = true;
-                }
-            }
-            n--;
-        } while (swapped);
+            indices[i] = items[i].index;
+        delete[] items;
     // pack
         while (1) {
             delete root;
@@ -834,31 +863,48 @@ struct Atlas {
 
         uint32 *data = new uint32[width * height];
         memset(data, 0, width * height * sizeof(data[0]));
-        fill(root, data);
+
+        nodes      = new Node*[tilesCount];
+        nodesCount = 0;
+        fillData   = data;
+        getNodes(root);
+        Jobs::parallelFor(nodesCount, fillJob, this);
+        delete[] nodes;
+
         fillInstances();
 
         Texture *atlas = new Texture(width, height, 1, FMT_RGBA, OPT_MIPMAPS, data);
 
         //Texture::SaveBMP("atlas", (char*)data, width, height);
 
-        delete[] data;
+        if (pixels)
+            *pixels = data;
+        else
+            delete[] data;
         return atlas;
     };
 
-    void fill(Node *node, void *data) {
+    void getNodes(Node *node) {
         if (!node) return;
 
         if (node->tileIndex == -1) {
-            fill(node->child[0], data);
-            fill(node->child[1], data);
+            getNodes(node->child[0]);
+            getNodes(node->child[1]);
         } else
-            callback(tiles[node->tileIndex].id, node->rect.x, node->rect.y, width, height, tiles[node->tileIndex], userData, data);
+            nodes[nodesCount++] = node;
+    }
+
+    static void fillJob(int index, int thread, void *userData) {
+        Atlas *atlas = (Atlas*)userData;
+        Node  *node  = atlas->nodes[index];
+        Tile  &tile  = atlas->tiles[node->tileIndex];
+        atlas->callback(tile.id, node->rect.x, node->rect.y, atlas->width, atlas->height, tile, atlas->userData, atlas->fillData, thread);
     }
 
-    void fillInstances() {
+    void fillInstances() { // refers to the filled tiles, so it's called after them
         for (int i = 0; i < tilesCount; i++)
             if (tiles[i].uv.x == 0x7FFF)
-                callback(tiles[i].id, tiles[i].uv.y, 0, width, height, tiles[i], userData, NULL);
+                callback(tiles[i].id, tiles[i].uv.y, 0, width, height, tiles[i], userData, NULL, 0);
     }
 };
 
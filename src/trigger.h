@@ -674,10 +674,13 @@ struct Door : Controller {
             sectors[1] = level->getSector(roomIndex[1], nx, nz, sectorIndex[1]);
         }
 
-        void set(TR::Level *level) {
+        bool set(TR::Level *level) { // returns true if box blocking has been changed
+            bool changed = false;
             for (int i = 0; i < 2; i++)
                 if (roomIndex[i] != TR::NO_ROOM) {
                     TR::Room::Sector &s = level->rooms[roomIndex[i]].sectors[sectorIndex[i]];
+                    if (s.floorIndex || s.roomBelow != TR::NO_ROOM || s.roomAbove != TR::NO_ROOM)
+                        level->invalidateSectorCache();
                     s.floorIndex = 0;
                     s.boxIndex   = TR::NO_BOX;
                     s.roomBelow  = TR::NO_ROOM;
@@ -688,22 +691,32 @@ struct Door : Controller {
                     if (sectors[i].boxIndex != TR::NO_BOX) {
                         ASSERT(sectors[i].boxIndex < level->boxesCount);
                         TR::Box &box = level->boxes[sectors[i].boxIndex];
-                        if (box.overlap.blockable)
+                        if (box.overlap.blockable && !box.overlap.block) {
                             box.overlap.block = true;
+                            changed = true;
+                        }
                     }
                 }
+            return changed;
         }
 
-        void reset(TR::Level *level) {
+        bool reset(TR::Level *level) {
+            bool changed = false;
             for (int i = 0; i < 2; i++)
                 if (roomIndex[i] != TR::NO_ROOM) {
-                    level->rooms[roomIndex[i]].sectors[sectorIndex[i]] = sectors[i];
+                    TR::Room::Sector &s = level->rooms[roomIndex[i]].sectors[sectorIndex[i]];
+                    if (s.floorIndex != sectors[i].floorIndex || s.roomBelow != sectors[i].roomBelow || s.roomAbove != sectors[i].roomAbove)
+                        level->invalidateSectorCache();
+                    s = sectors[i];
                     if (sectors[i].boxIndex != TR::NO_BOX) {
                         TR::Box &box = level->boxes[sectors[i].boxIndex];
-                        if (box.overlap.blockable)
+                        if (box.overlap.blockable && box.overlap.block) {
                             box.overlap.block = false;
+                            changed = true;
+                        }
                     }
                 }
+            return changed;
         }
 
     } block[2];
@@ -716,13 +729,17 @@ struct Door : Controller {
     }
 
     void updateBlock(bool open) {
+        bool changed;
         if (open) {
-            block[0].reset(level);
-            block[1].reset(level);
+            changed  = block[0].reset(level);
+            changed |= block[1].reset(level);
         } else {
-            block[0].set(level);
-            block[1].set(level);
+            changed  = block[0].set(level);
+            changed |= block[1].set(level);
         }
+
+        if (changed)
+            game->invalidatePaths();
     }
     
     virtual void update() {
@@ -1657,7 +1674,7 @@ struct HelicopterFlying : Controller {
 
         Sound::Sample *sample = game->playSound(TR::SND_HELICOPTER, vec3(0.0), 0);
         if (sample) {
-            sample->volume = (1.0f - dist / HELICOPTER_RANGE) * 0.8f;
+            sample->setVolume((1.0f - dist / HELICOPTER_RANGE) * 0.8f, 0.0f);
         }
 
         if (fabsf(dist) > HELICOPTER_RANGE) {
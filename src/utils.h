@@ -5,6 +5,20 @@
 #include <math.h>
 #include <float.h>
 
+#ifdef OS_FILEIO_MMAP
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#ifdef OS_FILEIO_CACHE
+    #if defined(_OS_WIN)
+        #include <io.h>
+    #elif defined(__unix__) || defined(__APPLE__)
+        #include <unistd.h>
+        #define OS_FILEIO_FSYNC
+    #endif
+#endif
+
 //#define TEST_SLOW_FIO
 
 #ifdef _DEBUG
@@ -72,6 +86,17 @@
     }
 #endif
 
+// SIMD instruction set (define NO_SIMD to force the scalar code path)
+#ifndef NO_SIMD
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define USE_SSE2
+        #include <emmintrin.h>
+    #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        #define USE_NEON
+        #include <arm_neon.h>
+    #endif
+#endif
+
 #define DECL_ENUM(v) v,
 #define DECL_STR(v)  #v,
 
@@ -1405,6 +1430,33 @@ char contentDir[255];
 
 #define STREAM_BUFFER_SIZE (16 * 1024)
 
+// memory mapped file, shared by the stream and the arrays read by Stream::readMapped
+struct StreamMap {
+    char *data;
+    int  size;
+    int  refCount;
+
+    StreamMap(char *data, int size) : data(data), size(size), refCount(1) {}
+
+    StreamMap* addRef() {
+        refCount++;
+        return this;
+    }
+
+    void release() {
+        if (--refCount)
+            return;
+    #ifdef OS_FILEIO_MMAP
+        munmap(data, size);
+    #endif
+        delete this;
+    }
+
+    bool contains(const void *ptr) const {
+        return ptr >= data && ptr < data + size;
+    }
+};
+
 struct Stream {
     typedef void (Callback)(Stream *stream, void *userData);
     Callback    *callback;
@@ -1418,14 +1470,16 @@ struct Stream {
     char        *buffer;
     int         bufferIndex;
 
-    Stream(const char *name, const void *data, int size, Callback *callback = NULL, void *userData = NULL) : callback(callback), userData(userData), f(NULL), data((char*)data), name(NULL), size(size), pos(0), buffer(NULL) {
+    StreamMap   *map;
+
+    Stream(const char *name, const void *data, int size, Callback *callback = NULL, void *userData = NULL) : callback(callback), userData(userData), f(NULL), data((char*)data), name(NULL), size(size), pos(0), buffer(NULL), map(NULL) {
         if (name) {
             this->name = new char[strlen(name) + 1];
             strcpy(this->name, name);
         }
     }
 
-    Stream(const char *name, Callback *callback = NULL, void *userData = NULL) : callback(callback), userData(userData), f(NULL), data(NULL), name(NULL), size(-1), pos(0), buffer(NULL) {
+    Stream(const char *name, Callback *callback = NULL, void *userData = NULL) : callback(callback), userData(userData), f(NULL), data(NULL), name(NULL), size(-1), pos(0), buffer(NULL), map(NULL) {
         if (!name && callback) {
             callback(NULL, userData);
             delete this;
@@ -1469,6 +1523,19 @@ struct Stream {
 
             bufferIndex = -1;
 
+        #ifdef OS_FILEIO_MMAP
+        // private writable mapping, in-place patching of the data doesn't affect the file
+            if (size > 0) {
+                void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+                if (ptr != MAP_FAILED) {
+                    map  = new StreamMap((char*)ptr, size);
+                    data = map->data;
+                    fclose(f);
+                    f = NULL;
+                }
+            }
+        #endif
+
             if (name) {
                 this->name = new char[strlen(name) + 1];
                 strcpy(this->name, name);
@@ -1483,6 +1550,7 @@ struct Stream {
         delete[] name;
         delete[] buffer;
         if (f) fclose(f);
+        if (map) map->release();
     }
 
     static void cacheRead(const char *name, Callback *callback = NULL, void *userData = NULL) {
@@ -1627,6 +1695,20 @@ struct Stream {
         return a;
     }
 
+    // zero-copy read, the array points into the file mapping and owner takes a reference to it
+    // falls back to the regular read for unmapped, misaligned data or if owner refers to another map
+    template <typename T>
+    inline T* readMapped(T *&a, int count, StreamMap *&owner) {
+        if (map && count > 0 && (!owner || owner == map) && !(size_t(data + pos) & (alignof(T) - 1)) && pos + count * int(sizeof(T)) <= size) {
+            a = (T*)(data + pos);
+            pos += count * sizeof(T);
+            if (!owner)
+                owner = map->addRef();
+            return a;
+        }
+        return read(a, count);
+    }
+
     inline uint8 read() {
         uint8 x;
         return read(x);
@@ -1660,14 +1742,40 @@ struct Stream {
 
 
 #ifdef OS_FILEIO_CACHE
+// write to the temporary file and replace the old one, so it's never left partially written
+bool osDataReplace(const char *tmpPath, const char *path) {
+#ifdef _OS_WIN
+    return MoveFileExA(tmpPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(tmpPath, path) == 0;
+#endif
+}
+
 void osDataWrite(Stream *stream, const char *dir) {
-    char path[255];
+    char path[255], tmpPath[255];
     strcpy(path, dir);
     strcat(path, stream->name);
-    FILE *f = fopen(path, "wb");
+    strcpy(tmpPath, path);
+    strcat(tmpPath, ".tmp");
+
+    bool ok = false;
+    FILE *f = fopen(tmpPath, "wb");
     if (f) {
-        fwrite(stream->data, 1, stream->size, f);
-        fclose(f);
+        ok = fwrite(stream->data, 1, stream->size, f) == size_t(stream->size);
+        ok &= fflush(f) == 0;
+    // flush to the disk before the rename, so the replaced file is never lost on crash
+    #if defined(_OS_WIN)
+        ok &= FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(f))) != 0;
+    #elif defined(OS_FILEIO_FSYNC)
+        ok &= fsync(fileno(f)) == 0;
+    #endif
+        ok &= fclose(f) == 0;
+        ok = ok && osDataReplace(tmpPath, path);
+        if (!ok)
+            remove(tmpPath);
+    }
+
+    if (ok) {
         if (stream->callback)
             stream->callback(new Stream(stream->name, stream->data, stream->size), stream->userData);
     } else
@@ -2014,5 +2122,59 @@ struct Array {
     operator T*() const { return items; };
 };
 
+#if defined(_MSC_VER)
+    #define MEMORY_BARRIER() MemoryBarrier()
+#else
+    #define MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+// body of the spin-wait loops, gives the time slice away (the waited thread may share the core)
+#if defined(_MSC_VER)
+    #define SPIN_WAIT() Sleep(0)
+#elif defined(_POSIX_THREADS)
+    #include <sched.h>
+    #define SPIN_WAIT() sched_yield()
+#elif defined(__i386__) || defined(__x86_64__)
+    #define SPIN_WAIT() __builtin_ia32_pause()
+#else
+    #define SPIN_WAIT() MEMORY_BARRIER()
+#endif
+
+// lock-free single producer / single consumer ring buffer
+template <typename T, int SIZE>
+struct RingQueue {
+    T            items[SIZE];
+    volatile int head; // written by producer only
+    volatile int tail; // written by consumer only
+
+    RingQueue() : head(0), tail(0) {}
+
+    bool push(const T &item) {
+        int next = (head + 1) % SIZE;
+        if (next == tail)
+            return false; // full
+        items[head] = item;
+        MEMORY_BARRIER(); // publish the item before the head
+        head = next;
+        return true;
+    }
+
+    bool pop(T &item) {
+        if (!peek(item))
+            return false;
+        MEMORY_BARRIER(); // read the item before the slot is released
+        tail = (tail + 1) % SIZE;
+        return true;
+    }
+
+    bool peek(T &item) const {
+        if (tail == head)
+            return false; // empty
+        MEMORY_BARRIER(); // read the head before the item
+        item = items[tail];
+        return true;
+    }
+};
+
 
 #endif
@@ -4,6 +4,13 @@
 #include "utils.h"
 #include "texture.h"
 #include "sound.h"
+#include "jobs.h"
+
+#ifdef OS_PTHREAD_MT
+    #define VIDEO_RING_SIZE 4 // the presented frame + frames decoded ahead by the worker thread
+#else
+    #define VIDEO_RING_SIZE 1
+#endif
 
 struct AC_ENTRY {
     uint8 code;
@@ -167,10 +174,70 @@ struct Video {
 
     struct Decoder : Sound::Decoder {
         int width, height, fps;
+        int frameChunk;          // source chunk of the last decoded frame
+        volatile int shownChunk; // source chunk of the presented frame, audio follows it
+
+        enum { AUDIO_RING_SIZE = 16 };
+
+        // only the video side reads the stream, audio data goes to the mixer through the packet rings
+        struct AudioPacket {
+            uint8 *data;
+            int   size;
+            int   capacity;
+            int   chunk;
+        } audioPackets[AUDIO_RING_SIZE];
+
+        RingQueue<int, AUDIO_RING_SIZE + 1> freeAudio;  // mixer -> video
+        RingQueue<int, AUDIO_RING_SIZE + 1> readyAudio; // video -> mixer, in stream order
+
+        Decoder(Stream *stream) : Sound::Decoder(stream, 2, 0), frameChunk(0), shownChunk(0) {
+            for (int i = 0; i < AUDIO_RING_SIZE; i++) {
+                audioPackets[i].data     = NULL;
+                audioPackets[i].capacity = 0;
+                freeAudio.push(i);
+            }
+        }
+
+        virtual ~Decoder() {
+            /* delete stream; */
+            for (int i = 0; i < AUDIO_RING_SIZE; i++)
+                delete[] audioPackets[i].data;
+        }
 
-        Decoder(Stream *stream) : Sound::Decoder(stream, 2, 0) {}
-        virtual ~Decoder() { /* delete stream; */ }
         virtual bool decodeVideo(Color32 *pixels) { return false; }
+
+        // video side, returns NULL if the mixer is behind and all packets are queued
+        AudioPacket* allocAudio(int size, int chunk) {
+            int index;
+            if (!freeAudio.pop(index))
+                return NULL;
+
+            AudioPacket &packet = audioPackets[index];
+            if (packet.capacity < size) {
+                delete[] packet.data;
+                packet.data     = new uint8[size];
+                packet.capacity = size;
+            }
+            packet.size  = size;
+            packet.chunk = chunk;
+            return &packet;
+        }
+
+        void pushAudio(AudioPacket *packet) {
+            readyAudio.push(int(packet - audioPackets));
+        }
+
+        // mixer side
+        AudioPacket* peekAudio() {
+            int index;
+            return readyAudio.peek(index) ? &audioPackets[index] : NULL;
+        }
+
+        void releaseAudio() {
+            int index;
+            if (readyAudio.pop(index))
+                freeAudio.push(index);
+        }
     };
 
     // based on ffmpeg https://github.com/FFmpeg/FFmpeg/blob/master/libavcodec/ implementation of escape codecs
@@ -179,7 +246,7 @@ struct Video {
         int sfmt, rate, channels, bps;
         int framesCount, chunksCount, offset;
         int curVideoPos, curVideoChunk;
-        int curAudioPos, curAudioChunk;
+        int curAudioPos;
 
         Sound::Decoder *audioDecoder;
 
@@ -262,8 +329,8 @@ struct Video {
             codebook[1].blocks =
             codebook[2].blocks = NULL;
 
-            curVideoPos   = curAudioPos   = 0;
-            curVideoChunk = curAudioChunk = 0;
+            curVideoPos   = curAudioPos = 0;
+            curVideoChunk = 0;
 
             nextChunk(0, 0);
 
@@ -278,11 +345,8 @@ struct Video {
         }
 
         virtual ~Escape() {
-            {
-                OS_LOCK(Sound::lock);
-                audioDecoder->stream = NULL;
-                delete audioDecoder;
-            }
+            audioDecoder->stream = NULL;
+            delete audioDecoder;
             for (int i = 0; i < chunksCount; i++)
                 delete[] chunks[i].data;
             delete[] chunks;
@@ -371,9 +435,7 @@ struct Video {
         }
 
         void nextChunk(int from, int to) {
-            OS_LOCK(Sound::lock);
-
-            if (from < curVideoChunk && from < curAudioChunk) {
+            if (from < curVideoChunk) {
                 delete[] chunks[from].data;
                 chunks[from].data = NULL;
             }
@@ -381,9 +443,15 @@ struct Video {
             Chunk &chunk = chunks[to];
             if (chunk.data)
                 return;
-            chunk.data = new uint8[chunk.videoSize + chunk.audioSize];
+            chunk.data = new uint8[chunk.videoSize];
             stream->setPos(chunk.offset);
-            stream->raw(chunk.data, chunk.videoSize + chunk.audioSize);
+            stream->raw(chunk.data, chunk.videoSize);
+
+            AudioPacket *packet = allocAudio(chunk.audioSize, to);
+            if (packet) {
+                stream->raw(packet->data, packet->size);
+                pushAudio(packet);
+            }
         }
 
         virtual bool decodeVideo(Color32 *pixels) {
@@ -400,6 +468,7 @@ struct Video {
             }
 
             uint8 *data = chunks[curVideoChunk].data + curVideoPos;
+            frameChunk  = curVideoChunk;
 
             switch (vfmt) {
                 case 124 : return decode124(data, pixels);
@@ -683,41 +752,41 @@ struct Video {
         virtual int decode(Sound::Frame *frames, int count) {
             if (!audioDecoder) return 0;
 
-            if (bps != 4 && abs(curAudioChunk - curVideoChunk) > 1) { // sync with video chunk, doesn't work for IMA
-                nextChunk(curAudioChunk, curVideoChunk);
-                curAudioChunk = curVideoChunk;
-                curAudioPos   = 0;
+            int videoChunk = shownChunk; // the worker may decode a few frames ahead
+            AudioPacket *packet = peekAudio();
+            if (bps != 4 && packet && packet->chunk < videoChunk - 1) { // sync with video chunk, doesn't work for IMA
+                while (packet && packet->chunk < videoChunk) {
+                    releaseAudio();
+                    packet = peekAudio();
+                }
+                curAudioPos = 0;
             }
 
             int i = 0;
             while (i < count) {
-                if (curAudioChunk >= chunksCount) {
+                packet = peekAudio();
+                if (!packet || (bps != 4 && packet->chunk > videoChunk + 1)) { // no data read yet or the video is late
                     memset(&frames[i], 0, sizeof(Sound::Frame) * (count - i));
                     break;
                 }
 
-                Chunk *chunk = &chunks[curAudioChunk];
-
-                if (curAudioPos >= chunk->audioSize) {
+                if (curAudioPos >= packet->size) {
                     curAudioPos = 0;
-                    curAudioChunk++;
-                    nextChunk(curAudioChunk - 1, curAudioChunk);
+                    releaseAudio();
                     continue;
                 }
 
-                int part = min(count - i, (chunk->audioSize - curAudioPos) / (channels * bps / 8));
+                int part = min(count - i, (packet->size - curAudioPos) / (channels * bps / 8));
 
-                Stream *memStream = new Stream(NULL, chunk->data + chunk->videoSize + curAudioPos, chunk->audioSize - curAudioPos);
-                audioDecoder->stream = memStream;
+                Stream memStream(NULL, packet->data + curAudioPos, packet->size - curAudioPos);
+                audioDecoder->stream = &memStream;
 
                 while (part > 0) { 
                     int res = audioDecoder->decode(&frames[i], part);
                     i += res;
                     part -= res;
                 }
-                curAudioPos += memStream->pos;
-
-                delete memStream;
+                curAudioPos += memStream.pos;
             }
 
             return count;
@@ -773,23 +842,14 @@ struct Video {
             uint8  data[VIDEO_SECTOR_SIZE * VIDEO_SECTOR_MAX];
         };
 
-        struct AudioChunk {
-            int    size;
-            uint8  data[AUDIO_SECTOR_SIZE];
-        };
-
         uint8 AC_LUT_1[256];
         uint8 AC_LUT_6[256];
         uint8 AC_LUT_9[256];
 
         VideoChunk videoChunks[MAX_CHUNKS];
-        AudioChunk audioChunks[MAX_CHUNKS];
 
         int   videoChunksCount;
-        int   audioChunksCount;
-
         int   curVideoChunk;
-        int   curAudioChunk;
 
         Sound::Decoder *audioDecoder;
 
@@ -800,7 +860,7 @@ struct Video {
 
         bool hasSyncHeader;
 
-        STR(Stream *stream) : Decoder(stream), videoChunksCount(0), audioChunksCount(0), curVideoChunk(-1), curAudioChunk(-1), audioDecoder(NULL) {
+        STR(Stream *stream) : Decoder(stream), videoChunksCount(0), curVideoChunk(-1), audioDecoder(NULL) {
 
             if (stream->pos >= stream->size) {
                 LOG("Can't load STR format \"%s\"\n", stream->name);
@@ -826,10 +886,8 @@ struct Video {
                 LOG("! No sync header found, please use jpsxdec tool to extract FMVs\n");
             }
 
-            for (int i = 0; i < MAX_CHUNKS; i++) {
+            for (int i = 0; i < MAX_CHUNKS; i++)
                 videoChunks[i].size = 0;
-                audioChunks[i].size = 0;
-            }
 
             nextChunk();
 
@@ -845,7 +903,6 @@ struct Video {
         }
 
         virtual ~STR() {
-            OS_LOCK(Sound::lock);
             audioDecoder->stream = NULL;
             delete audioDecoder;
         }
@@ -861,8 +918,6 @@ struct Video {
         }
 
         bool nextChunk() {
-            OS_LOCK(Sound::lock);
-
             if (videoChunks[videoChunksCount % MAX_CHUNKS].size > 0)
                 return false;
 
@@ -903,11 +958,14 @@ struct Video {
                     }
 
                 } else {
-                    AudioChunk *chunk = audioChunks + (audioChunksCount++ % MAX_CHUNKS);
-
-                    memcpy(chunk->data, &sector, sizeof(sector)); // audio chunk has no sector header (just XA data)
-                    stream->raw(chunk->data + sizeof(sector), AUDIO_SECTOR_SIZE - sizeof(sector)); // !!! MUST BE 2304 !!! most of CD image tools copy only 2048 per sector, so "clicks" will be there
-                    chunk->size = AUDIO_SECTOR_SIZE;
+                    AudioPacket *packet = allocAudio(AUDIO_SECTOR_SIZE, videoChunksCount);
+
+                    if (packet) {
+                        memcpy(packet->data, &sector, sizeof(sector)); // audio chunk has no sector header (just XA data)
+                        stream->raw(packet->data + sizeof(sector), AUDIO_SECTOR_SIZE - sizeof(sector)); // !!! MUST BE 2304 !!! most of CD image tools copy only 2048 per sector, so "clicks" will be there
+                        pushAudio(packet);
+                    } else
+                        stream->seek(AUDIO_SECTOR_SIZE - sizeof(sector)); // the mixer is behind, drop the sector
                     stream->seek(24);
 
                     if (!hasSyncHeader)
@@ -975,6 +1033,69 @@ struct Video {
         }
         
         void IDCT(int16 *b) {
+        #if defined(USE_SSE2)
+        // rows of the result are the sums of the coefficient rows scaled by the broadcasted IDCT factors
+            __m128 r[8][2], c[8][2];
+            for (int k = 0; k < 8; k++) {
+                __m128i v = _mm_loadu_si128((__m128i*)(b + k * 8));
+                r[k][0] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+                r[k][1] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+                c[k][0] = _mm_loadu_ps(STR_IDCT + k * 8 + 0);
+                c[k][1] = _mm_loadu_ps(STR_IDCT + k * 8 + 4);
+            }
+
+            float t[64];
+            for (int y = 0; y < 8; y++) {
+                __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+                for (int k = 0; k < 8; k++) {
+                    __m128 f = _mm_set1_ps(STR_IDCT[k * 8 + y]);
+                    a0 = _mm_add_ps(a0, _mm_mul_ps(r[k][0], f));
+                    a1 = _mm_add_ps(a1, _mm_mul_ps(r[k][1], f));
+                }
+                _mm_storeu_ps(t + y * 8 + 0, a0);
+                _mm_storeu_ps(t + y * 8 + 4, a1);
+            }
+
+            for (int y = 0; y < 8; y++) {
+                __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+                for (int k = 0; k < 8; k++) {
+                    __m128 f = _mm_set1_ps(t[y * 8 + k]);
+                    a0 = _mm_add_ps(a0, _mm_mul_ps(c[k][0], f));
+                    a1 = _mm_add_ps(a1, _mm_mul_ps(c[k][1], f));
+                }
+                __m128i v = _mm_packs_epi32(_mm_cvttps_epi32(a0), _mm_cvttps_epi32(a1));
+                _mm_storeu_si128((__m128i*)(b + y * 8), v);
+            }
+        #elif defined(USE_NEON)
+            float32x4_t r[8][2], c[8][2];
+            for (int k = 0; k < 8; k++) {
+                int16x8_t v = vld1q_s16(b + k * 8);
+                r[k][0] = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+                r[k][1] = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+                c[k][0] = vld1q_f32(STR_IDCT + k * 8 + 0);
+                c[k][1] = vld1q_f32(STR_IDCT + k * 8 + 4);
+            }
+
+            float t[64];
+            for (int y = 0; y < 8; y++) {
+                float32x4_t a0 = vdupq_n_f32(0.0f), a1 = vdupq_n_f32(0.0f);
+                for (int k = 0; k < 8; k++) {
+                    a0 = vmlaq_n_f32(a0, r[k][0], STR_IDCT[k * 8 + y]);
+                    a1 = vmlaq_n_f32(a1, r[k][1], STR_IDCT[k * 8 + y]);
+                }
+                vst1q_f32(t + y * 8 + 0, a0);
+                vst1q_f32(t + y * 8 + 4, a1);
+            }
+
+            for (int y = 0; y < 8; y++) {
+                float32x4_t a0 = vdupq_n_f32(0.0f), a1 = vdupq_n_f32(0.0f);
+                for (int k = 0; k < 8; k++) {
+                    a0 = vmlaq_n_f32(a0, c[k][0], t[y * 8 + k]);
+                    a1 = vmlaq_n_f32(a1, c[k][1], t[y * 8 + k]);
+                }
+                vst1q_s16(b + y * 8, vcombine_s16(vqmovn_s32(vcvtq_s32_f32(a0)), vqmovn_s32(vcvtq_s32_f32(a1))));
+            }
+        #else
             float t[64];
 
             for (int x = 0; x < 8; x++)
@@ -1001,6 +1122,7 @@ struct Video {
                              + t[6 + i] * STR_IDCT[x + 6 * 8]
                              + t[7 + i] * STR_IDCT[x + 7 * 8]);
                 }
+        #endif
         }
 
         virtual bool decodeVideo(Color32 *pixels) {
@@ -1012,6 +1134,7 @@ struct Video {
             }
 
             VideoChunk *chunk = videoChunks + (curVideoChunk % MAX_CHUNKS);
+            frameChunk = curVideoChunk;
 
             BitStream bs(chunk->data + 8, chunk->size - 8); // make bitstream without frame header
 
@@ -1073,25 +1196,24 @@ struct Video {
 
             int i = 0;
             while (i < count) {
-                if (xa->pos >= COUNT(xa->buffer)) {
-                    curAudioChunk++;
-                    while (curAudioChunk >= audioChunksCount) {
-                        if (!nextChunk()) {
-                            curAudioChunk--;
-                            memset(frames, 0, count * sizeof(Sound::Frame));
-                            return count;
-                        }
-                    }
+                if (xa->pos < COUNT(xa->buffer)) {
+                    xa->stream = NULL; // the rest of the decoded sector
+                    i += audioDecoder->decode(&frames[i], count - i);
+                    continue;
+                }
+
+                AudioPacket *packet = peekAudio();
+                if (!packet) { // the next sector isn't read yet
+                    memset(&frames[i], 0, (count - i) * sizeof(Sound::Frame));
+                    break;
                 }
 
-                AudioChunk *chunk = audioChunks + (curAudioChunk % MAX_CHUNKS);
-                ASSERT(chunk->size > 0);
-                Stream *memStream = new Stream(NULL, chunk->data, AUDIO_SECTOR_SIZE);
-                audioDecoder->stream = memStream;
+                Stream memStream(NULL, packet->data, packet->size);
+                audioDecoder->stream = &memStream;
 
                 i += audioDecoder->decode(&frames[i], count - i);
 
-                delete memStream;
+                releaseAudio(); // the whole sector is decoded into the XA buffer
             }
 
             return count;
@@ -1108,15 +1230,15 @@ struct Video {
         } *chunks;
 
         int chunksCount;
-        int audioChunkIndex;
-        int audioChunkPos;
-        Array<Sound::Frame> audioChunkFrames;
+        volatile int  audioChunkIndex; // last audio chunk read by the video side
+        int           audioChunkPos;   // mixer position in the front packet, in frames
+        volatile bool audioEnd;        // all audio chunks are played
 
         int videoChunkIndex;
         int videoChunkPos;
         Array<uint8> videoChunkData;
 
-        Cinepak(Stream *stream) : Decoder(stream), chunks(NULL), audioChunkIndex(-1), audioChunkPos(0), videoChunkIndex(-1), videoChunkPos(0) {
+        Cinepak(Stream *stream) : Decoder(stream), chunks(NULL), audioChunkIndex(-1), audioChunkPos(0), audioEnd(false), videoChunkIndex(-1), videoChunkPos(0) {
             ASSERTV(stream->readLE32() == FOURCC("FILM"));
             int sampleOffset = stream->readBE32();
             stream->seek(4); // skip version 1.06
@@ -1153,9 +1275,34 @@ struct Video {
             delete[] chunks;  
         }
 
+        void readAudio() {
+            while (audioChunkIndex < chunksCount) {
+                int index = audioChunkIndex + 1;
+                while (index < chunksCount && chunks[index].info[0] != 0xFFFFFFFF)
+                    index++;
+
+                if (index >= chunksCount) {
+                    audioChunkIndex = index;
+                    break;
+                }
+
+                const Chunk &chunk = chunks[index];
+                AudioPacket *packet = allocAudio(chunk.size, index);
+                if (!packet)
+                    break; // the mixer is behind, read it on the next frame
+                audioChunkIndex = index;
+
+                stream->setPos(chunk.offset);
+                stream->raw(packet->data, packet->size);
+                pushAudio(packet);
+            }
+        }
+
         virtual bool decodeVideo(Color32 *pixels) {
-            if (audioChunkIndex >= chunksCount)
+            if (audioEnd)
                 return false;
+
+            readAudio();
             /*
             // TODO: sega cinepak film decoder
             // get next audio chunk
@@ -1172,12 +1319,9 @@ struct Video {
 
                 const Chunk &chunk = chunks[videoChunkIndex];
 
-                {
-                    OS_LOCK(Sound::lock);
-                    stream->setPos(chunk.offset);
-                    videoChunkData.resize(chunk.size);
-                    stream->raw(videoChunkData.items, videoChunkData.length);
-                }
+                stream->setPos(chunk.offset);
+                videoChunkData.resize(chunk.size);
+                stream->raw(videoChunkData.items, videoChunkData.length);
             }
 
             // TODO: decode
@@ -1203,44 +1347,35 @@ struct Video {
         }
 
         virtual int decode(Sound::Frame *frames, int count) {
-            if (audioChunkIndex >= chunksCount) {
+            bool readEnd = audioChunkIndex >= chunksCount; // before the peek, the last packet is pushed before the end is set
+            MEMORY_BARRIER();
+            AudioPacket *packet = peekAudio();
+
+            if (!packet) {
+                if (readEnd)
+                    audioEnd = true; // all chunks are played, stops the video
                 memset(frames, 0, count * sizeof(Sound::Frame));
                 return count;
             }
 
-            // get next audio chunk
-            if (audioChunkPos >= audioChunkFrames.length) {
-                audioChunkPos = 0;
-
-                while (++audioChunkIndex < chunksCount) {
-                    if (chunks[audioChunkIndex].info[0] == 0xFFFFFFFF)
-                        break;
-                }
-
-                if (audioChunkIndex >= chunksCount) {
-                    memset(frames, 0, count);
-                    return count;
-                }
-
-                const Chunk &chunk = chunks[audioChunkIndex];
-
-                audioChunkFrames.resize(chunk.size / sizeof(Sound::Frame));
-
-                stream->setPos(chunk.offset);
-                // read LEFT channel samples
-                for (int i = 0; i < audioChunkFrames.length; i++)
-                    audioChunkFrames[i].L = stream->readBE16();
-                // read RIGHT channel samples
-                for (int i = 0; i < audioChunkFrames.length; i++)
-                    audioChunkFrames[i].R = stream->readBE16();
-            }
+            // LEFT channel samples followed by RIGHT channel samples
+            int    length = packet->size / sizeof(Sound::Frame);
+            uint16 *data  = (uint16*)packet->data;
 
             for (int i = 0; i < count; i += 2) {
-                frames[i + 0] = audioChunkFrames[audioChunkPos];
-                frames[i + 1] = audioChunkFrames[audioChunkPos++];
+                Sound::Frame frame;
+                frame.L = swap16(data[audioChunkPos]);
+                frame.R = swap16(data[length + audioChunkPos]);
+                audioChunkPos++;
+
+                frames[i + 0] = frame;
+                frames[i + 1] = frame;
 
-                if (audioChunkPos >= audioChunkFrames.length)
+                if (audioChunkPos >= length) {
+                    audioChunkPos = 0;
+                    releaseAudio();
                     return i + 2;
+                }
             }
 
             return count;
@@ -1255,57 +1390,153 @@ struct Video {
 
     Decoder *decoder;
     Texture *frameTex[2];
-    Color32 *frameData;
+    Color32 *frameData; // presented frame
     float   step, stepTimer, time;
     bool    isPlaying;
     bool    needUpdate;
     Sound::Sample *sample;
+    uint32        sampleGeneration;
+
+    struct Frame {
+        Color32 *pixels;
+        int     chunk;
+        bool    valid; // false marks the end of the video
+    } frames[VIDEO_RING_SIZE];
 
-    Video(Stream *stream) : decoder(NULL), stepTimer(0.0f), time(0.0f), isPlaying(false) {
+    int frameIndex; // slot of the presented frame or -1
+
+    Jobs::Background worker;
+    Jobs::Event      workerEvent;
+    volatile bool    workerQuit;
+    RingQueue<int, VIDEO_RING_SIZE + 1> freeFrames;  // game thread -> worker
+    RingQueue<int, VIDEO_RING_SIZE + 1> readyFrames; // worker -> game thread, in decoding order
+
+    Video(Stream *stream) : decoder(NULL), frameData(NULL), stepTimer(0.0f), time(0.0f), isPlaying(false), needUpdate(false), sample(NULL), frameIndex(-1), workerQuit(false) {
         frameTex[0] = frameTex[1] = NULL;
+        worker.active = false;
+
+        for (int i = 0; i < VIDEO_RING_SIZE; i++)
+            frames[i].pixels = NULL;
 
         if (!stream) return;
 
-        uint32 magic = stream->readLE32();
-        stream->seek(-4);
+        decoder = createDecoder(stream, format);
 
         float pitch = 1.0f;
-
-        if (magic == FOURCC("FILM")) {
-            format  = SAT;
-            decoder = new Cinepak(stream);
+        if (format == SAT)
             pitch = decoder->freq / 22050.0f; // 22254 / 22050 = 1.00925
-        } else if (magic == FOURCC("ARMo")) {
-            format  = PC;
-            decoder = new Escape(stream);
-        } else {
-            format  = PSX;
-            decoder = new STR(stream);
-        }
 
-        frameData = new Color32[decoder->width * decoder->height];
-        memset(frameData, 0, decoder->width * decoder->height * sizeof(Color32));
+        int size = decoder->width * decoder->height;
+        for (int i = 0; i < VIDEO_RING_SIZE; i++) {
+            frames[i].pixels = new Color32[size];
+            memset(frames[i].pixels, 0, size * sizeof(Color32));
+        }
+        frameData = frames[0].pixels;
 
         for (int i = 0; i < 2; i++)
             frameTex[i] = new Texture(decoder->width, decoder->height, 1, FMT_RGBA, 0, frameData);
 
-        sample = Sound::play(decoder);
-        sample->pitch = pitch;
+        sample = Sound::play(decoder, pitch);
+        if (sample)
+            sampleGeneration = sample->generation;
 
         step      = 1.0f / decoder->fps;
         stepTimer = step;
         time      = 0.0f;
         isPlaying = true;
+
+    #ifndef VIDEO_TEST
+        if (VIDEO_RING_SIZE > 1) {
+            for (int i = 0; i < VIDEO_RING_SIZE; i++)
+                freeFrames.push(i);
+            Jobs::startBackground(worker, decodeProc, this);
+        }
+    #endif
     }
 
     virtual ~Video() {
-        OS_LOCK(Sound::lock);
-        sample->decoder = NULL;
-        sample->stop();
-        delete decoder;
+        if (worker.active) {
+            workerQuit = true;
+            workerEvent.signal();
+            Jobs::wait(worker);
+        }
+
+    // the mixer may still decode the audio, the voice takes the decoder and deletes it when released
+    // if the voice is back in the pool (finished or stolen), the mixer is done with the decoder already
+        if (sample && sample->generation == sampleGeneration) {
+            sample->external = false;
+            sample->stop();
+        } else
+            delete decoder;
+
         delete frameTex[0];
         delete frameTex[1];
-        delete[] frameData;
+        for (int i = 0; i < VIDEO_RING_SIZE; i++)
+            delete[] frames[i].pixels;
+    }
+
+    static Decoder* createDecoder(Stream *stream, Format &format) {
+        uint32 magic = stream->readLE32();
+        stream->seek(-4);
+
+        if (magic == FOURCC("FILM")) {
+            format = SAT;
+            return new Cinepak(stream);
+        }
+
+        if (magic == FOURCC("ARMo")) {
+            format = PC;
+            return new Escape(stream);
+        }
+
+        format = PSX;
+        return new STR(stream);
+    }
+
+    bool decodeFrame(Frame &frame) {
+        frame.valid = decoder->decodeVideo(frame.pixels);
+        frame.chunk = decoder->frameChunk;
+        return frame.valid;
+    }
+
+    // worker thread, keeps the free slots of the ring filled by the next frames
+    static void decodeProc(void *userData) {
+        Video *video = (Video*)userData;
+
+        while (!video->workerQuit) {
+            int index;
+            if (!video->freeFrames.pop(index)) {
+                video->workerEvent.wait();
+                continue;
+            }
+
+            bool valid = video->decodeFrame(video->frames[index]);
+            video->readyFrames.push(index);
+
+            if (!valid)
+                break;
+        }
+    }
+
+    bool nextFrame() {
+        if (!worker.active) {
+            frameIndex = 0;
+            return decodeFrame(frames[frameIndex]);
+        }
+
+        int index;
+        if (!readyFrames.pop(index))
+            return true; // the worker is late, keep the current frame
+
+        if (!frames[index].valid)
+            return false;
+
+        if (frameIndex != -1) {
+            freeFrames.push(frameIndex);
+            workerEvent.signal();
+        }
+        frameIndex = index;
+        return true;
     }
 
     void update() {
@@ -1322,7 +1553,18 @@ struct Video {
         LOG("time: %d\n", Core::getTime() - t);
         isPlaying = false;
     #else
-        isPlaying = needUpdate = decoder->decodeVideo(frameData);
+        int index = frameIndex;
+        isPlaying = nextFrame();
+
+        if (frameIndex != index || !worker.active) {
+            Frame &frame = frames[frameIndex];
+            frameData  = frame.pixels;
+            needUpdate = isPlaying;
+            decoder->shownChunk = frame.chunk;
+        } else if (isPlaying) { // no decoded frame yet, retry on the next tick to stay in sync with the audio
+            stepTimer += step;
+            time      -= step;
+        }
     #endif
     }
 